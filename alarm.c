@@ -0,0 +1,410 @@
+/*
+ * alarm.c - Detect fan faults
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "conf.h"
+#include "board.h"
+#include "alarm.h"
+
+
+/*
+ * Speed conditions are judged on the RPM smoothed with this time constant,
+ * since a 100 ms window holds only a few tacho edges at low speed. They must
+ * persist for RAISE_S before we raise the alarm. Stall detection is based on
+ * time already, and does not wait. All alarms clear once the condition has
+ * been absent for CLEAR_S.
+ *
+ * While we can't judge a condition, e.g., during spin-up, while the fan
+ * settles after a duty cycle change, or before we have learned the expected
+ * RPM, it keeps its state. Only time in which we have judged the condition
+ * absent counts towards clearing it.
+ */
+
+#define	SMOOTH_S	0.5
+#define	RAISE_S		0.3
+#define	CLEAR_S		1
+
+/*
+ * A learned RPM is used once we have seen the fan settled at that duty cycle
+ * for this many checks (5 s).
+ */
+
+#define	LEARN_SAMPLES	50
+
+
+struct setting {
+	const char *name;	/* fan group */
+	unsigned mask;		/* 1 << SET_x of the settings given */
+	struct alarm_settings set;
+	struct setting *next;
+};
+
+enum {
+	SET_STALL,
+	SET_SPINUP,
+	SET_SETTLE,
+	SET_ENVELOPE,
+	SET_TOLERANCE,
+	SET_MAX_RPM,
+	SET_IMBALANCE,
+	SET_ACTION,
+};
+
+
+const char *const alarm_names[alarm_n_conds] = {
+	[alarm_stall]		= "stall",
+	[alarm_under]		= "under-speed",
+	[alarm_over]		= "over-speed",
+	[alarm_imbalance]	= "imbalance",
+};
+
+static const struct alarm_settings defaults = {
+	.stall_s	= 0.3,
+	.spinup_s	= 3,
+	.settle_s	= 5,
+	.tolerance	= 0.25,
+	.imbalance	= 0.2,
+	.max_rpm	= 0,
+	.full		= 0,
+	.n_points	= 0,
+};
+
+static struct setting *settings = NULL;
+static struct setting **last_setting = &settings;
+
+
+/* ----- Configuration ----------------------------------------------------- */
+
+
+static double number(const char *s, const char *what, const char *suffix)
+{
+	char *end;
+	double n;
+
+	n = strtod(s, &end);
+	if (end == s || strcmp(end, suffix) || n < 0)
+		conf_error("invalid %s \"%s\"", what, s);
+	return n;
+}
+
+
+static void envelope(struct alarm_settings *set, const char *s)
+{
+	int n;
+
+	set->n_points = 0;
+	while (1) {
+		if (set->n_points == ALARM_MAX_POINTS)
+			conf_error("too many points");
+		if (sscanf(s, "%lf:%lf%n", &set->points[set->n_points].duty,
+		    &set->points[set->n_points].rpm, &n) != 2)
+			conf_error("invalid point \"%s\"", s);
+		if (set->n_points &&
+		    set->points[set->n_points].duty <=
+		    set->points[set->n_points - 1].duty)
+			conf_error("duty cycles must increase");
+		set->n_points++;
+		s += n;
+		if (!*s)
+			break;
+		if (*s != ',')
+			conf_error("invalid envelope \"%s\"", s);
+		s++;
+	}
+}
+
+
+static void conf_alarm(int argc, char *const *argv)
+{
+	struct setting *st;
+	struct alarm_settings *set;
+	int i;
+
+	if (!(argc & 1))
+		conf_error("settings come in pairs");
+	st = calloc(1, sizeof(*st));
+	if (!st) {
+		perror("calloc");
+		exit(1);
+	}
+	st->name = strdup(argv[0]);
+	if (!st->name) {
+		perror("strdup");
+		exit(1);
+	}
+	set = &st->set;
+	for (i = 1; i != argc; i += 2) {
+		const char *name = argv[i];
+		const char *value = argv[i + 1];
+
+		if (!strcmp(name, "stall")) {
+			set->stall_s = number(value, name, "") / 1000;
+			st->mask |= 1 << SET_STALL;
+		} else if (!strcmp(name, "spinup")) {
+			set->spinup_s = number(value, name, "");
+			st->mask |= 1 << SET_SPINUP;
+		} else if (!strcmp(name, "settle")) {
+			set->settle_s = number(value, name, "");
+			st->mask |= 1 << SET_SETTLE;
+		} else if (!strcmp(name, "envelope")) {
+			envelope(set, value);
+			st->mask |= 1 << SET_ENVELOPE;
+		} else if (!strcmp(name, "tolerance")) {
+			set->tolerance = number(value, name, "%") / 100;
+			st->mask |= 1 << SET_TOLERANCE;
+		} else if (!strcmp(name, "max-rpm")) {
+			set->max_rpm = number(value, name, "");
+			st->mask |= 1 << SET_MAX_RPM;
+		} else if (!strcmp(name, "imbalance")) {
+			set->imbalance = number(value, name, "%") / 100;
+			st->mask |= 1 << SET_IMBALANCE;
+		} else if (!strcmp(name, "action")) {
+			if (!strcmp(value, "report"))
+				set->full = 0;
+			else if (!strcmp(value, "full"))
+				set->full = 1;
+			else
+				conf_error("action must be report or full");
+			st->mask |= 1 << SET_ACTION;
+		} else {
+			conf_error("unknown setting \"%s\"", name);
+		}
+	}
+	*last_setting = st;
+	last_setting = &st->next;
+}
+
+
+const struct conf_keyword alarm_conf[] = {
+	{ "alarm",	3, 19,	conf_alarm },
+	{ NULL, 0, 0, NULL }
+};
+
+
+static void apply(struct alarm_settings *to, const struct setting *st)
+{
+	const struct alarm_settings *from = &st->set;
+
+	if (st->mask & 1 << SET_STALL)
+		to->stall_s = from->stall_s;
+	if (st->mask & 1 << SET_SPINUP)
+		to->spinup_s = from->spinup_s;
+	if (st->mask & 1 << SET_SETTLE)
+		to->settle_s = from->settle_s;
+	if (st->mask & 1 << SET_ENVELOPE) {
+		to->n_points = from->n_points;
+		memcpy(to->points, from->points, sizeof(to->points));
+	}
+	if (st->mask & 1 << SET_TOLERANCE)
+		to->tolerance = from->tolerance;
+	if (st->mask & 1 << SET_MAX_RPM)
+		to->max_rpm = from->max_rpm;
+	if (st->mask & 1 << SET_IMBALANCE)
+		to->imbalance = from->imbalance;
+	if (st->mask & 1 << SET_ACTION)
+		to->full = from->full;
+}
+
+
+/* ----- Detection --------------------------------------------------------- */
+
+
+void alarm_init(struct alarm_fan *a, const struct board *board, unsigned ch,
+    unsigned n_tachos)
+{
+	const struct setting *st;
+	unsigned channels;
+
+	memset(a, 0, sizeof(*a));
+	a->set = defaults;
+	for (st = settings; st; st = st->next) {
+		channels = board_channels(board, st->name);
+		if (!channels) {
+			fprintf(stderr, "unknown fan group \"%s\"\n", st->name);
+			exit(1);
+		}
+		if (channels & 1 << ch)
+			apply(&a->set, st);
+	}
+	a->n_tachos = n_tachos;
+}
+
+
+void alarm_duty(struct alarm_fan *a, double duty, uint64_t now)
+{
+	unsigned i;
+
+	if (duty == a->duty)
+		return;
+	if (!a->duty) {
+		a->start_ns = now;
+		for (i = 0; i != a->n_tachos; i++)
+			a->tachos[i].moving_ns = now;
+	}
+	a->duty = duty;
+	/* forcing the fan to 100% does not start a settle window */
+	if (!a->forced)
+		a->duty_ns = now;
+}
+
+
+/*
+ * While the fan is forced to 100%, it does not run at the duty cycle the
+ * speed conditions refer to, so we don't judge them, and we don't learn.
+ */
+
+void alarm_force(struct alarm_fan *a, bool on)
+{
+	a->forced = on;
+}
+
+
+/*
+ * Expected RPM of tacho "t" at the current duty cycle. 0 if we don't know.
+ */
+
+static double expected(const struct alarm_fan *a, const struct alarm_tacho *t)
+{
+	const struct alarm_settings *set = &a->set;
+	unsigned bin, i;
+	double f;
+
+	if (!set->n_points) {
+		bin = (a->duty + ALARM_LEARN_STEP / 2.0) / ALARM_LEARN_STEP;
+		return t->samples[bin] < LEARN_SAMPLES ? 0 : t->learned[bin];
+	}
+	if (a->duty <= set->points[0].duty)
+		return set->points[0].rpm;
+	for (i = 1; i != set->n_points; i++)
+		if (a->duty < set->points[i].duty) {
+			f = (a->duty - set->points[i - 1].duty) /
+			    (set->points[i].duty - set->points[i - 1].duty);
+			return set->points[i - 1].rpm +
+			    f * (set->points[i].rpm - set->points[i - 1].rpm);
+		}
+	return set->points[set->n_points - 1].rpm;
+}
+
+
+static void learn(struct alarm_fan *a, struct alarm_tacho *t)
+{
+	unsigned bin = (a->duty + ALARM_LEARN_STEP / 2.0) / ALARM_LEARN_STEP;
+
+	if (a->set.n_points || t->samples[bin] >= LEARN_SAMPLES)
+		return;
+	t->samples[bin]++;
+	t->learned[bin] += (t->rpm - t->learned[bin]) / t->samples[bin];
+}
+
+
+static bool debounce(struct alarm_fan *a, enum alarm_cond c, bool raw,
+    bool known, uint64_t now)
+{
+	bool old = a->cond[c];
+
+	if (!raw && !known) {
+		a->since_ns[c] = 0;
+		if (a->cond[c])
+			a->clear_ns[c] = now;
+		return 0;
+	}
+	if (raw) {
+		if (!a->since_ns[c])
+			a->since_ns[c] = now;
+		if (c == alarm_stall || now - a->since_ns[c] >= RAISE_S * 1e9)
+			a->cond[c] = 1;
+		a->clear_ns[c] = now;
+	} else {
+		a->since_ns[c] = 0;
+		if (a->cond[c] && now - a->clear_ns[c] >= CLEAR_S * 1e9)
+			a->cond[c] = 0;
+	}
+	return a->cond[c] != old;
+}
+
+
+bool alarm_check(struct alarm_fan *a, const double *rpm, uint64_t now)
+{
+	const struct alarm_settings *set = &a->set;
+	bool raw[alarm_n_conds] = { 0 };
+	bool known[alarm_n_conds];
+	bool running, settled, judged, changed = 0;
+	double min = 0, max = 0, exp;
+	struct alarm_tacho *t;
+	unsigned i;
+
+	running = a->duty && now - a->start_ns >= set->spinup_s * 1e9;
+	settled = running && !a->forced &&
+	    now - a->duty_ns >= set->settle_s * 1e9;
+	judged = settled;
+
+	for (i = 0; i != a->n_tachos; i++) {
+		t = a->tachos + i;
+		t->rpm += (rpm[i] - t->rpm) * ALARM_CHECK_S / SMOOTH_S;
+		if (rpm[i] || !a->duty)
+			t->moving_ns = now;
+		else if (running && now - t->moving_ns >= set->stall_s * 1e9)
+			raw[alarm_stall] = 1;
+		if (set->max_rpm && rpm[i] > set->max_rpm)
+			raw[alarm_over] = 1;
+		if (!i || t->rpm < min)
+			min = t->rpm;
+		if (!i || t->rpm > max)
+			max = t->rpm;
+		if (!settled)
+			continue;
+		exp = expected(a, t);
+		if (!exp)
+			judged = 0;
+		if (exp && t->rpm < exp * (1 - set->tolerance))
+			raw[alarm_under] = 1;
+		if (exp && t->rpm > exp * (1 + set->tolerance))
+			raw[alarm_over] = 1;
+	}
+	if (settled && a->n_tachos > 1 && !raw[alarm_stall] &&
+	    max - min > max * set->imbalance)
+		raw[alarm_imbalance] = 1;
+
+	known[alarm_stall] = running;
+	known[alarm_under] = judged;
+	known[alarm_over] = judged;
+	known[alarm_imbalance] = settled && !raw[alarm_stall];
+	for (i = 0; i != alarm_n_conds; i++)
+		if (debounce(a, i, raw[i], known[i], now))
+			changed = 1;
+
+	/*
+	 * Conditions we can't judge yet must not keep us from learning, or
+	 * they would never clear.
+	 */
+	if (!settled)
+		return changed;
+	for (i = 0; i != alarm_n_conds; i++)
+		if (raw[i] || (a->cond[i] && known[i]))
+			return changed;
+	for (i = 0; i != a->n_tachos; i++)
+		learn(a, a->tachos + i);
+	return changed;
+}
+
+
+bool alarm_active(const struct alarm_fan *a)
+{
+	unsigned i;
+
+	for (i = 0; i != alarm_n_conds; i++)
+		if (a->cond[i])
+			return 1;
+	return 0;
+}
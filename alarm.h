@@ -0,0 +1,152 @@
+/*
+ * alarm.h - Detect fan faults
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef ALARM_H
+#define	ALARM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "conf.h"
+#include "board.h"
+
+
+/*
+ * Conditions. Stall, under-speed, and over-speed apply to each tacho,
+ * imbalance to the tachos of a fan among each other.
+ */
+
+enum alarm_cond {
+	alarm_stall,		/* no tacho edges for "stall" ms */
+	alarm_under,		/* RPM below the expected range */
+	alarm_over,		/* RPM above the expected range, or noise */
+	alarm_imbalance,	/* tachos of one fan disagree */
+	alarm_n_conds
+};
+
+#define	ALARM_CHECK_S		0.1
+
+#define	ALARM_MAX_POINTS	11
+
+
+struct alarm_settings {
+	double stall_s;		/* no edges for this long = stall */
+	double spinup_s;	/* grace period when starting from 0% */
+	double settle_s;	/* time to reach speed after a duty change */
+	double tolerance;	/* fraction of the expected RPM */
+	double imbalance;	/* fraction of the faster tacho */
+	double max_rpm;		/* 0 if no absolute limit */
+	bool full;		/* run the other fans at 100% on alarm */
+	unsigned n_points;	/* expected RPM vs. duty; learned if 0 */
+	struct {
+		double duty;
+		double rpm;
+	} points[ALARM_MAX_POINTS];
+};
+
+/*
+ * Without an envelope, we learn the RPM of each tacho at duty cycles in steps
+ * of ALARM_LEARN_STEP percent, once the fan has settled.
+ */
+
+#define	ALARM_LEARN_STEP	5
+#define	ALARM_LEARN_BINS	(100 / ALARM_LEARN_STEP + 1)
+
+struct alarm_tacho {
+	double rpm;		/* smoothed */
+	uint64_t moving_ns;	/* last time we saw edges */
+	double learned[ALARM_LEARN_BINS];
+	unsigned samples[ALARM_LEARN_BINS];
+};
+
+struct alarm_fan {
+	struct alarm_settings set;
+	double duty;
+	uint64_t duty_ns;	/* when the duty cycle last changed */
+	uint64_t start_ns;	/* when the fan was last started from 0% */
+	struct alarm_tacho tachos[BOARD_MAX_TACHOS];
+	unsigned n_tachos;
+	bool forced;		/* at 100% because of an alarm or watchdog */
+	bool cond[alarm_n_conds];	/* any tacho, after debouncing */
+	uint64_t since_ns[alarm_n_conds]; /* raw condition first seen */
+	uint64_t clear_ns[alarm_n_conds]; /* raw condition last seen */
+};
+
+
+/*
+ * Configuration:
+ *
+ * alarm GROUP SETTING VALUE ...
+ *	Fault detection for the fan group (a fan name or alias, or all).
+ *	Settings:
+ *
+ *	stall MS	no tacho edges for this long while the duty cycle is
+ *			not 0 is a stall. Default: 300 ms.
+ *	spinup S	grace period for stall detection after starting from
+ *			0%. Default: 3 s.
+ *	settle S	wait this long after a duty cycle change before
+ *			judging the speed. Default: 5 s.
+ *	envelope DUTY:RPM,...
+ *			expected RPM at the given duty cycles (interpolated).
+ *			Default: learn the RPM at each duty cycle.
+ *	tolerance N%	allowed deviation from the expected RPM before we
+ *			report under- or over-speed. Default: 25%.
+ *	max-rpm N	any reading above this is over-speed (e.g., tacho
+ *			noise). Default: no limit.
+ *	imbalance N%	allowed difference between the tachos of a fan,
+ *			relative to the faster one. Default: 20%.
+ *	action report|full
+ *			"full" runs all fans that are not stalled at 100%
+ *			while an alarm of the group is active. Default:
+ *			report.
+ */
+
+extern const struct conf_keyword alarm_conf[];
+
+
+extern const char *const alarm_names[alarm_n_conds];
+
+
+/*
+ * Set up fault detection for channel "ch" of the board, which is at 0%. Exits
+ * if the configuration names an unknown group.
+ */
+
+void alarm_init(struct alarm_fan *a, const struct board *board, unsigned ch,
+    unsigned n_tachos);
+
+/*
+ * Tell the detector about a new duty cycle (0-100).
+ */
+
+void alarm_duty(struct alarm_fan *a, double duty, uint64_t now);
+
+/*
+ * Tell the detector that the fan is (no longer) forced to 100%. Call this
+ * before changing the duty cycle. Under-speed, over-speed (other than above
+ * max-rpm), and imbalance keep their state while the fan is forced, so an
+ * alarm that forces its own fan to 100% stays active.
+ */
+
+void alarm_force(struct alarm_fan *a, bool on);
+
+/*
+ * Judge the RPM of each tacho, measured over the last ALARM_CHECK_S. Returns
+ * 1 if any condition of the fan has changed.
+ */
+
+bool alarm_check(struct alarm_fan *a, const double *rpm, uint64_t now);
+
+/*
+ * 1 if any condition of the fan is active.
+ */
+
+bool alarm_active(const struct alarm_fan *a);
+
+#endif /* !ALARM_H */
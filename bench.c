@@ -0,0 +1,439 @@
+/*
+ * bench.c - Microbenchmarks and soak test of fand's hot paths
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * Runs the code fand executes on incoming commands and on each poll tick
+ * against a stand-in for libmosquitto and a register image in RAM, and
+ * reports the time per operation, the number of heap allocations per
+ * operation, and the rate of MQTT messages published. Allocations should be
+ * zero.
+ *
+ * Heap allocations are counted by wrapping malloc & co. at link time
+ * (-Wl,--wrap=...). Allocations libmosquitto makes for its packets are not
+ * included, since they happen in the real library.
+ *
+ * The soak test (-s) runs a mix of all paths for hours, and reports the
+ * resident set size, the number of open file descriptors, and the number of
+ * heap allocations, none of which should grow.
+ */
+
+#define _GNU_SOURCE	/* for memfd_create */
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include "mono.h"
+#include "regmap.h"
+#include "pub.h"
+#include "state.h"
+#include "mosqstub.h"
+#include "benchfand.h"
+
+
+#define	DEFAULT_TICKS		1000000
+#define	DEFAULT_GENERATION	2
+#define	DEFAULT_PCLK		111111111	/* Hz */
+#define	DEFAULT_REPORT_S	60		/* soak test */
+#define	RSS_SLACK_KB		64		/* soak test */
+
+#define	N_TOPICS	6	/* gen 2: two PWM and four RPM topics */
+#define	MAX_STATE_MSG	256
+#define	TACHO_EDGES	100	/* per poll, i.e., 3000 RPM at 1 Hz */
+
+#define	DUTY_A		40
+#define	DUTY_B		80
+
+
+/* ----- Allocation counting ----------------------------------------------- */
+
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+void __wrap_free(void *ptr);
+
+
+static unsigned long allocs = 0;
+
+
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	return __real_malloc(size);
+}
+
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __real_realloc(ptr, size);
+}
+
+
+void __wrap_free(void *ptr)
+{
+	__real_free(ptr);
+}
+
+
+/* ----- Benchmarks -------------------------------------------------------- */
+
+
+static struct pub_topic *topics[N_TOPICS];
+
+
+static uint64_t bench_t0;
+static unsigned long bench_allocs0, bench_published0;
+
+
+static void start(void)
+{
+	bench_allocs0 = allocs;
+	bench_published0 = mosqstub_published;
+	bench_t0 = mono_ns();
+}
+
+
+static void report(const char *name, unsigned long n)
+{
+	uint64_t dt = mono_ns() - bench_t0;
+	unsigned long published = mosqstub_published - bench_published0;
+
+	printf("%-20s %8.1f ns/op %8.3f allocs/op", name,
+	    (double) dt / n, (double) (allocs - bench_allocs0) / n);
+	if (published)
+		printf(" %10.0f msgs/s", published / (dt * 1e-9));
+	printf("\n");
+}
+
+
+static void bench_update(unsigned long n)
+{
+	unsigned long i;
+	unsigned j;
+
+	start();
+	/* the value changes on each tick, so every update gets published */
+	for (i = 0; i != n; i++)
+		for (j = 0; j != N_TOPICS; j++)
+			pub_update(NULL, topics[j], 1000 + (i & 1023));
+	report("pub_update", n * N_TOPICS);
+}
+
+
+static void bench_state(unsigned long n, enum state_format format,
+    const char *name)
+{
+	struct state_fan fans[2] = {
+		{ "front", 50, 2, { 4000, 4100 }, FAN_F_RPM_CTL },
+		{ "rear", 60, 2, { 5000, 5100 }, 0 },
+	};
+	uint8_t buf[MAX_STATE_MSG];
+	unsigned long i;
+	size_t len;
+
+	start();
+	for (i = 0; i != n; i++) {
+		fans[0].rpm[0] = 4000 + (i & 1023);
+		len = state_encode(format, buf, sizeof(buf), i, fans, 2);
+		if (!len)
+			abort();
+		pub_send_raw(NULL, topics[0], buf, len);
+	}
+	if (name)
+		report(name, n);
+}
+
+
+/* ----- fand ------------------------------------------------------------- */
+
+
+static void bench_rpm_poll(unsigned long n)
+{
+	unsigned fans = benchfand_fans();
+	unsigned long i;
+
+	start();
+	for (i = 0; i != n; i++)
+		benchfand_rpm_poll(i % fans, 0);
+	report("rpm_poll", n);
+}
+
+
+static void bench_set_pwm(unsigned long n)
+{
+	unsigned fans = benchfand_fans();
+	unsigned long i;
+
+	start();
+	for (i = 0; i != n; i++)
+		benchfand_set_pwm(mosqstub_mosq, i % fans,
+		    i / fans & 1 ? DUTY_A : DUTY_B);
+	report("set_pwm", n);
+}
+
+
+static void bench_parse_pwm(unsigned long n)
+{
+	unsigned long i;
+
+	start();
+	for (i = 0; i != n; i++)
+		benchfand_parse_pwm(mosqstub_mosq, i & 1 ? "40" : "80");
+	report("parse_pwm (all)", n);
+}
+
+
+static void bench_cb(unsigned long n)
+{
+	unsigned long i;
+
+	start();
+	for (i = 0; i != n; i++)
+		benchfand_cb(mosqstub_mosq, "/fan/all/pwm-set",
+		    i & 1 ? "40" : "80");
+	report("cb (pwm-set)", n);
+}
+
+
+static void bench_poll(unsigned long n)
+{
+	unsigned long i;
+
+	start();
+	for (i = 0; i != n; i++) {
+		benchfand_turn(TACHO_EDGES);
+		benchfand_poll(mosqstub_mosq);
+	}
+	report("poll tick", n);
+}
+
+
+/* ----- Soak test --------------------------------------------------------- */
+
+
+static unsigned long rss_kb(void)
+{
+	unsigned long size, resident;
+	FILE *file;
+
+	file = fopen("/proc/self/statm", "r");
+	if (!file) {
+		perror("/proc/self/statm");
+		exit(1);
+	}
+	if (fscanf(file, "%lu %lu", &size, &resident) != 2) {
+		fprintf(stderr, "/proc/self/statm: bad format\n");
+		exit(1);
+	}
+	fclose(file);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+/* not counting the one we use for counting */
+
+static unsigned open_fds(void)
+{
+	const struct dirent *de;
+	unsigned n = 0;
+	DIR *dir;
+
+	dir = opendir("/proc/self/fd");
+	if (!dir) {
+		perror("/proc/self/fd");
+		exit(1);
+	}
+	while ((de = readdir(dir)))
+		if (*de->d_name != '.')
+			n++;
+	closedir(dir);
+	return n - 1;
+}
+
+
+/*
+ * Each round is one poll tick, a pwm-set for all fans, and the publication of
+ * a state message. We take the baseline at the first report, after everything
+ * has been touched at least once. The RSS may still move by a page or two,
+ * e.g., when stdio or the stack grow, so we allow for RSS_SLACK_KB.
+ */
+
+static bool soak(double hours, double report_s)
+{
+	uint64_t t0 = mono_ns();
+	uint64_t end = t0 + hours * 3600e9;
+	uint64_t next = t0 + report_s * 1e9;
+	unsigned long rounds = 0, rss0 = 0, rss;
+	unsigned long allocs0 = 0;
+	unsigned fds0 = 0, fds;
+	uint64_t now;
+	bool first = 1;
+
+	printf("%10s %12s %12s %10s %6s %12s\n",
+	    "time (s)", "rounds", "messages", "RSS (kB)", "fds", "allocs");
+	while (1) {
+		benchfand_turn(TACHO_EDGES);
+		benchfand_poll(mosqstub_mosq);
+		benchfand_cb(mosqstub_mosq, "/fan/all/pwm-set",
+		    rounds & 1 ? "40" : "80");
+		bench_state(1, rounds & 1 ? state_json : state_cbor, NULL);
+		rounds++;
+
+		now = mono_ns();
+		if (now < next && now < end)
+			continue;
+		rss = rss_kb();
+		fds = open_fds();
+		printf("%10.0f %12lu %12lu %10lu %6u %12lu\n",
+		    (now - t0) * 1e-9, rounds, mosqstub_published, rss, fds,
+		    allocs);
+		fflush(stdout);
+		if (first) {
+			rss0 = rss;
+			fds0 = fds;
+			allocs0 = allocs;
+			first = 0;
+		}
+		if (now >= end)
+			break;
+		next += report_s * 1e9;
+	}
+	printf("RSS %+ld kB, fds %+d, allocations %+ld\n",
+	    (long) (rss - rss0), (int) (fds - fds0), (long) (allocs - allocs0));
+	return rss <= rss0 + RSS_SLACK_KB && fds == fds0 && allocs == allocs0;
+}
+
+
+/* ----- Register image ---------------------------------------------------- */
+
+
+/*
+ * The registers live in an anonymous file in RAM, through regmap's file
+ * backend.
+ */
+
+static void register_image(void)
+{
+	static char spec[40];	/* regmap_backend keeps a pointer */
+	int fd;
+
+	fd = memfd_create("fand-bench", 0);
+	if (fd < 0) {
+		perror("memfd_create");
+		exit(1);
+	}
+	snprintf(spec, sizeof(spec), "file:/proc/self/fd/%d", fd);
+	regmap_backend(spec);
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-g generation] [-n ticks] [-P hz]\n"
+"       %s -s hours [-g generation] [-i seconds] [-P hz]\n\n"
+"  -g generation\n"
+"      board generation (default: %u)\n"
+"  -i seconds\n"
+"      report interval of the soak test (default: %u s)\n"
+"  -n ticks\n"
+"      iterations of each benchmark (default: %u)\n"
+"  -P hz\n"
+"      cpu_1x frequency for the PWM setup (default: %u Hz)\n"
+"  -s hours\n"
+"      run all paths for this long, and check that the resident set size,\n"
+"      the number of open file descriptors, and the number of heap\n"
+"      allocations do not grow. The exit status is 1 if they do.\n"
+    , name, name, DEFAULT_GENERATION, DEFAULT_REPORT_S, DEFAULT_TICKS,
+    DEFAULT_PCLK);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned long n = DEFAULT_TICKS;
+	unsigned generation = DEFAULT_GENERATION;
+	unsigned long pclk = DEFAULT_PCLK;
+	double soak_h = 0;
+	double report_s = DEFAULT_REPORT_S;
+	char *end;
+	unsigned i;
+	int c;
+
+	while ((c = getopt(argc, argv, "g:i:n:P:s:")) != EOF)
+		switch (c) {
+		case 'g':
+			generation = strtoul(optarg, &end, 0);
+			if (*end || generation > 2)
+				usage(*argv);
+			break;
+		case 'i':
+			report_s = strtod(optarg, &end);
+			if (*end || report_s <= 0)
+				usage(*argv);
+			break;
+		case 'n':
+			n = strtoul(optarg, &end, 0);
+			if (*end || !n)
+				usage(*argv);
+			break;
+		case 'P':
+			pclk = strtoul(optarg, &end, 0);
+			if (*end || !pclk)
+				usage(*argv);
+			break;
+		case 's':
+			soak_h = strtod(optarg, &end);
+			if (*end || soak_h <= 0)
+				usage(*argv);
+			break;
+		default:
+			usage(*argv);
+		}
+	if (argc != optind)
+		usage(*argv);
+
+	for (i = 0; i != N_TOPICS; i++)
+		topics[i] = pub_topic("/bench", i < 2 ? pub_pwm : pub_rpm);
+	register_image();
+	benchfand_setup(mosqstub_mosq, generation, pclk);
+
+	if (soak_h)
+		return !soak(soak_h, report_s);
+
+	bench_update(n);
+	bench_state(n, state_json, "state (JSON)");
+	bench_state(n, state_cbor, "state (CBOR)");
+	bench_rpm_poll(n);
+	bench_set_pwm(n);
+	bench_parse_pwm(n);
+	bench_cb(n);
+	bench_poll(n);
+	printf("%lu messages, %lu bytes\n", mosqstub_published, mosqstub_bytes);
+	return 0;
+}
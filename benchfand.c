@@ -0,0 +1,148 @@
+/*
+ * benchfand.c - Access to fand's internals for benchmarks
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * We include fand.c, so that the benchmarks run the very code of the daemon,
+ * static functions included. Its main is renamed and never called.
+ */
+
+int fand_main(int argc, char *argv[]);
+
+#define	main	fand_main
+#include "fand.c"
+#undef	main
+
+#include "ttc.h"
+#include "benchfand.h"
+
+
+/*
+ * The MQTT client is replaced by the stand-in for libmosquitto. fand_main
+ * still refers to it.
+ */
+
+struct mosquitto *mqtt_setup(const char *host, int port,
+    void (*connected_fn)(struct mosquitto *mosq),
+    void (*cb_fn)(struct mosquitto *mosq, void *obj,
+    const struct mosquitto_message *msg))
+{
+	(void) host;
+	(void) port;
+	(void) connected_fn;
+	(void) cb_fn;
+
+	abort();
+}
+
+
+void mqtt_start(void)
+{
+	abort();
+}
+
+
+void mqtt_stop(void)
+{
+	abort();
+}
+
+
+bool mqtt_connected(void)
+{
+	abort();
+}
+
+
+/* ----- Setup ------------------------------------------------------------- */
+
+
+void benchfand_setup(struct mosquitto *mosq, unsigned gen,
+    unsigned long hz)
+{
+	const struct board_fan *bf;
+	unsigned i;
+
+	generation = gen;
+	pclk = hz;
+	init_board();
+	init_commands();
+	init_topics();
+	loop_init();
+	loop_timer_init(&poll_timer, poll_tacho, mosq);
+	poll_cur_s = poll_s;
+	loop_timer_init(&ctl_timer, control, mosq);
+	loop_timer_init(&slew_timer, slew_tick, NULL);
+	init_control();
+	for (i = 0; i != n_fans; i++) {
+		init_pwm(mosq, 0, i, 100);
+		fans[i].slew.up = fans[i].slew.down = 0;
+		bf = fans[i].bf;
+		TTC_COUNTER(bf->ttc, bf->timer) = 0xffff;
+	}
+	init_alarms(mosq);
+}
+
+
+unsigned benchfand_fans(void)
+{
+	return n_fans;
+}
+
+
+void benchfand_turn(unsigned edges)
+{
+	const struct board_tacho *bt;
+	const struct fan *fan;
+
+	for (fan = fans; fan != fans + n_fans; fan++)
+		for (bt = fan->bf->tachos;
+		    bt != fan->bf->tachos + fan->bf->n_tachos; bt++)
+			TTC_COUNTER(bt->ttc, bt->timer) =
+			    (TTC_COUNTER(bt->ttc, bt->timer) + edges) & 0xffff;
+}
+
+
+/* ----- Paths ------------------------------------------------------------- */
+
+
+void benchfand_cb(struct mosquitto *mosq, const char *topic_name,
+    const char *payload)
+{
+	struct mosquitto_message msg = {
+		.topic		= (char *) topic_name,
+		.payload	= (void *) payload,
+		.payloadlen	= strlen(payload),
+	};
+
+	cb(mosq, NULL, &msg);
+}
+
+
+void benchfand_parse_pwm(struct mosquitto *mosq, const char *payload)
+{
+	parse_pwm(mosq, (1 << n_fans) - 1, payload, strlen(payload));
+}
+
+
+void benchfand_set_pwm(struct mosquitto *mosq, unsigned ch, uint8_t duty)
+{
+	set_pwm(mosq, ch, duty, 0);
+}
+
+
+double benchfand_rpm_poll(unsigned ch, unsigned tacho)
+{
+	return rpm_poll(fans[ch].rpm_ctx + tacho);
+}
+
+
+void benchfand_poll(struct mosquitto *mosq)
+{
+	poll_tacho(mosq);
+}
@@ -0,0 +1,51 @@
+/*
+ * benchfand.h - Access to fand's internals for benchmarks
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef BENCHFAND_H
+#define	BENCHFAND_H
+
+#include <stdint.h>
+
+#include <mosquitto.h>
+
+
+/*
+ * Set up fand's state as main does, for a board of the given generation, on
+ * the registers of the backend selected with regmap_backend. Nothing is
+ * attached to the event loop, and duty cycle ramps are disabled, so that each
+ * command reaches the PWM register at once.
+ *
+ * The PWM counters are parked at the end of the period, where pwm_duty never
+ * has to wait for a window.
+ */
+
+void benchfand_setup(struct mosquitto *mosq, unsigned generation,
+    unsigned long pclk);
+
+unsigned benchfand_fans(void);
+
+/*
+ * Advance the counters of all tachos, as if each had seen "edges" more
+ * edges.
+ */
+
+void benchfand_turn(unsigned edges);
+
+/*
+ * The paths fand runs on incoming messages and timer ticks.
+ */
+
+void benchfand_cb(struct mosquitto *mosq, const char *topic,
+    const char *payload);
+void benchfand_parse_pwm(struct mosquitto *mosq, const char *payload);
+void benchfand_set_pwm(struct mosquitto *mosq, unsigned ch, uint8_t duty);
+double benchfand_rpm_poll(unsigned ch, unsigned tacho);
+void benchfand_poll(struct mosquitto *mosq);
+
+#endif /* !BENCHFAND_H */
@@ -0,0 +1,267 @@
+/*
+ * board.c - Fan and tacho wiring of the board
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for vasprintf */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "conf.h"
+#include "board.h"
+
+
+#define	TOPIC_BASE	"/fan"
+
+#define	N_TTCS		2
+#define	N_TIMERS	3	/* per TTC */
+
+#define	N_GENERATIONS	3
+
+
+/*
+ * The channels are called left and right on LC001.01 to .04, and front and
+ * rear on LC001.05. For compatibility, each channel also answers to the name
+ * it has on the other boards.
+ */
+
+#define	FAN(n, a, t, m)					\
+	.name = n, .alias = a, .ttc = t, .timer = 0, .mio = m,	\
+	.min_duty = BOARD_MIN_DUTY
+#define	TACHO(t, tm)					\
+	{ .ttc = t, .timer = tm, .mio = 0, .ppr = BOARD_PPR }
+
+static const struct board builtin[N_GENERATIONS] = {
+	[0 ... 1] = {
+		.fans = {
+			{
+				FAN("left", "front", 0, 30),
+				.tachos = { TACHO(1, 1) },
+				.n_tachos = 1,
+			},
+			{
+				FAN("right", "rear", 1, 28),
+				.tachos = { TACHO(0, 1) },
+				.n_tachos = 1,
+			},
+		},
+		.n_fans = 2,
+	},
+	[2] = {
+		.fans = {
+			{
+				FAN("front", "left", 0, 30),
+				.tachos = { TACHO(0, 1), TACHO(1, 1) },
+				.n_tachos = 2,
+			},
+			{
+				FAN("rear", "right", 1, 28),
+				.tachos = { TACHO(0, 2), TACHO(1, 2) },
+				.n_tachos = 2,
+			},
+		},
+		.n_fans = 2,
+	},
+};
+
+static struct board board;
+
+
+/* ----- Configuration ----------------------------------------------------- */
+
+
+static unsigned long integer(const char *s, const char *what,
+    unsigned long max)
+{
+	unsigned long n;
+	char *end;
+
+	n = strtoul(s, &end, 0);
+	if (end == s || *end || n > max)
+		conf_error("invalid %s \"%s\"", what, s);
+	return n;
+}
+
+
+static char *stralloc(const char *s)
+{
+	char *tmp;
+
+	tmp = strdup(s);
+	if (!tmp) {
+		perror("strdup");
+		exit(1);
+	}
+	return tmp;
+}
+
+
+static struct board_fan *find_fan(const char *name)
+{
+	struct board_fan *f;
+
+	for (f = board.fans; f != board.fans + board.n_fans; f++)
+		if (!strcmp(f->name, name) ||
+		    (f->alias && !strcmp(f->alias, name)))
+			return f;
+	return NULL;
+}
+
+
+/*
+ * The name goes into MQTT topics, JSON strings, and Prometheus labels, none
+ * of which we escape.
+ */
+
+static bool valid_name(const char *s)
+{
+	if (!strcmp(s, "all"))
+		return 0;
+	while (*s) {
+		if (strchr("/+#\"\\", *s) || (uint8_t) *s < ' ' || *s == 0x7f)
+			return 0;
+		s++;
+	}
+	return 1;
+}
+
+
+static void conf_fan(int argc, char *const *argv)
+{
+	struct board_fan *f;
+
+	if (!valid_name(argv[0]))
+		conf_error("invalid fan name \"%s\"", argv[0]);
+	if (find_fan(argv[0]))
+		conf_error("fan \"%s\" already exists", argv[0]);
+	if (board.n_fans == BOARD_MAX_FANS)
+		conf_error("too many fans");
+	f = board.fans + board.n_fans++;
+	f->name = stralloc(argv[0]);
+	f->alias = NULL;
+	f->topic = NULL;
+	f->ttc = integer(argv[1], "TTC", N_TTCS - 1);
+	f->timer = integer(argv[2], "timer", N_TIMERS - 1);
+	f->mio = integer(argv[3], "MIO", 53);
+	if (f->mio && f->timer)
+		conf_error("for MIO, timer must be 0");
+	f->min_duty = argc > 4 ?
+	    integer(argv[4], "minimum duty cycle", 100) : BOARD_MIN_DUTY;
+	f->n_tachos = 0;
+}
+
+
+static void conf_tacho(int argc, char *const *argv)
+{
+	struct board_fan *f;
+	struct board_tacho *t;
+
+	f = find_fan(argv[0]);
+	if (!f)
+		conf_error("unknown fan \"%s\"", argv[0]);
+	if (f->n_tachos == BOARD_MAX_TACHOS)
+		conf_error("too many tachos");
+	t = f->tachos + f->n_tachos++;
+	t->ttc = integer(argv[1], "TTC", N_TTCS - 1);
+	t->timer = integer(argv[2], "timer", N_TIMERS - 1);
+	t->mio = argc > 3 ? integer(argv[3], "MIO", 53) : 0;
+	t->ppr = argc > 4 ? integer(argv[4], "pulses per revolution", 100) :
+	    BOARD_PPR;
+	if (!t->ppr)
+		conf_error("pulses per revolution must be at least 1");
+	t->topic = argc > 5 ? stralloc(argv[5]) : NULL;
+}
+
+
+const struct conf_keyword board_conf[] = {
+	{ "fan",	4, 5,	conf_fan },
+	{ "tacho",	3, 6,	conf_tacho },
+	{ NULL, 0, 0, NULL }
+};
+
+
+/* ----- Setup ------------------------------------------------------------- */
+
+
+static char *topic(const char *fmt, ...)
+{
+	va_list ap;
+	char *s;
+	int res;
+
+	va_start(ap, fmt);
+	res = vasprintf(&s, fmt, ap);
+	va_end(ap);
+	if (res < 0) {
+		perror("vasprintf");
+		exit(1);
+	}
+	return s;
+}
+
+
+static void claim(bool used[N_TTCS][N_TIMERS], uint8_t ttc, uint8_t timer)
+{
+	if (used[ttc][timer]) {
+		fprintf(stderr, "TTC%u timer %u is used more than once\n",
+		    ttc, timer);
+		exit(1);
+	}
+	used[ttc][timer] = 1;
+}
+
+
+const struct board *board_setup(unsigned generation)
+{
+	bool used[N_TTCS][N_TIMERS] = { { 0 } };
+	struct board_fan *f;
+	struct board_tacho *t;
+
+	if (!board.n_fans) {
+		if (generation >= N_GENERATIONS) {
+			fprintf(stderr, "unknown board generation %u\n",
+			    generation);
+			exit(1);
+		}
+		board = builtin[generation];
+	}
+
+	for (f = board.fans; f != board.fans + board.n_fans; f++) {
+		claim(used, f->ttc, f->timer);
+		if (!f->topic)
+			f->topic = topic(TOPIC_BASE "/%s", f->name);
+		for (t = f->tachos; t != f->tachos + f->n_tachos; t++) {
+			claim(used, t->ttc, t->timer);
+			if (t->topic)
+				continue;
+			if (f->n_tachos == 1)
+				t->topic = topic("%s/rpm", f->topic);
+			else
+				t->topic = topic("%s/%u/rpm", f->topic,
+				    (unsigned) (t - f->tachos + 1));
+		}
+	}
+	return &board;
+}
+
+
+unsigned board_channels(const struct board *b, const char *name)
+{
+	const struct board_fan *f;
+
+	if (!strcmp(name, "all"))
+		return (1 << b->n_fans) - 1;
+	for (f = b->fans; f != b->fans + b->n_fans; f++)
+		if (!strcmp(f->name, name) ||
+		    (f->alias && !strcmp(f->alias, name)))
+			return 1 << (f - b->fans);
+	return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * board.h - Fan and tacho wiring of the board
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef BOARD_H
+#define	BOARD_H
+
+#include <stdint.h>
+
+#include "conf.h"
+
+
+/*
+ * Per the "4-Wire Pulse Width Modulation (PWM) Controlled Fans"
+ * specification, the minimum PWM duty cycle for the fan to start and keep
+ * running is vendor-defined, but must not be higher than 30%. This is the
+ * default minimum of a fan.
+ */
+
+#define	BOARD_MIN_DUTY		30
+
+/*
+ * Fan tacho signals usually have two pulses (four edges) per revolution.
+ */
+
+#define	BOARD_PPR		2
+
+/*
+ * Each PWM output and each tacho needs a timer of its own, and there are only
+ * six (two TTCs with three timers each). board_setup checks that no timer is
+ * used twice.
+ */
+
+#define	BOARD_MAX_FANS		4
+#define	BOARD_MAX_TACHOS	2	/* per fan */
+
+
+struct board_tacho {
+	uint8_t ttc;
+	uint8_t timer;
+	uint8_t mio;		/* 0 for EMIO */
+	unsigned ppr;		/* pulses per revolution */
+	const char *topic;	/* RPM */
+};
+
+struct board_fan {
+	const char *name;
+	const char *alias;	/* NULL if none */
+	const char *topic;	/* base of the fan's topics */
+	uint8_t ttc;		/* PWM output */
+	uint8_t timer;
+	uint8_t mio;		/* 0 for EMIO */
+	uint8_t min_duty;	/* percent */
+	struct board_tacho tachos[BOARD_MAX_TACHOS];
+	unsigned n_tachos;
+};
+
+struct board {
+	struct board_fan fans[BOARD_MAX_FANS];
+	unsigned n_fans;
+};
+
+
+/*
+ * Configuration:
+ *
+ * fan NAME TTC TIMER MIO [MIN_DUTY]
+ *	PWM channel. The fan's topics are /fan/NAME/pwm, /fan/NAME/pwm-set,
+ *	etc. NAME cannot be "all", nor contain /, +, #, ", \, or control
+ *	characters. MIO is 0 for EMIO. Only the wave of timer 0 reaches the
+ *	MIO pins (18, 30, 42 for TTC 0; 16, 28, 40 for TTC 1), so a fan on
+ *	timer 1 or 2 must use EMIO. MIN_DUTY defaults to 30 (percent).
+ * tacho FAN TTC TIMER [MIO [PPR [TOPIC]]]
+ *	Tacho input of fan FAN. MIO is 0 for EMIO (default), PPR the number
+ *	of pulses per revolution (default: 2). The RPM topic defaults to
+ *	/fan/NAME/rpm if the fan has only one tacho, /fan/NAME/<n>/rpm
+ *	otherwise, with <n> counting from 1.
+ *
+ * If the configuration does not describe any fans, we use the built-in
+ * wiring of the board generation.
+ */
+
+extern const struct conf_keyword board_conf[];
+
+
+/*
+ * Return the wiring, with all defaults filled in. Exits if the configuration
+ * is inconsistent.
+ */
+
+const struct board *board_setup(unsigned generation);
+
+/*
+ * Bit mask of the channels that belong to a fan name, alias, or "all". 0 if
+ * the name is unknown.
+ */
+
+unsigned board_channels(const struct board *b, const char *name);
+
+#endif /* !BOARD_H */
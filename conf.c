@@ -0,0 +1,103 @@
+/*
+ * conf.c - Read the configuration file
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "conf.h"
+
+
+#define	MAX_LINE	1024
+#define	MAX_ARGS	32
+
+
+static const char *conf_path;
+static unsigned conf_lineno;
+
+
+void conf_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s:%u: ", conf_path, conf_lineno);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+
+static const struct conf_keyword *lookup(
+    const struct conf_keyword *const *tables, const char *name)
+{
+	const struct conf_keyword *const *t;
+	const struct conf_keyword *kw;
+
+	for (t = tables; *t; t++)
+		for (kw = *t; kw->name; kw++)
+			if (!strcmp(kw->name, name))
+				return kw;
+	return NULL;
+}
+
+
+static void line(const struct conf_keyword *const *tables, char *s)
+{
+	const struct conf_keyword *kw;
+	char *argv[MAX_ARGS];
+	int argc = 0;
+	char *p;
+
+	p = strchr(s, '#');
+	if (p)
+		*p = 0;
+	for (p = strtok(s, " \t\r\n"); p; p = strtok(NULL, " \t\r\n")) {
+		if (argc == MAX_ARGS)
+			conf_error("too many words");
+		argv[argc++] = p;
+	}
+	if (!argc)
+		return;
+
+	kw = lookup(tables, argv[0]);
+	if (!kw)
+		conf_error("unknown keyword \"%s\"", argv[0]);
+	if (argc - 1 < kw->min_args || argc - 1 > kw->max_args)
+		conf_error("wrong number of arguments for \"%s\"", argv[0]);
+	kw->fn(argc - 1, argv + 1);
+}
+
+
+void conf_read(const char *path, const struct conf_keyword *const *tables)
+{
+	char buf[MAX_LINE];
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		exit(1);
+	}
+	conf_path = path;
+	conf_lineno = 0;
+	while (fgets(buf, sizeof(buf), file)) {
+		conf_lineno++;
+		if (!strchr(buf, '\n') && !feof(file))
+			conf_error("line too long");
+		line(tables, buf);
+	}
+	if (ferror(file)) {
+		perror(path);
+		exit(1);
+	}
+	(void) fclose(file);
+}
@@ -0,0 +1,38 @@
+/*
+ * conf.h - Read the configuration file
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef CONF_H
+#define	CONF_H
+
+/*
+ * The configuration file consists of lines of whitespace-separated words.
+ * The first word selects the keyword, the remaining words are its arguments.
+ * Everything after a # is a comment.
+ *
+ * Handlers report errors with conf_error, which exits.
+ */
+
+struct conf_keyword {
+	const char *name;
+	int min_args, max_args;
+	void (*fn)(int argc, char *const *argv);
+};
+
+
+void conf_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+
+/*
+ * "tables" is a NULL-terminated list of keyword tables, each terminated by an
+ * entry with name == NULL.
+ */
+
+void conf_read(const char *path, const struct conf_keyword *const *tables);
+
+#endif /* !CONF_H */
@@ -0,0 +1,355 @@
+/*
+ * curve.c - Temperature to duty cycle curves
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for strndup */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mono.h"
+#include "loop.h"
+#include "conf.h"
+#include "board.h"
+#include "trace.h"
+#include "curve.h"
+
+
+#define	DEFAULT_STALE_S		30
+#define	STALE_CHECK_S		1
+#define	FAILSAFE_DUTY		100
+
+#define	MAX_POINTS		16
+#define	MAX_TEMP_MSG		20
+
+
+struct sensor {
+	char *topic;
+	double temp;
+	bool valid;		/* temp has been set */
+	uint64_t t_ns;		/* time of last update or start */
+	struct sensor *next;
+};
+
+struct point {
+	double temp;
+	double duty;
+};
+
+struct group {
+	char *name;
+	unsigned channels;
+	struct point points[MAX_POINTS];
+	unsigned n_points;
+	double hysteresis;
+	double stale_s;
+	struct sensor *sensors;
+	int duty;		/* current output, -1 if none yet */
+	struct group *next;
+};
+
+
+static struct group *groups = NULL;
+static void (*apply_fn)(unsigned channels, uint8_t duty);
+static struct loop_timer stale_timer;
+
+
+/* ----- Configuration ----------------------------------------------------- */
+
+
+static struct group *group(const char *name)
+{
+	struct group *g;
+
+	for (g = groups; g; g = g->next)
+		if (!strcmp(g->name, name))
+			return g;
+	g = calloc(1, sizeof(*g));
+	if (!g) {
+		perror("calloc");
+		exit(1);
+	}
+	g->name = strdup(name);
+	if (!g->name) {
+		perror("strdup");
+		exit(1);
+	}
+	g->stale_s = DEFAULT_STALE_S;
+	g->duty = -1;
+	g->next = groups;
+	groups = g;
+	return g;
+}
+
+
+static double number(const char *s, const char *what)
+{
+	char *end;
+	double n;
+
+	n = strtod(s, &end);
+	if (end == s || *end)
+		conf_error("invalid %s \"%s\"", what, s);
+	return n;
+}
+
+
+static void conf_curve(int argc, char *const *argv)
+{
+	struct group *g = group(argv[0]);
+	struct point *p;
+	int i;
+
+	if (g->n_points)
+		conf_error("group \"%s\" already has a curve", g->name);
+	if (argc - 1 > MAX_POINTS)
+		conf_error("too many points");
+	for (i = 1; i != argc; i++) {
+		p = g->points + g->n_points;
+		if (sscanf(argv[i], "%lf:%lf", &p->temp, &p->duty) != 2)
+			conf_error("invalid point \"%s\"", argv[i]);
+		if (p->duty < 0 || p->duty > 100)
+			conf_error("duty must be 0-100, not %g", p->duty);
+		if (g->n_points && p->temp <= p[-1].temp)
+			conf_error("temperatures must increase");
+		g->n_points++;
+	}
+}
+
+
+static void conf_sensor(int argc, char *const *argv)
+{
+	struct group *g = group(argv[0]);
+	struct sensor *s;
+
+	(void) argc;
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		perror("calloc");
+		exit(1);
+	}
+	s->topic = strdup(argv[1]);
+	if (!s->topic) {
+		perror("strdup");
+		exit(1);
+	}
+	s->next = g->sensors;
+	g->sensors = s;
+}
+
+
+static void conf_hysteresis(int argc, char *const *argv)
+{
+	(void) argc;
+
+	group(argv[0])->hysteresis = number(argv[1], "temperature");
+}
+
+
+static void conf_stale(int argc, char *const *argv)
+{
+	double s = number(argv[1], "duration");
+
+	(void) argc;
+
+	if (s <= 0)
+		conf_error("duration must be positive");
+	group(argv[0])->stale_s = s;
+}
+
+
+const struct conf_keyword curve_conf[] = {
+	{ "curve",	2, MAX_POINTS + 1,	conf_curve },
+	{ "sensor",	2, 2,			conf_sensor },
+	{ "hysteresis",	2, 2,			conf_hysteresis },
+	{ "stale",	2, 2,			conf_stale },
+	{ NULL, 0, 0, NULL }
+};
+
+
+/* ----- Evaluation -------------------------------------------------------- */
+
+
+static double interpolate(const struct group *g, double temp)
+{
+	const struct point *p;
+
+	if (temp <= g->points[0].temp)
+		return g->points[0].duty;
+	for (p = g->points + 1; p != g->points + g->n_points; p++)
+		if (temp < p->temp)
+			return p[-1].duty + (p->duty - p[-1].duty) *
+			    (temp - p[-1].temp) / (p->temp - p[-1].temp);
+	return p[-1].duty;
+}
+
+
+static void set_duty(struct group *g, int duty)
+{
+	if (duty == g->duty)
+		return;
+	g->duty = duty;
+	apply_fn(g->channels, duty);
+}
+
+
+static void evaluate(struct group *g, uint64_t now)
+{
+	const struct sensor *s;
+	uint64_t stale_ns = g->stale_s * 1e9;
+	double temp = 0;
+	bool have = 0;
+	int up, down;
+
+	for (s = g->sensors; s; s = s->next) {
+		if (now - s->t_ns > stale_ns) {
+			set_duty(g, FAILSAFE_DUTY);
+			return;
+		}
+		if (s->valid && (!have || s->temp > temp)) {
+			temp = s->temp;
+			have = 1;
+		}
+	}
+	if (!have)
+		return;
+
+	/*
+	 * Going up, we follow the curve. Going down, we follow the curve
+	 * shifted by the hysteresis, i.e., the duty cycle only drops once the
+	 * temperature has fallen that far below where it would otherwise.
+	 */
+	up = interpolate(g, temp) + 0.5;
+	down = interpolate(g, temp + g->hysteresis) + 0.5;
+	if (g->duty < 0 || up > g->duty)
+		set_duty(g, up);
+	else if (down < g->duty)
+		set_duty(g, down);
+}
+
+
+void curve_check(void)
+{
+	uint64_t now = mono_ns();
+	struct group *g;
+
+	for (g = groups; g; g = g->next)
+		if (g->duty != FAILSAFE_DUTY)
+			evaluate(g, now);
+}
+
+
+static void check_stale(void *user)
+{
+	(void) user;
+
+	trace_begin(trace_curve);
+	curve_check();
+}
+
+
+bool curve_input(const char *topic, const void *payload, int len)
+{
+	uint64_t now = mono_ns();
+	struct group *g;
+	struct sensor *s;
+	bool found = 0;
+	char buf[MAX_TEMP_MSG + 1];
+	char *end;
+	double temp;
+
+	for (g = groups; g; g = g->next)
+		for (s = g->sensors; s; s = s->next) {
+			if (strcmp(s->topic, topic))
+				continue;
+			if (!found) {
+				if (len < 1 || len > MAX_TEMP_MSG) {
+					fprintf(stderr,
+					    "%s: invalid message length: %d\n",
+					    topic, len);
+					return 1;
+				}
+				memcpy(buf, payload, len);
+				buf[len] = 0;
+				temp = strtod(buf, &end);
+				if (*end) {
+					fprintf(stderr,
+					    "%s: bad temperature \"%s\"\n",
+					    topic, buf);
+					return 1;
+				}
+				found = 1;
+			}
+			s->temp = temp;
+			s->valid = 1;
+			s->t_ns = now;
+			evaluate(g, now);
+		}
+	return found;
+}
+
+
+/* ----- Setup ------------------------------------------------------------- */
+
+
+void curve_topics(void (*fn)(void *user, const char *topic), void *user)
+{
+	const struct group *g;
+	const struct sensor *s;
+
+	for (g = groups; g; g = g->next)
+		for (s = g->sensors; s; s = s->next)
+			fn(user, s->topic);
+}
+
+
+void curve_start(const struct board *board,
+    void (*apply)(unsigned channels, uint8_t duty))
+{
+	uint64_t now = mono_ns();
+	struct group *g;
+
+	if (!groups)
+		return;
+	for (g = groups; g; g = g->next) {
+		g->channels = board_channels(board, g->name);
+		if (!g->channels) {
+			fprintf(stderr, "unknown fan group \"%s\"\n", g->name);
+			exit(1);
+		}
+		if (!g->n_points) {
+			fprintf(stderr, "fan group \"%s\" has no curve\n",
+			    g->name);
+			exit(1);
+		}
+		if (!g->sensors) {
+			fprintf(stderr, "fan group \"%s\" has no sensors\n",
+			    g->name);
+			exit(1);
+		}
+	}
+
+	apply_fn = apply;
+
+	/*
+	 * Sensors that have never reported become stale "stale_s" after we
+	 * start. Until then, they don't count, and a group none of whose
+	 * sensors has reported yet keeps the duty cycle we started with.
+	 */
+	for (g = groups; g; g = g->next) {
+		struct sensor *s;
+
+		for (s = g->sensors; s; s = s->next)
+			s->t_ns = now;
+	}
+	loop_timer_init(&stale_timer, check_stale, NULL);
+	loop_timer_set(&stale_timer, STALE_CHECK_S, STALE_CHECK_S);
+}
@@ -0,0 +1,71 @@
+/*
+ * curve.h - Temperature to duty cycle curves
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef CURVE_H
+#define	CURVE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "conf.h"
+#include "board.h"
+
+
+/*
+ * Configuration:
+ *
+ * curve GROUP TEMP:DUTY ...
+ *	Piecewise-linear curve for the fan group. GROUP is the name of a fan
+ *	of the board (e.g., left, right, front, or rear), or all. Temperatures
+ *	must be increasing. Below the first and above the last point, the duty
+ *	cycle of that point applies.
+ * sensor GROUP TOPIC
+ *	MQTT topic with a temperature (in degrees Celsius) that feeds the
+ *	group's curve. If a group has several sensors, the highest temperature
+ *	applies.
+ * hysteresis GROUP DEGREES
+ *	Only lower the duty cycle once the temperature has dropped this much
+ *	below the point at which the current duty cycle was reached.
+ * stale GROUP SECONDS
+ *	If any sensor of the group has not reported for this long, run the
+ *	group's fans at 100%.
+ */
+
+extern const struct conf_keyword curve_conf[];
+
+
+/*
+ * "apply" is called with a bit mask of PWM channels (bit n = fan n of the
+ * board) and the duty cycle they should run at, whenever the output of a
+ * curve changes.
+ */
+
+void curve_start(const struct board *board,
+    void (*apply)(unsigned channels, uint8_t duty));
+
+/*
+ * Call "fn" for each topic we need to subscribe to.
+ */
+
+void curve_topics(void (*fn)(void *user, const char *topic), void *user);
+
+/*
+ * Process an incoming message. Returns 0 if the topic is not a sensor topic.
+ */
+
+bool curve_input(const char *topic, const void *payload, int len);
+
+/*
+ * Re-evaluate the curves, failing over those whose sensors went stale. This
+ * is what the periodic check does; fandreplay calls it directly.
+ */
+
+void curve_check(void);
+
+#endif /* !CURVE_H */
@@ -0,0 +1,98 @@
+/*
+ * dispatch.c - Dispatch incoming MQTT messages by topic
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * Topics are kept in a hash table (FNV-1a, chained), so the cost of a lookup
+ * does not grow with the number of topics. Each hit costs one strcmp, to
+ * rule out collisions.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mosquitto.h>
+
+#include "dispatch.h"
+
+
+#define	HASH_BUCKETS	64	/* power of two */
+
+
+struct entry {
+	const char *topic;
+	uint32_t hash;
+	dispatch_fn fn;
+	unsigned arg;
+	struct entry *next;
+};
+
+
+static struct entry *buckets[HASH_BUCKETS];
+
+
+static uint32_t hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	while (*s) {
+		h ^= (uint8_t) *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static struct entry *lookup(const char *topic, uint32_t h)
+{
+	struct entry *e;
+
+	for (e = buckets[h & (HASH_BUCKETS - 1)]; e; e = e->next)
+		if (e->hash == h && !strcmp(e->topic, topic))
+			return e;
+	return NULL;
+}
+
+
+void dispatch_add(const char *topic, dispatch_fn fn, unsigned arg)
+{
+	uint32_t h = hash(topic);
+	struct entry **anchor = buckets + (h & (HASH_BUCKETS - 1));
+	struct entry *e;
+
+	if (lookup(topic, h)) {
+		fprintf(stderr, "topic \"%s\" has already a handler\n", topic);
+		exit(1);
+	}
+	e = malloc(sizeof(*e));
+	if (!e) {
+		perror("malloc");
+		exit(1);
+	}
+	e->topic = topic;
+	e->hash = h;
+	e->fn = fn;
+	e->arg = arg;
+	e->next = *anchor;
+	*anchor = e;
+}
+
+
+bool dispatch(struct mosquitto *mosq, const struct mosquitto_message *msg)
+{
+	const struct entry *e;
+
+	e = lookup(msg->topic, hash(msg->topic));
+	if (!e)
+		return 0;
+	e->fn(mosq, e->arg, msg->payload, msg->payloadlen);
+	return 1;
+}
@@ -0,0 +1,40 @@
+/*
+ * dispatch.h - Dispatch incoming MQTT messages by topic
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef DISPATCH_H
+#define	DISPATCH_H
+
+#include <stdbool.h>
+
+#include <mosquitto.h>
+
+
+/*
+ * Handlers get the "arg" they were registered with, e.g., a bit mask of
+ * channels, so that one handler can serve several topics.
+ */
+
+typedef void (*dispatch_fn)(struct mosquitto *mosq, unsigned arg,
+    const void *payload, int len);
+
+
+/*
+ * Register a handler for a topic. "topic" must stay valid and each topic can
+ * only have one handler. Call this only during startup.
+ */
+
+void dispatch_add(const char *topic, dispatch_fn fn, unsigned arg);
+
+/*
+ * Call the handler of the message's topic. Returns 0 if there is none.
+ */
+
+bool dispatch(struct mosquitto *mosq, const struct mosquitto_message *msg);
+
+#endif /* !DISPATCH_H */
@@ -7,102 +7,192 @@
  * A copy of the license can be found in the file COPYING.txt
  */
 
-#define _GNU_SOURCE	/* for asprintf */
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <assert.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 
 #include <mosquitto.h>
 
+#include "regmap.h"
+#include "ttc.h"
 #include "pclk.h"
 #include "pwm.h"
 #include "rpm.h"
+#include "uio.h"
+#include "pid.h"
+#include "board.h"
+#include "conf.h"
+#include "curve.h"
+#include "slew.h"
+#include "alarm.h"
+#include "filter.h"
+#include "hist.h"
+#include "metrics.h"
+#include "stats.h"
+#include "trace.h"
+#include "rt.h"
+#include "watchdog.h"
+#include "dispatch.h"
+#include "pub.h"
+#include "state.h"
+#include "mono.h"
+#include "loop.h"
+#include "mqtt.h"
 
 
 /*
  * Per the "4-Wire Pulse Width Modulation (PWM) Controlled Fans"
- * specification [1], the minimum PWM duty cycle for the fan to start and
- * keep running is vendor-defined, but must not be higher than 30%.
- *
- * We play it safe treat any non-zero PWM value < 30% as 30%. To remove this
- * limit, use pwm_duty_raw instead of pwm_duty.
+ * specification [1], the PWM frequency is 25 kHz.
  *
  * [1] https://www.glkinst.com/cables/cable_pics/4_Wire_PWM_Spec.pdf
  */
 
 #define	FAN_PWM_HZ		25000
 
+#define	DEFAULT_POLL_INTERVAL_S	1
+
 /*
- * Per the same specification, the minimum PWM duty cycle for the fan to start
- * and keep running is vendor-defined, but must not be higher than 30%.
+ * Adaptive polling (-a): after a command, during duty cycle ramps, and while
+ * the RPM changes by more than measurement noise, we poll (and publish) at
+ * the fast interval. POLL_HOLD_S after the last such activity, the interval
+ * begins to grow by POLL_DECAY per poll, until it reaches the -t interval.
  *
- * We play it safe treat any non-zero PWM value < 30% as 30%. To remove this
- * limit, use pwm_duty_raw instead of pwm_duty.
+ * In count mode, the reading of a tacho can jump by one edge per poll
+ * interval without the fan changing speed. Changes must exceed POLL_CHANGE
+ * (relative) and POLL_NOISE_EDGES edges to count as activity.
  */
 
-#define	FAN_MIN_DUTY		30
+#define	POLL_HOLD_S		2
+#define	POLL_DECAY		1.5
+#define	POLL_CHANGE		0.1
+#define	POLL_NOISE_EDGES	2
 
-#define	DEFAULT_POLL_INTERVAL_S	1
+/*
+ * If there is a UIO device with this name for a tacho's timer, we use the
+ * timer's overflow interrupt to extend the edge count to 64 bits.
+ */
+
+#define	UIO_TACHO_NAME		"ttc%u-timer%u"
+#define	MAX_TACHOS		(BOARD_MAX_FANS * BOARD_MAX_TACHOS)
+
+/*
+ * Closed-loop RPM control. The output of the controller is the duty cycle in
+ * percent, the input is the RPM. A typical fan covers a few thousand RPM over
+ * the 30-100% range, i.e., roughly 50 RPM per percent. The gains can be
+ * changed with -k.
+ */
+
+#define	DEFAULT_CONTROL_INTERVAL_S	0.25
+#define	DEFAULT_KP		0.005	/* % per RPM */
+#define	DEFAULT_KI		0.02	/* % per RPM and second */
+#define	DEFAULT_KD		0	/* % per RPM/s */
+
+#define	MAX_RPM			30000
 
 
 #define	CONSUMER		"fand"
 
+#define	ARRAY_ENTRIES(a)	(sizeof(a) / sizeof(*(a)))
+
 #define	MQTT_HOST		"localhost"
 #define	MQTT_PORT		1883
 
 #define	MQTT_TOPIC_SHUTDOWN	"/sys/shutdown"
 #define	MQTT_TOPIC_BASE		"/fan"
 
-/* generations 0 and 1 */
-
-#define	MQTT_TOPIC_L		MQTT_TOPIC_BASE "/left"
-#define	MQTT_TOPIC_R		MQTT_TOPIC_BASE "/right"
-#define	MQTT_TOPIC_L_PWM_SET	MQTT_TOPIC_L "/pwm-set"
-#define	MQTT_TOPIC_R_PWM_SET	MQTT_TOPIC_R "/pwm-set"
-#define	MQTT_TOPIC_L_PWM	MQTT_TOPIC_L "/pwm"
-#define	MQTT_TOPIC_R_PWM	MQTT_TOPIC_R "/pwm"
-#define	MQTT_TOPIC_L_RPM	MQTT_TOPIC_L "/rpm"
-#define	MQTT_TOPIC_R_RPM	MQTT_TOPIC_R "/rpm"
-#define	MQTT_TOPIC_L_PWM_MIN	MQTT_TOPIC_L "/pwm-min"
-#define	MQTT_TOPIC_R_PWM_MIN	MQTT_TOPIC_R "/pwm-min"
-
-/* generation 2 */
-
-#define	MQTT_TOPIC_F_PWM_SET	"/fan/front/pwm-set"
-#define	MQTT_TOPIC_RE_PWM_SET	"/fan/rear/pwm-set"
-#define	MQTT_TOPIC_F_PWM	"/fan/front/pwm"
-#define	MQTT_TOPIC_RE_PWM	"/fan/rear/pwm"
-#define	MQTT_TOPIC_F_PWM_MIN	"/fan/front/pwm-min"
-#define	MQTT_TOPIC_RE_PWM_MIN	"/fan/rear/pwm-min"
-#define	MQTT_TOPIC_F_1_RPM	"/fan/front/1/rpm"
-#define	MQTT_TOPIC_F_2_RPM	"/fan/front/2/rpm"
-#define	MQTT_TOPIC_R_1_RPM	"/fan/rear/1/rpm"
-#define	MQTT_TOPIC_R_2_RPM	"/fan/rear/2/rpm"
-
-/* all generations */
-
-#define	MQTT_TOPIC_ALL_PWM_SET	"/fan/all/pwm-set"
-
-
-enum mqtt_qos {
-	qos_be		= 0,
-	qos_ack		= 1,
-	qos_once	= 2
-};
+/*
+ * The per-fan topics are MQTT_TOPIC_BASE "/<fan>/..." and come from the board
+ * description.
+ */
+
+#define	MQTT_PWM		"/pwm"
+#define	MQTT_PWM_SET		"/pwm-set"
+#define	MQTT_PWM_MIN		"/pwm-min"
+#define	MQTT_RPM_SET		"/rpm-set"
+#define	MQTT_RAW		"-raw"	/* RPM topic + this */
+#define	MQTT_ALARM		"/alarm/"	/* + condition */
+
+#define	MQTT_TOPIC_ANY_PWM_SET	MQTT_TOPIC_BASE "/+/pwm-set"
+#define	MQTT_TOPIC_ANY_RPM_SET	MQTT_TOPIC_BASE "/+/rpm-set"
+#define	MQTT_TOPIC_POLL_MISSED	"/fan/poll-missed"
+#define	MQTT_TOPIC_STATE	"/fan/state"
+#define	MQTT_TOPIC_ALARM	"/fan/alarm"
+#define	MQTT_TOPIC_WATCHDOG	"/fan/watchdog"
+#define	MQTT_TOPIC_PUB_SENT	"/fan/publish/sent"
+#define	MQTT_TOPIC_PUB_SUPPR	"/fan/publish/suppressed"
+#define	MQTT_TOPIC_REG_READS	"/fan/regs/reads"
+#define	MQTT_TOPIC_REG_WRITES	"/fan/regs/writes"
+#define	MQTT_TOPIC_REG_SKIPPED	"/fan/regs/skipped"
+#define	MQTT_TOPIC_REG_MISMATCH	"/fan/regs/mismatches"
+#define	MQTT_TOPIC_STATS	"/fan/stats"
+
+#define	PUB_STATS_INTERVAL_S	60
+
+#define	OPTIONS			"a:A:bc:C:fg:H:ik:m:M:p:P:r:R:s:St:vV"
+/* options a trace does not need to reproduce what fand did */
+#define	NOT_TRACED		"AbHMpPrRvV"
+
+#define	MAX_STATE_MSG		512
+#define	MAX_STATS_MSG		1024
+
+#if STATE_MAX_RPM < BOARD_MAX_TACHOS
+#error "STATE_MAX_RPM must be at least BOARD_MAX_TACHOS"
+#endif
+
+#if HIST_MAX_FANS < BOARD_MAX_FANS || HIST_MAX_TACHOS < BOARD_MAX_TACHOS
+#error "HIST_MAX_FANS/TACHOS must be at least BOARD_MAX_FANS/TACHOS"
+#endif
 
 
 /*
- * Libmosquitto documentation:
- * https://mosquitto.org/api/files/mosquitto-h.htm
+ * A PWM channel and its tachos. The topics are resolved once, at startup, so
+ * that publishing needs neither lookups nor memory allocation.
+ *
+ * For closed-loop control, the channel has its own measurement windows on
+ * its tachos ("fb"), so that sampling for the controller does not disturb
+ * the windows of the poll loop ("rpm_ctx"). Likewise for fault detection
+ * ("mon").
+ *
+ * Readings of the poll loop and the controller pass through RPM filters.
+ * Fault detection looks at raw edges, and smoothes on its own.
  */
 
-
-struct ctx_rpm {
-	struct mosquitto *mosq;
-	const char *topic;
+struct fan {
+	const struct board_fan *bf;
+	struct pub_topic *pwm_topic;
+	struct pub_topic *pwm_min_topic;
+
+	struct tacho tachos[BOARD_MAX_TACHOS];
+	struct rpm_ctx rpm_ctx[BOARD_MAX_TACHOS];
+	struct pub_topic *rpm_topics[BOARD_MAX_TACHOS];
+	struct pub_topic *rpm_raw_topics[BOARD_MAX_TACHOS]; /* NULL if none */
+	unsigned n_tachos;
+	double rpm[BOARD_MAX_TACHOS];	/* readings of the last poll */
+	struct filter_settings filter_set;
+	struct filter filters[BOARD_MAX_TACHOS];
+
+	double duty;		/* current duty cycle, 0-100 */
+	struct slew slew;	/* ramp towards the requested duty cycle */
+	uint64_t cmd_ns;	/* command waiting for its first write, or 0 */
+	uint8_t reported;	/* last duty cycle we published */
+	unsigned rpm_target;	/* 0 for open-loop control */
+	struct pid pid;
+	struct rpm_ctx fb[BOARD_MAX_TACHOS];
+	struct filter fb_filters[BOARD_MAX_TACHOS];
+
+	struct alarm_fan alarm;
+	struct rpm_ctx mon[BOARD_MAX_TACHOS];
+	struct pub_topic *alarm_topics[alarm_n_conds];
+	bool forced;		/* at 100% because of an alarm */
+	uint8_t held;		/* duty cycle requested while forced */
 };
 
 
@@ -110,95 +200,372 @@ static bool shutting_down = 0;
 static bool verbose = 0;
 static bool force = 0;
 static unsigned generation = 1;
+static const struct board *board;
 
+struct tacho_irq {
+	struct tacho *tacho;
+	int fd;
+};
 
-static void update_pwm(struct mosquitto *mosq, const char *topic, uint8_t duty)
-{
-	char *s;
-	int res;
 
-	if (asprintf(&s, "%u", duty) < 0) {
-		perror("asprintf");
-		return;
+static bool period = 0;
+static unsigned long pclk = 0;
+static struct tacho_irq tacho_irqs[MAX_TACHOS];
+static unsigned n_tacho_irqs = 0;
+
+static struct pub_topic *poll_missed_topic;
+static struct pub_topic *state_topic;
+static struct pub_topic *alarm_topic;
+static struct pub_topic *watchdog_topic;
+static struct pub_topic *pub_sent_topic, *pub_suppr_topic;
+static struct pub_topic *reg_reads_topic, *reg_writes_topic;
+static struct pub_topic *reg_skipped_topic, *reg_mismatch_topic;
+static struct pub_topic *stats_topic;
+
+static struct loop_timer poll_timer;
+static unsigned long poll_missed = 0;	/* last value we reported */
+static double poll_s = DEFAULT_POLL_INTERVAL_S;
+static double poll_fast_s = 0;		/* 0 if not adaptive */
+static double poll_cur_s;		/* current interval */
+static uint64_t poll_busy_ns;		/* last activity */
+
+static struct fan fans[BOARD_MAX_FANS];	/* in the order of the board */
+static unsigned n_fans = 0;
+static bool state = 0;		/* publish MQTT_TOPIC_STATE */
+static bool state_only = 0;	/* ... instead of the per-channel topics */
+static enum state_format state_format;
+static struct loop_timer ctl_timer;
+static bool ctl_running = 0;
+static double ctl_s = DEFAULT_CONTROL_INTERVAL_S;
+static uint64_t ctl_ns;		/* time of the last control step */
+static double pid_kp = DEFAULT_KP;
+static double pid_ki = DEFAULT_KI;
+static double pid_kd = DEFAULT_KD;
+static struct loop_timer slew_timer;
+static bool slew_running = 0;
+static uint64_t slew_ns;	/* time of the last ramp step */
+static struct loop_timer alarm_timer;
+static struct loop_timer watchdog_timer;
+static unsigned watchdog_missed = 0;	/* 1 << enum watchdog_deadline */
+static unsigned long guard_interventions = 0;
+static bool watchdog_guard = 1;		/* 0 in fandreplay */
+static const char *hist_path = NULL;	/* -H */
+static const char *metrics_spec = NULL;	/* -M */
+static const char *trace_path = NULL;	/* -R */
+static int rt_priority = 0;		/* -p */
+static int rt_cpu = -1;			/* -A */
+static struct hist hist;
+static uint64_t cmd_ns = 0;	/* arrival of the message being processed */
+
+
+/* ----- Duty cycle ramps ------------------------------------------------- */
+
+
+/*
+ * A command's latency ends with the first write that moves the duty cycle,
+ * which may be the first step of a ramp.
+ */
+
+static void output(struct fan *fan)
+{
+	pwm_duty(fan->bf->ttc, fan->bf->timer, fan->slew.duty / 100.0);
+	trace_duty(fan - fans, fan->slew.duty);
+	if (fan->cmd_ns && fan->slew.duty != fan->duty) {
+		stats_add(stats_command, mono_ns() - fan->cmd_ns);
+		fan->cmd_ns = 0;
 	}
-	res = mosquitto_publish(mosq, NULL, topic, strlen(s), s, qos_ack, 1);
-	free(s);
-        if (res == MOSQ_ERR_SUCCESS)
-                return;
-        fprintf(stderr, "mosquitto_publish: %d\n", res);
-        exit(1);
+	fan->duty = fan->slew.duty;
+	alarm_duty(&fan->alarm, fan->duty, mono_ns());
 }
 
 
-static void update_rpm(struct mosquitto *mosq, const char *topic, double rpm)
+static void slew_tick(void *user)
 {
-	char *s;
-	int res;
+	uint64_t now = mono_ns();
+	double dt = (now - slew_ns) * 1e-9;
+	struct fan *fan;
+	bool active = 0;
+
+	(void) user;
+
+	trace_begin(trace_slew);
+	for (fan = fans; fan != fans + n_fans; fan++) {
+		if (fan->slew.duty == fan->slew.target)
+			continue;
+		if (slew_step(&fan->slew, dt))
+			active = 1;
+		output(fan);
+	}
+	slew_ns = now;
+	if (!active) {
+		loop_timer_stop(&slew_timer);
+		slew_running = 0;
+	}
+}
 
-	if (asprintf(&s, "%u", (unsigned) rpm) < 0) {
-		perror("asprintf");
-		return;
+
+/*
+ * Ramp towards "duty", or, if "now" is set (e.g., on shutdown), go there
+ * immediately.
+ */
+
+static void set_duty(struct fan *fan, double duty, bool now)
+{
+	if (cmd_ns)
+		fan->cmd_ns = duty == fan->duty ? 0 : cmd_ns;
+	if (now) {
+		slew_force(&fan->slew, duty);
+	} else if (slew_set(&fan->slew, duty) && !slew_running) {
+		slew_ns = mono_ns();
+		loop_timer_set(&slew_timer, SLEW_STEP_S, SLEW_STEP_S);
+		slew_running = 1;
 	}
-	res = mosquitto_publish(mosq, NULL, topic, strlen(s), s, qos_ack, 1);
-	free(s);
-        if (res == MOSQ_ERR_SUCCESS)
-                return;
-        fprintf(stderr, "mosquitto_publish: %d\n", res);
-        exit(1);
+	output(fan);
 }
 
 
-static void set_pwm(struct mosquitto *mosq, bool right, uint8_t duty)
+static void set_pwm(struct mosquitto *mosq, unsigned ch, uint8_t duty,
+    bool now)
 {
-	const char *topic;
+	struct fan *fan = fans + ch;
+	const struct board_fan *bf = fan->bf;
 
-	if (duty && duty < FAN_MIN_DUTY && !force)
-		duty = FAN_MIN_DUTY;
-	pwm_duty(right, 0, duty / 100.0);
-	if (!mosq)
+	/*
+	 * We play it safe and treat any non-zero PWM value below the fan's
+	 * minimum (BOARD_MIN_DUTY unless the board description says otherwise)
+	 * as that minimum. -f removes this limit.
+	 */
+	if (duty && duty < bf->min_duty && !force)
+		duty = bf->min_duty;
+	if (fan->forced) {
+		fan->held = duty;
 		return;
-	switch (generation) {
-	case 0:
-	case 1:
-		topic = right ? MQTT_TOPIC_R_PWM : MQTT_TOPIC_L_PWM;
-		break;
-	case 2:
-		topic = right ? MQTT_TOPIC_RE_PWM : MQTT_TOPIC_F_PWM;
-		break;
-	default:
-		abort();
 	}
-	update_pwm(mosq, topic, duty);
+	set_duty(fan, duty, now);
+	if (!mosq || state_only)
+		return;
+	fan->reported = duty;
+	pub_update(mosq, fan->pwm_topic, duty);
 }
 
 
-static void init_pwm(struct mosquitto *mosq, bool invert, bool right,
-    uint8_t duty)
+static unsigned long get_pclk(void)
 {
-	static unsigned long pclk = 0;
-
 	if (!pclk) {
 		pclk = pclk_get();
 		if (verbose)
 			fprintf(stderr, "pclk is %.6f MHz\n", pclk / 1e6);
 	}
-	pwm_init(right, 0, pwm_cpu_1x, 0, invert, right ? 28 : 30);
-	pwm_interval(right, 0, pclk / FAN_PWM_HZ);
-	set_pwm(mosq, right, duty);
-	pwm_start(right, 0);
+	return pclk;
 }
 
 
+static void init_pwm(struct mosquitto *mosq, bool invert, unsigned ch,
+    uint8_t duty)
+{
+	const struct board_fan *bf = fans[ch].bf;
+
+	pwm_init(bf->ttc, bf->timer, pwm_cpu_1x, 0, invert, bf->mio);
+	pwm_interval(bf->ttc, bf->timer, get_pclk() / FAN_PWM_HZ);
+	slew_init(&fans[ch].slew, board, ch, duty);
+	alarm_init(&fans[ch].alarm, board, ch, fans[ch].n_tachos);
+	set_pwm(mosq, ch, duty, 1);
+	pwm_start(bf->ttc, bf->timer);
+}
+
+
+/*
+ * Topics are only built at startup, and live forever.
+ */
+
+static const char *topic(const char *base, const char *leaf)
+{
+	char *s;
+
+	s = malloc(strlen(base) + strlen(leaf) + 1);
+	if (!s) {
+		perror("malloc");
+		exit(1);
+	}
+	strcpy(s, base);
+	strcat(s, leaf);
+	return s;
+}
+
+
+static void init_tacho(struct fan *fan, const struct board_tacho *bt)
+{
+	struct tacho *t = fan->tachos + fan->n_tachos;
+	uint8_t ttc = bt->ttc;
+	uint8_t timer = bt->timer;
+	char name[20];
+	int fd;
+
+	tacho_init(t, ttc, timer, bt->mio, bt->ppr);
+	if (period)
+		tacho_period(t, get_pclk());
+	rpm_init(fan->rpm_ctx + fan->n_tachos, t);
+	fan->rpm_topics[fan->n_tachos] = pub_topic(bt->topic, pub_rpm);
+	filter_init(fan->filters + fan->n_tachos, &fan->filter_set);
+	filter_init(fan->fb_filters + fan->n_tachos, &fan->filter_set);
+	fan->rpm_raw_topics[fan->n_tachos] =
+	    filter_enabled(&fan->filter_set) ?
+	    pub_topic(topic(bt->topic, MQTT_RAW), pub_rpm) : NULL;
+	fan->n_tachos++;
+
+	snprintf(name, sizeof(name), UIO_TACHO_NAME, ttc, timer);
+	fd = uio_open(name);
+	if (fd < 0) {
+		if (verbose)
+			fprintf(stderr, "no UIO device \"%s\", polling only\n",
+			    name);
+		return;
+	}
+	assert(n_tacho_irqs != MAX_TACHOS);
+	tacho_irqs[n_tacho_irqs].tacho = t;
+	tacho_irqs[n_tacho_irqs].fd = fd;
+	n_tacho_irqs++;
+}
+
+
+static void init_fan(struct fan *fan)
+{
+	const struct board_fan *bf = fan->bf;
+	unsigned i;
+
+	fan->pwm_topic = pub_topic(topic(bf->topic, MQTT_PWM), pub_pwm);
+	fan->pwm_min_topic =
+	    pub_topic(topic(bf->topic, MQTT_PWM_MIN), pub_status);
+	filter_setup(&fan->filter_set, board, fan - fans);
+	fan->n_tachos = 0;
+	for (i = 0; i != bf->n_tachos; i++)
+		init_tacho(fan, bf->tachos + i);
+}
+
+
+static void tacho_irq_event(void *user, uint32_t events)
+{
+	const struct tacho_irq *irq = user;
+
+	(void) events;
+
+	trace_begin_irq(irq->tacho->ttc, irq->tacho->timer);
+	uio_ack(irq->fd);
+	tacho_irq(irq->tacho);
+	uio_unmask(irq->fd);
+}
+
+
+static void start_tacho_irqs(void)
+{
+	struct tacho_irq *irq;
+
+	for (irq = tacho_irqs; irq != tacho_irqs + n_tacho_irqs; irq++) {
+		loop_add(irq->fd, EPOLLIN, tacho_irq_event, irq);
+		tacho_irq_enable(irq->tacho);
+		uio_unmask(irq->fd);
+	}
+}
+
+
+/* ----- RPM readings ----------------------------------------------------- */
+
+
+/*
+ * Read the RPM since the last poll of "ctx" and filter it. If "raw" is not
+ * NULL, it receives the unfiltered value.
+ */
+
+static double poll_filtered(struct rpm_ctx *ctx, struct filter *f,
+    double *raw)
+{
+	uint64_t last = ctx->last_ns;
+	uint64_t t0 = mono_ns();
+	double rpm;
+
+	rpm = rpm_poll(ctx);
+	stats_add(stats_read, mono_ns() - t0);
+	if (raw)
+		*raw = rpm;
+	return filter_update(f, rpm, (ctx->last_ns - last) * 1e-9);
+}
+
+
+/* ----- Poll rate --------------------------------------------------------- */
+
+
+static void poll_set(double s)
+{
+	if (s == poll_cur_s)
+		return;
+	if (verbose)
+		fprintf(stderr, "polling every %g s\n", s);
+	poll_cur_s = s;
+	loop_timer_set(&poll_timer, s, s);
+}
+
+
+/*
+ * Something is about to change. Poll fast from now on.
+ */
+
+static void poll_busy(void)
+{
+	if (!poll_fast_s)
+		return;
+	poll_busy_ns = mono_ns();
+	poll_set(poll_fast_s);
+}
+
+
+static bool rpm_changed(const struct fan *fan, unsigned i, double rpm)
+{
+	double old = fan->rpm[i];
+	double noise = POLL_NOISE_EDGES * 60.0 /
+	    (fan->bf->tachos[i].ppr * poll_cur_s);
+	double d = rpm > old ? rpm - old : old - rpm;
+
+	return d > noise && d > old * POLL_CHANGE;
+}
+
+
+static void poll_adapt(bool changed)
+{
+	uint64_t now = mono_ns();
+	double s;
+
+	if (!poll_fast_s)
+		return;
+	if (changed || slew_running)
+		poll_busy_ns = now;
+	if (now - poll_busy_ns < POLL_HOLD_S * 1e9) {
+		poll_set(poll_fast_s);
+	} else {
+		s = poll_cur_s * POLL_DECAY;
+		poll_set(s < poll_s ? s : poll_s);
+	}
+}
+
+
+/* ----- Commands -------------------------------------------------------- */
+
+
 #define	MAX_MSG	10	/* PWM range is 0-100, this is plenty */
 
 
-static void parse_pwm(struct mosquitto *mosq, bool right,
-    const char *msg, int len)
+static void update_control(void);
+
+
+static void parse_pwm(struct mosquitto *mosq, unsigned channels,
+    const void *msg, int len)
 {
+	unsigned i;
+
 	if (shutting_down)
 		return;
 	if (len < 0 || len > MAX_MSG) {
 		fprintf(stderr, "invalid message length: %d\n", len);
+		stats_error(stats_err_command);
 		return;
 	}
 
@@ -213,11 +580,427 @@ static void parse_pwm(struct mosquitto *mosq, bool right,
 		n = strtoul(buf, &end, 0);
 		if (*end || n > 100) {
 			fprintf(stderr, "bad PWM duty: \"%s\"\n", buf);
+			stats_error(stats_err_command);
+			return;
+		}
+	}
+
+	poll_busy();
+	for (i = 0; i != n_fans; i++)
+		if (channels & 1 << i) {
+			fans[i].rpm_target = 0;
+			set_pwm(mosq, i, n, 0);
+		}
+	update_control();
+}
+
+
+/* ----- Closed-loop RPM control ------------------------------------------- */
+
+
+static void control(void *user)
+{
+	struct mosquitto *mosq = user;
+	uint64_t now = mono_ns();
+	double dt = (now - ctl_ns) * 1e-9;	/* includes missed steps */
+	struct fan *fan;
+	double rpm, duty;
+	uint8_t rounded;
+	unsigned i;
+
+	trace_begin(trace_control);
+	ctl_ns = now;
+	for (fan = fans; fan != fans + n_fans; fan++) {
+		if (!fan->rpm_target || fan->forced)
+			continue;
+		rpm = 0;
+		for (i = 0; i != fan->n_tachos; i++)
+			rpm += poll_filtered(fan->fb + i,
+			    fan->fb_filters + i, NULL);
+		rpm /= fan->n_tachos;
+
+		duty = pid_update(&fan->pid, fan->rpm_target, rpm, dt);
+		set_duty(fan, duty, 0);
+
+		rounded = duty + 0.5;
+		if (rounded != fan->reported && !state_only) {
+			fan->reported = rounded;
+			pub_update(mosq, fan->pwm_topic, rounded);
+		}
+	}
+}
+
+
+static void update_control(void)
+{
+	const struct fan *fan;
+	bool active = 0;
+
+	for (fan = fans; fan != fans + n_fans; fan++)
+		if (fan->rpm_target)
+			active = 1;
+
+	if (active == ctl_running)
+		return;
+	if (active) {
+		ctl_ns = mono_ns();
+		loop_timer_set(&ctl_timer, ctl_s, ctl_s);
+	} else {
+		loop_timer_stop(&ctl_timer);
+	}
+	ctl_running = active;
+}
+
+
+static void set_rpm(unsigned ch, unsigned rpm)
+{
+	struct fan *fan = fans + ch;
+	unsigned i;
+
+	if (rpm && !fan->n_tachos) {
+		fprintf(stderr, "fan \"%s\" has no tacho\n", fan->bf->name);
+		return;
+	}
+
+	if (rpm && !fan->rpm_target) {
+		/* restart the measurement windows */
+		for (i = 0; i != fan->n_tachos; i++) {
+			rpm_poll(fan->fb + i);
+			filter_init(fan->fb_filters + i, &fan->filter_set);
+		}
+		pid_reset(&fan->pid, fan->duty);
+	}
+	fan->rpm_target = rpm;
+	update_control();
+}
+
+
+static void parse_rpm(struct mosquitto *mosq, unsigned channels,
+    const void *msg, int len)
+{
+	unsigned i;
+
+	(void) mosq;
+
+	if (shutting_down)
+		return;
+	if (len < 0 || len > MAX_MSG) {
+		fprintf(stderr, "invalid message length: %d\n", len);
+		stats_error(stats_err_command);
+		return;
+	}
+
+	char buf[len + 1];
+	char *end;
+	unsigned long n = 0;
+
+	if (len) {
+		memcpy(buf, msg, len);
+		buf[len] = 0;
+
+		n = strtoul(buf, &end, 0);
+		if (*end || n > MAX_RPM) {
+			fprintf(stderr, "bad RPM: \"%s\"\n", buf);
+			stats_error(stats_err_command);
 			return;
 		}
 	}
 
-	set_pwm(mosq, right, n);
+	poll_busy();
+	for (i = 0; i != n_fans; i++)
+		if (channels & 1 << i)
+			set_rpm(i, n);
+}
+
+
+/* ----- Fan curves ------------------------------------------------------- */
+
+
+static struct mosquitto *curve_mosq;
+
+
+static void apply_curve(unsigned channels, uint8_t duty)
+{
+	unsigned i;
+
+	if (shutting_down)
+		return;
+	if (verbose)
+		fprintf(stderr, "fan curve: channels 0x%x at %u%%\n",
+		    channels, duty);
+	poll_busy();
+	for (i = 0; i != n_fans; i++)
+		if (channels & 1 << i) {
+			fans[i].rpm_target = 0;
+			set_pwm(curve_mosq, i, duty, 0);
+		}
+	update_control();
+}
+
+
+static const struct conf_keyword *const conf_tables[] = {
+	board_conf,
+	curve_conf,
+	pub_conf,
+	slew_conf,
+	alarm_conf,
+	watchdog_conf,
+	filter_conf,
+	NULL
+};
+
+
+static void init_control(void)
+{
+	struct fan *fan;
+	unsigned i;
+
+	for (fan = fans; fan != fans + n_fans; fan++) {
+		for (i = 0; i != fan->n_tachos; i++)
+			rpm_init(fan->fb + i, fan->tachos + i);
+		pid_init(&fan->pid, pid_kp, pid_ki, pid_kd,
+		    force ? 0 : fan->bf->min_duty, 100);
+	}
+}
+
+
+/* ----- Fault detection -------------------------------------------------- */
+
+
+static void publish_alarms(struct mosquitto *mosq)
+{
+	const struct fan *fan;
+	unsigned active = 0;
+	unsigned i;
+
+	for (fan = fans; fan != fans + n_fans; fan++) {
+		for (i = 0; i != alarm_n_conds; i++)
+			pub_update(mosq, fan->alarm_topics[i],
+			    fan->alarm.cond[i]);
+		if (alarm_active(&fan->alarm))
+			active++;
+	}
+	pub_update(mosq, alarm_topic, active);
+}
+
+
+/*
+ * With "action full", an alarm runs all fans that still turn at 100%, until
+ * it clears. A missed watchdog deadline runs all fans at 100%. Duty cycles
+ * requested in the meantime are applied then.
+ */
+
+static void update_forced(struct mosquitto *mosq)
+{
+	const struct fan *fan;
+	bool full = 0;
+	bool want;
+	unsigned i;
+
+	for (fan = fans; fan != fans + n_fans; fan++)
+		if (fan->alarm.set.full && alarm_active(&fan->alarm))
+			full = 1;
+
+	for (i = 0; i != n_fans; i++) {
+		struct fan *f = fans + i;
+
+		want = watchdog_missed ||
+		    (full && !f->alarm.cond[alarm_stall]);
+		if (want == f->forced)
+			continue;
+		poll_busy();
+		alarm_force(&f->alarm, want);
+		if (want) {
+			f->held = f->slew.target + 0.5;
+			set_pwm(mosq, i, 100, 1);
+			f->forced = 1;
+		} else {
+			f->forced = 0;
+			set_pwm(mosq, i, f->held, 0);
+		}
+	}
+}
+
+
+static void check_alarms(void *user)
+{
+	struct mosquitto *mosq = user;
+	uint64_t now = mono_ns();
+	double rpm[BOARD_MAX_TACHOS];
+	struct fan *fan;
+	bool changed = 0;
+	unsigned i;
+
+	trace_begin(trace_alarm);
+	for (fan = fans; fan != fans + n_fans; fan++) {
+		for (i = 0; i != fan->n_tachos; i++)
+			rpm[i] = rpm_poll(fan->mon + i);
+		if (!alarm_check(&fan->alarm, rpm, now))
+			continue;
+		changed = 1;
+		if (!verbose)
+			continue;
+		for (i = 0; i != alarm_n_conds; i++)
+			if (fan->alarm.cond[i])
+				fprintf(stderr, "fan \"%s\": %s\n",
+				    fan->bf->name, alarm_names[i]);
+		if (!alarm_active(&fan->alarm))
+			fprintf(stderr, "fan \"%s\": ok\n", fan->bf->name);
+	}
+	if (!changed)
+		return;
+	update_forced(mosq);
+	publish_alarms(mosq);
+}
+
+
+static void init_alarms(struct mosquitto *mosq)
+{
+	struct fan *fan;
+	const char *t;
+	unsigned i;
+
+	for (fan = fans; fan != fans + n_fans; fan++) {
+		for (i = 0; i != fan->n_tachos; i++)
+			rpm_init(fan->mon + i, fan->tachos + i);
+		for (i = 0; i != alarm_n_conds; i++) {
+			t = topic(topic(fan->bf->topic, MQTT_ALARM),
+			    alarm_names[i]);
+			fan->alarm_topics[i] = pub_topic(t, pub_alarm);
+		}
+	}
+	loop_timer_init(&alarm_timer, check_alarms, mosq);
+	loop_timer_set(&alarm_timer, ALARM_CHECK_S, ALARM_CHECK_S);
+}
+
+
+/* ----- Watchdog ---------------------------------------------------------- */
+
+
+/*
+ * Called in the watchdog's guard process, which has our register mappings but
+ * not our event loop, and whose copy of the register shadows may be stale.
+ */
+
+static void failsafe_full(void)
+{
+	const struct fan *fan;
+
+	ttc_forget();
+	for (fan = fans; fan != fans + n_fans; fan++)
+		pwm_duty(fan->bf->ttc, fan->bf->timer, 1);
+}
+
+
+/*
+ * If our event loop was stuck for too long, the guard has set the PWM
+ * registers. Since the loop runs again, we go back to our duty cycles.
+ */
+
+static void guard_fired(uint64_t reaction_ns)
+{
+	struct fan *fan;
+
+	fprintf(stderr, "event loop stalled, fans were run at 100%%\n");
+	stats_add(stats_failsafe, reaction_ns);
+	guard_interventions++;
+	ttc_forget();
+	for (fan = fans; fan != fans + n_fans; fan++)
+		output(fan);
+}
+
+
+static void watchdog_tick(void *user)
+{
+	struct mosquitto *mosq = user;
+	uint64_t now = mono_ns();
+	uint64_t expired_ns, ns;
+	unsigned missed, d;
+	bool was;
+
+	trace_begin(trace_watchdog);
+	if (watchdog_guard_fired(&ns))
+		guard_fired(ns);
+	if (mqtt_connected())
+		watchdog_seen(watchdog_broker, now);
+	missed = watchdog_check(now, &expired_ns);
+	if (missed == watchdog_missed)
+		return;
+
+	for (d = 0; d != watchdog_n_deadlines; d++)
+		if ((missed ^ watchdog_missed) & 1 << d)
+			fprintf(stderr, "watchdog: %s deadline %s\n",
+			    watchdog_names[d],
+			    missed & 1 << d ? "missed" : "met again");
+	was = watchdog_missed;
+	watchdog_missed = missed;
+	update_forced(mosq);
+	if (!was)
+		stats_add(stats_failsafe, mono_ns() - expired_ns);
+	pub_update(mosq, watchdog_topic, !!missed);
+}
+
+
+static void init_watchdog(struct mosquitto *mosq)
+{
+	if (!watchdog_enabled())
+		return;
+	loop_timer_init(&watchdog_timer, watchdog_tick, mosq);
+	loop_timer_set(&watchdog_timer, watchdog_check_s(),
+	    watchdog_check_s());
+}
+
+
+static void set_shutdown(struct mosquitto *mosq, unsigned channels,
+    const void *msg, int len)
+{
+	(void) channels;
+
+	if (len && *(const char *) msg == '0') {
+		shutting_down = 0;
+	} else {
+		shutting_down = 1;
+		poll_busy();
+		fans[0].rpm_target = 0;
+		update_control();
+		set_pwm(mosq, 0, 100, 1);	/* no ramp */
+	}
+}
+
+
+/*
+ * Each of these covers the command topics of all fans. With wildcards, the
+ * number of subscriptions does not depend on the number of fans.
+ */
+
+static const char *const subscriptions[] = {
+	MQTT_TOPIC_SHUTDOWN,
+	MQTT_TOPIC_ANY_PWM_SET,
+	MQTT_TOPIC_ANY_RPM_SET,
+};
+
+
+static void add_commands(const char *base, unsigned channels)
+{
+	dispatch_add(topic(base, MQTT_PWM_SET), parse_pwm, channels);
+	dispatch_add(topic(base, MQTT_RPM_SET), parse_rpm, channels);
+}
+
+
+static void init_commands(void)
+{
+	const struct board_fan *bf;
+	unsigned i;
+
+	dispatch_add(MQTT_TOPIC_SHUTDOWN, set_shutdown, 0);
+	add_commands(MQTT_TOPIC_BASE "/all", (1 << n_fans) - 1);
+	for (i = 0; i != n_fans; i++) {
+		bf = fans[i].bf;
+		add_commands(bf->topic, 1 << i);
+		if (bf->alias)
+			add_commands(topic(MQTT_TOPIC_BASE "/", bf->alias),
+			    1 << i);
+	}
 }
 
 
@@ -226,99 +1009,428 @@ static void cb(struct mosquitto *mosq, void *obj,
 {
 	(void) obj;
 
-	if (!strcmp(msg->topic, MQTT_TOPIC_SHUTDOWN)) {
-		if (msg->payloadlen && *(const char *) msg->payload == '0') {
-			shutting_down = 0;
-		} else {
-			shutting_down = 1;
-			set_pwm(mosq, 0, 100);
-		}
-	} else if (!strcmp(msg->topic, MQTT_TOPIC_L_PWM_SET)) {
-		/* "R" (rear) in LC001.01, "L" (left) in LC001.02 */
-		parse_pwm(mosq, 0, msg->payload, msg->payloadlen);
-	} else if (!strcmp(msg->topic, MQTT_TOPIC_R_PWM_SET)) {
-		/* "F" (front) in LC001.01, "R" (right) in LC001.02 */
-		parse_pwm(mosq, 1, msg->payload, msg->payloadlen);
-	} else if (!strcmp(msg->topic, MQTT_TOPIC_F_PWM_SET)) {
-		/* front in LC001.05 */
-		parse_pwm(mosq, 0, msg->payload, msg->payloadlen);
-	} else if (!strcmp(msg->topic, MQTT_TOPIC_RE_PWM_SET)) {
-		/* rear in LC001.05 */
-		parse_pwm(mosq, 1, msg->payload, msg->payloadlen);
-	} else if (!strcmp(msg->topic, MQTT_TOPIC_ALL_PWM_SET)) {
-		parse_pwm(mosq, 0, msg->payload, msg->payloadlen);
-		parse_pwm(mosq, 1, msg->payload, msg->payloadlen);
+	/*
+	 * Commands that change a duty cycle record the time until the
+	 * register first moves towards it (see output).
+	 */
+	cmd_ns = mono_ns();
+	trace_begin_command(msg->topic, msg->payload, msg->payloadlen);
+	if (dispatch(mosq, msg) ||
+	    curve_input(msg->topic, msg->payload, msg->payloadlen)) {
+		watchdog_seen(watchdog_input, cmd_ns);
 	} else {
 		fprintf(stderr, "unrecognized topic \"%s\"\n", msg->topic);
+		stats_error(stats_err_topic);
 	}
+	cmd_ns = 0;
 }
 
 
-static struct mosquitto *setup_mqtt(void)
+static void subscribe(void *user, const char *topic)
 {
-	struct mosquitto *mosq;
+	struct mosquitto *mosq = user;
 	int res;
 
-	mosquitto_lib_init();
-	mosq = mosquitto_new(NULL, 1, NULL);
-	if (!mosq) {
-		fprintf(stderr, "mosquitto_new failed\n");
-		exit(1);
-	}
-	if (mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 3600)) {
-		fprintf(stderr, "unable to connect\n");
-		exit(1);
-	}
-	res = mosquitto_subscribe(mosq, NULL, MQTT_TOPIC_SHUTDOWN, qos_ack);
+	res = mosquitto_subscribe(mosq, NULL, topic, qos_ack);
 	if (res) {
 		fprintf(stderr, "mosquitto_subscribe: %d\n", res);
 		exit(1);
 	}
-	res = mosquitto_subscribe(mosq, NULL, MQTT_TOPIC_L_PWM_SET, qos_ack);
-	if (res) {
-		fprintf(stderr, "mosquitto_subscribe: %d\n", res);
-		exit(1);
+}
+
+
+/*
+ * Called from the event loop whenever we have (re)connected. Since we use a
+ * clean session, we have to subscribe again each time.
+ */
+
+static void connected(struct mosquitto *mosq)
+{
+	const struct fan *fan;
+	unsigned i;
+
+	pub_reset();
+	for (i = 0; i != ARRAY_ENTRIES(subscriptions); i++)
+		subscribe(mosq, subscriptions[i]);
+	curve_topics(subscribe, mosq);
+
+	for (fan = fans; fan != fans + n_fans; fan++)
+		pub_update(mosq, fan->pwm_min_topic, fan->bf->min_duty);
+	pub_update(mosq, poll_missed_topic, poll_missed);
+	publish_alarms(mosq);
+	if (watchdog_enabled())
+		pub_update(mosq, watchdog_topic, !!watchdog_missed);
+}
+
+
+static unsigned fan_flags(const struct fan *fan)
+{
+	unsigned flags = 0;
+	unsigned i;
+
+	for (i = 0; i != fan->n_tachos; i++)
+		if (fan->duty && fan->rpm[i] < 1)
+			flags |= FAN_F_STALL;
+	if (fan->rpm_target)
+		flags |= FAN_F_RPM_CTL;
+	if (fan->forced || (fan == fans && shutting_down))
+		flags |= FAN_F_FORCED;
+	if (alarm_active(&fan->alarm))
+		flags |= FAN_F_ALARM;
+	return flags;
+}
+
+
+static void publish_state(struct mosquitto *mosq)
+{
+	struct state_fan sf[BOARD_MAX_FANS];
+	uint8_t buf[MAX_STATE_MSG];
+	struct timespec ts;
+	unsigned i, j;
+	size_t len;
+
+	for (i = 0; i != n_fans; i++) {
+		const struct fan *fan = fans + i;
+
+		sf[i].name = fan->bf->name;
+		sf[i].duty = fan->duty + 0.5;
+		sf[i].n_rpm = fan->n_tachos;
+		sf[i].flags = fan_flags(fan);
+		for (j = 0; j != fan->n_tachos; j++)
+			sf[i].rpm[j] = fan->rpm[j];
 	}
-	res = mosquitto_subscribe(mosq, NULL, MQTT_TOPIC_R_PWM_SET, qos_ack);
-	if (res) {
-		fprintf(stderr, "mosquitto_subscribe: %d\n", res);
-		exit(1);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	len = state_encode(state_format, buf, sizeof(buf),
+	    (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000, sf, n_fans);
+	if (!len) {
+		fprintf(stderr, "state message too long\n");
+		return;
 	}
-	res = mosquitto_subscribe(mosq, NULL, MQTT_TOPIC_F_PWM_SET, qos_ack);
-	if (res) {
-		fprintf(stderr, "mosquitto_subscribe: %d\n", res);
-		exit(1);
+	pub_send_raw(mosq, state_topic, buf, len);
+	pub_stats[pub_state].sent++;
+}
+
+
+/* ----- Telemetry --------------------------------------------------------- */
+
+
+/*
+ * Append the readings of this poll to the history. This only writes to the
+ * mapped file.
+ */
+
+static void record_history(void)
+{
+	struct hist_rec *r = hist_begin(&hist);
+	const struct fan *fan;
+	struct hist_fan *hf;
+	struct hist_tacho *ht;
+	unsigned i;
+
+	for (fan = fans; fan != fans + n_fans; fan++) {
+		hf = hist_fan(&hist, r, fan - fans);
+		hf->duty = fan->duty + 0.5;
+		hf->flags = fan_flags(fan);
+		for (i = 0; i != fan->n_tachos; i++) {
+			ht = hist_tacho(hf, i);
+			ht->edges = (uint64_t) fan->tachos[i].cycles;
+			ht->rpm = fan->rpm[i] > 0xffff ? 0xffff :
+			    fan->rpm[i] + 0.5;
+		}
 	}
-	res = mosquitto_subscribe(mosq, NULL, MQTT_TOPIC_RE_PWM_SET, qos_ack);
-	if (res) {
-		fprintf(stderr, "mosquitto_subscribe: %d\n", res);
-		exit(1);
+	hist_commit(&hist, r);
+}
+
+
+static void init_history(void)
+{
+	const char *names[BOARD_MAX_FANS];
+	unsigned n_tachos[BOARD_MAX_FANS];
+	unsigned i;
+
+	for (i = 0; i != n_fans; i++) {
+		names[i] = fans[i].bf->name;
+		n_tachos[i] = fans[i].n_tachos;
 	}
-	res = mosquitto_subscribe(mosq, NULL, MQTT_TOPIC_ALL_PWM_SET, qos_ack);
-	if (res) {
-		fprintf(stderr, "mosquitto_subscribe: %d\n", res);
-		exit(1);
+	hist_create(&hist, hist_path, HIST_DEFAULT_RECORDS, n_fans, names,
+	    n_tachos);
+}
+
+
+/*
+ * Everything here has been computed already. Scraping does not touch any
+ * registers.
+ */
+
+static void write_metrics(FILE *file)
+{
+	const struct fan *fan;
+	const struct regmap_stats *rs = &regmap_stats;
+	char labels[100];
+	unsigned i;
+
+	metrics_help(file, "fand_duty_percent", "gauge",
+	    "PWM duty cycle currently output");
+	for (fan = fans; fan != fans + n_fans; fan++) {
+		snprintf(labels, sizeof(labels), "fan=\"%s\"", fan->bf->name);
+		metrics_value(file, "fand_duty_percent", labels, fan->duty);
+	}
+	metrics_help(file, "fand_duty_target_percent", "gauge",
+	    "PWM duty cycle the output is ramping to");
+	for (fan = fans; fan != fans + n_fans; fan++) {
+		snprintf(labels, sizeof(labels), "fan=\"%s\"", fan->bf->name);
+		metrics_value(file, "fand_duty_target_percent", labels,
+		    fan->slew.target);
+	}
+	metrics_help(file, "fand_rpm_target", "gauge",
+	    "RPM set with rpm-set, 0 for open-loop control");
+	for (fan = fans; fan != fans + n_fans; fan++) {
+		snprintf(labels, sizeof(labels), "fan=\"%s\"", fan->bf->name);
+		metrics_value(file, "fand_rpm_target", labels,
+		    fan->rpm_target);
+	}
+	metrics_help(file, "fand_rpm", "gauge",
+	    "Tacho reading of the last poll (filtered)");
+	for (fan = fans; fan != fans + n_fans; fan++)
+		for (i = 0; i != fan->n_tachos; i++) {
+			snprintf(labels, sizeof(labels),
+			    "fan=\"%s\",tacho=\"%u\"", fan->bf->name, i + 1);
+			metrics_value(file, "fand_rpm", labels, fan->rpm[i]);
+		}
+	metrics_help(file, "fand_tacho_cycles_total", "counter",
+	    "Tacho cycles counted");
+	for (fan = fans; fan != fans + n_fans; fan++)
+		for (i = 0; i != fan->n_tachos; i++) {
+			snprintf(labels, sizeof(labels),
+			    "fan=\"%s\",tacho=\"%u\"", fan->bf->name, i + 1);
+			metrics_value(file, "fand_tacho_cycles_total", labels,
+			    (uint64_t) fan->tachos[i].cycles);
+		}
+	metrics_help(file, "fand_alarm", "gauge",
+	    "1 while the fault condition is active");
+	for (fan = fans; fan != fans + n_fans; fan++)
+		for (i = 0; i != alarm_n_conds; i++) {
+			snprintf(labels, sizeof(labels),
+			    "fan=\"%s\",condition=\"%s\"", fan->bf->name,
+			    alarm_names[i]);
+			metrics_value(file, "fand_alarm", labels,
+			    fan->alarm.cond[i]);
+		}
+	metrics_help(file, "fand_forced", "gauge",
+	    "1 while the fan is forced to 100% (alarm, watchdog, or shutdown)");
+	for (fan = fans; fan != fans + n_fans; fan++) {
+		snprintf(labels, sizeof(labels), "fan=\"%s\"", fan->bf->name);
+		metrics_value(file, "fand_forced", labels,
+		    !!(fan_flags(fan) & FAN_F_FORCED));
+	}
+	metrics_help(file, "fand_watchdog_missed", "gauge",
+	    "1 while the watchdog deadline is missed");
+	for (i = 0; i != watchdog_n_deadlines; i++) {
+		snprintf(labels, sizeof(labels), "deadline=\"%s\"",
+		    watchdog_names[i]);
+		metrics_value(file, "fand_watchdog_missed", labels,
+		    !!(watchdog_missed & 1 << i));
+	}
+	metrics_help(file, "fand_watchdog_guard_total", "counter",
+	    "Times the guard ran the fans at 100% during a loop stall");
+	metrics_value(file, "fand_watchdog_guard_total", NULL,
+	    guard_interventions);
+
+	metrics_help(file, "fand_published_total", "counter",
+	    "MQTT messages published");
+	for (i = 0; i != pub_n_classes; i++) {
+		snprintf(labels, sizeof(labels), "class=\"%s\"",
+		    pub_class_names[i]);
+		metrics_value(file, "fand_published_total", labels,
+		    pub_stats[i].sent);
+	}
+	metrics_help(file, "fand_suppressed_total", "counter",
+	    "MQTT messages held back by the publish policy");
+	for (i = 0; i != pub_n_classes; i++) {
+		snprintf(labels, sizeof(labels), "class=\"%s\"",
+		    pub_class_names[i]);
+		metrics_value(file, "fand_suppressed_total", labels,
+		    pub_stats[i].suppressed);
+	}
+	metrics_help(file, "fand_publish_errors_total", "counter",
+	    "MQTT messages lost while not connected");
+	for (i = 0; i != pub_n_classes; i++) {
+		snprintf(labels, sizeof(labels), "class=\"%s\"",
+		    pub_class_names[i]);
+		metrics_value(file, "fand_publish_errors_total", labels,
+		    pub_stats[i].errors);
+	}
+
+	metrics_help(file, "fand_register_accesses_total", "counter",
+	    "TTC and MIO register accesses");
+	metrics_value(file, "fand_register_accesses_total", "op=\"read\"",
+	    rs->reads);
+	metrics_value(file, "fand_register_accesses_total", "op=\"write\"",
+	    rs->writes);
+	metrics_value(file, "fand_register_accesses_total",
+	    "op=\"skipped\"", rs->skipped);
+	metrics_help(file, "fand_register_mismatches_total", "counter",
+	    "Shadow registers that differed from the hardware (-V)");
+	metrics_value(file, "fand_register_mismatches_total", NULL,
+	    rs->mismatches);
+
+	metrics_help(file, "fand_poll_interval_seconds", "gauge",
+	    "Current tacho poll interval");
+	metrics_value(file, "fand_poll_interval_seconds", NULL, poll_cur_s);
+	metrics_help(file, "fand_deadlines_missed_total", "counter",
+	    "Timer deadlines missed");
+	metrics_value(file, "fand_deadlines_missed_total", "timer=\"poll\"",
+	    poll_timer.missed);
+	metrics_value(file, "fand_deadlines_missed_total",
+	    "timer=\"control\"", ctl_timer.missed);
+	metrics_value(file, "fand_deadlines_missed_total",
+	    "timer=\"alarm\"", alarm_timer.missed);
+	metrics_help(file, "fand_loop_rounds_total", "counter",
+	    "Rounds of event processing");
+	metrics_value(file, "fand_loop_rounds_total", NULL, loop_stats.rounds);
+	metrics_help(file, "fand_loop_busy_seconds_total", "counter",
+	    "Time spent processing events");
+	metrics_value(file, "fand_loop_busy_seconds_total", NULL,
+	    loop_stats.busy_ns * 1e-9);
+
+	metrics_help(file, "fand_latency_seconds", "summary",
+	    "Command, poll wakeup, tacho read, and publish latency");
+	for (i = 0; i != stats_n_lats; i++) {
+		const struct stats_hist *h = stats_hists + i;
+		static const double q[] = { 0.5, 0.99, 0.999 };
+		unsigned j;
+
+		for (j = 0; j != ARRAY_ENTRIES(q); j++) {
+			snprintf(labels, sizeof(labels),
+			    "path=\"%s\",quantile=\"%g\"",
+			    stats_lat_names[i], q[j]);
+			metrics_value(file, "fand_latency_seconds", labels,
+			    stats_quantile(h, q[j]) * 1e-9);
+		}
+		snprintf(labels, sizeof(labels), "path=\"%s\"",
+		    stats_lat_names[i]);
+		metrics_value(file, "fand_latency_seconds_sum", labels,
+		    h->sum_ns * 1e-9);
+		metrics_value(file, "fand_latency_seconds_count", labels,
+		    h->count);
+	}
+	metrics_help(file, "fand_errors_total", "counter",
+	    "Malformed commands, unknown topics, lost messages, clock errors");
+	for (i = 0; i != stats_n_errs; i++) {
+		snprintf(labels, sizeof(labels), "kind=\"%s\"",
+		    stats_err_names[i]);
+		metrics_value(file, "fand_errors_total", labels,
+		    stats_errors[i]);
 	}
-	mosquitto_message_callback_set(mosq, cb);
-	return mosq;
 }
 
 
-static void mqtt_start(struct mosquitto *mosq)
+static void poll_tacho(void *user)
 {
-	int res;
+	struct mosquitto *mosq = user;
+	struct fan *fan;
+	bool changed = 0;
+	double rpm, raw;
+	unsigned i;
+
+	trace_begin(trace_poll);
+	stats_add(stats_wakeup, poll_timer.late_ns);
+	for (fan = fans; fan != fans + n_fans; fan++)
+		for (i = 0; i != fan->n_tachos; i++) {
+			rpm = poll_filtered(fan->rpm_ctx + i, fan->filters + i,
+			    &raw);
+			if (rpm_changed(fan, i, rpm))
+				changed = 1;
+			fan->rpm[i] = rpm;
+			trace_rpm(fan - fans, i, rpm);
+			if (state_only)
+				continue;
+			pub_update(mosq, fan->rpm_topics[i], rpm);
+			if (fan->rpm_raw_topics[i])
+				pub_update(mosq, fan->rpm_raw_topics[i], raw);
+		}
+	if (state)
+		publish_state(mosq);
+	if (hist_path)
+		record_history();
 
 	/*
-	 * @@@ quick and dirty. We could also use mosquitto_socket to get the
-	 * fd, then select/poll, and call mosquitto_loop_{read,write,misc}
-	 * accordingly. However, this would also burden us with reconnect
-	 * handling and such.
+	 * If publishing (or anything else) made us miss deadlines, the RPM
+	 * values above still cover the right time span, but the telemetry has
+	 * gaps. Let the world know.
 	 */
-	res = mosquitto_loop_start(mosq);
-	if (res < 0) {
-		fprintf(stderr, "mosquitto_loop_start: %d\n", res);
-		exit(1);
+	if (poll_timer.missed != poll_missed) {
+		if (verbose)
+			fprintf(stderr, "missed %lu poll deadline(s)\n",
+			    poll_timer.missed - poll_missed);
+		poll_missed = poll_timer.missed;
+		pub_update(mosq, poll_missed_topic, poll_missed);
+	}
+
+	poll_adapt(changed);
+}
+
+
+/*
+ * Publish statistics of the publish policy, totalled over all classes, of
+ * register accesses, and of latencies and errors.
+ */
+
+static void pub_stats_update(void *user)
+{
+	struct mosquitto *mosq = user;
+	unsigned long sent = 0, suppressed = 0;
+	const struct pub_stats *st;
+	char buf[MAX_STATS_MSG];
+	size_t len;
+
+	for (st = pub_stats; st != pub_stats + pub_n_classes; st++) {
+		sent += st->sent;
+		suppressed += st->suppressed;
 	}
+	if (verbose)
+		fprintf(stderr, "published %lu, suppressed %lu\n",
+		    sent, suppressed);
+	pub_update(mosq, pub_sent_topic, sent);
+	pub_update(mosq, pub_suppr_topic, suppressed);
+
+	if (verbose)
+		fprintf(stderr,
+		    "registers: %lu reads, %lu writes, %lu skipped\n",
+		    regmap_stats.reads, regmap_stats.writes,
+		    regmap_stats.skipped);
+	pub_update(mosq, reg_reads_topic, regmap_stats.reads);
+	pub_update(mosq, reg_writes_topic, regmap_stats.writes);
+	pub_update(mosq, reg_skipped_topic, regmap_stats.skipped);
+	pub_update(mosq, reg_mismatch_topic, regmap_stats.mismatches);
+
+	len = stats_summary(buf, sizeof(buf));
+	if (!len) {
+		fprintf(stderr, "stats message too long\n");
+		return;
+	}
+	pub_send_raw(mosq, stats_topic, buf, len);
+	pub_stats[pub_status].sent++;
+}
+
+
+static void dump_stats(void *user, int sig)
+{
+	(void) user;
+	(void) sig;
+
+	stats_dump(stderr);
+}
+
+
+static void stop(void *user, int sig)
+{
+	(void) user;
+
+	if (verbose)
+		fprintf(stderr, "%s\n", strsignal(sig));
+	loop_stop();
 }
 
 
@@ -334,7 +1446,81 @@ static void manual(const char *arg, bool invert)
 		exit(1);
 	}
 	init_pwm(NULL, invert, 0, n);
-	pwm_start(0, 0);
+}
+
+
+static void init_board(void)
+{
+	unsigned i;
+
+	board = board_setup(generation);
+	n_fans = board->n_fans;
+	for (i = 0; i != n_fans; i++)
+		fans[i].bf = board->fans + i;
+}
+
+
+static void init_topics(void)
+{
+	unsigned i;
+
+	poll_missed_topic = pub_topic(MQTT_TOPIC_POLL_MISSED, pub_status);
+	state_topic = pub_topic(MQTT_TOPIC_STATE, pub_state);
+	alarm_topic = pub_topic(MQTT_TOPIC_ALARM, pub_alarm);
+	watchdog_topic = pub_topic(MQTT_TOPIC_WATCHDOG, pub_alarm);
+	pub_sent_topic = pub_topic(MQTT_TOPIC_PUB_SENT, pub_status);
+	pub_suppr_topic = pub_topic(MQTT_TOPIC_PUB_SUPPR, pub_status);
+	reg_reads_topic = pub_topic(MQTT_TOPIC_REG_READS, pub_status);
+	reg_writes_topic = pub_topic(MQTT_TOPIC_REG_WRITES, pub_status);
+	reg_skipped_topic = pub_topic(MQTT_TOPIC_REG_SKIPPED, pub_status);
+	reg_mismatch_topic = pub_topic(MQTT_TOPIC_REG_MISMATCH, pub_status);
+	stats_topic = pub_topic(MQTT_TOPIC_STATS, pub_status);
+
+	for (i = 0; i != n_fans; i++)
+		init_fan(fans + i);
+}
+
+
+/*
+ * The trace begins before the tachos are set up, so that a replay sees the
+ * same counter values. We go through the options once more to record those
+ * that shape fand's behaviour.
+ */
+
+static void init_trace(int argc, char **argv)
+{
+	struct trace_header h = {
+		.pclk		= get_pclk(),
+		.generation	= generation,
+		.tachos		= 0,
+		.n_opts		= 0,
+	};
+	const struct board_fan *bf;
+	const struct board_tacho *bt;
+	struct trace_opt *o;
+	int c;
+
+	for (bf = board->fans; bf != board->fans + board->n_fans; bf++)
+		for (bt = bf->tachos; bt != bf->tachos + bf->n_tachos; bt++)
+			h.tachos |= 1 << (bt->ttc * 3 + bt->timer);
+
+	optind = 1;
+	while ((c = getopt(argc, argv, OPTIONS)) != EOF) {
+		if (strchr(NOT_TRACED, c))
+			continue;
+		if (h.n_opts == TRACE_MAX_OPTS) {
+			fprintf(stderr, "too many options to trace\n");
+			exit(1);
+		}
+		o = h.opts + h.n_opts++;
+		o->opt = c;
+		o->file = c == 'C';
+		o->arg = optarg ? optarg : "";
+		o->len = strlen(o->arg);
+	}
+
+	h.t0_ns = mono_ns();
+	trace_record(trace_path, &h);
 }
 
 
@@ -376,17 +1562,64 @@ static void set_generation(void)
 static void usage(const char *name)
 {
 	fprintf(stderr,
-"usage: %s [-b] [-f] [-g 0|1|2] [-i] [-t seconds] [-v] [duty]\n\n"
+"usage: %s [-a seconds] [-A cpu] [-b] [-c seconds] [-C config] [-f]\n"
+"       %*s [-g 0|1|2] [-H file] [-i] [-k kp,ki,kd] [-m count|period]\n"
+"       %*s [-M [address:]port|unix:path] [-p priority] [-P hz]\n"
+"       %*s [-r mem|uio|file:path] [-R trace] [-s json|cbor [-S]]\n"
+"       %*s [-t seconds] [-v] [-V]\n"
+"       %*s [duty]\n\n"
+"  -a seconds\n"
+"      adaptive polling: poll this often after commands and while the fans\n"
+"      change speed, and slow down to the -t interval when they are steady\n"
+"  -A cpu\n"
+"      run only on this CPU core\n"
 "  -b  fork and run in the background after initializing\n"
-"  -f  (force) allow also duty cycles < 30%%\n"
-"  -g  LC001 generation: 0 = .01, 1 = .02 to .04, 2 = .05 (default: 1)\n"
+"  -c seconds\n"
+"      closed-loop (rpm-set) control interval (default: %g s)\n"
+"  -C config\n"
+"      read fan curves, publish policies, and other settings from the\n"
+"      configuration file\n"
+"  -f  (force) allow also duty cycles below the fan's minimum (usually 30%%)\n"
+"  -g  LC001 generation: 0 = .01, 1 = .02 to .04, 2 = .05 (default: 1).\n"
+"      Ignored if the configuration file describes the fans.\n"
+"  -H file\n"
+"      record the readings of each poll in a history file (see fandlog)\n"
 "  -i  invert waveform polarity\n"
+"  -k kp,ki,kd\n"
+"      gains of the RPM controller, in %% per RPM (default: %g,%g,%g)\n"
+"  -m count|period\n"
+"      tacho measurement: count edges over the poll interval (default), or\n"
+"      time individual pulses while the fan is slow enough\n"
+"  -M [address:]port|unix:path\n"
+"      serve metrics in the Prometheus text format on this TCP port (on\n"
+"      localhost unless an address is given) or UNIX socket\n"
+"  -p priority\n"
+"      run with real-time (SCHED_FIFO) priority, 1-99, with all memory\n"
+"      locked\n"
+"  -P hz\n"
+"      cpu_1x (pclk) frequency (default: read it from debugfs)\n"
+"  -r mem|uio|file:path\n"
+"      access registers through /dev/mem (default), UIO devices, or a file\n"
+"      (e.g., for simulation)\n"
+"  -R trace\n"
+"      record tacho register values, commands, and duty cycles in this\n"
+"      file, for replaying with fandreplay\n"
+"  -s json|cbor\n"
+"      publish a snapshot of all channels on %s at each poll\n"
+"  -S  only publish the snapshot, not the per-channel pwm and rpm topics\n"
 "  -t seconds\n"
 "      tacho poll interval (default: %g s)\n"
-"  -v  verbose operation\n\n"
+"  -v  verbose operation\n"
+"  -V  verify the register shadow copies against the hardware on each\n"
+"      access (for debugging)\n\n"
 "  duty  set fan 0 PWM (fan(s) affected depends on the board revision) to\n"
 "        the specified duty cycle (an integer, 0 <= duty <= 100).\n"
-    , name, (double) DEFAULT_POLL_INTERVAL_S);
+    , name, (int) strlen(name), "", (int) strlen(name), "",
+    (int) strlen(name), "", (int) strlen(name), "",
+    (int) strlen(name), "",
+    (double) DEFAULT_CONTROL_INTERVAL_S,
+    (double) DEFAULT_KP, (double) DEFAULT_KI, (double) DEFAULT_KD,
+    MQTT_TOPIC_STATE, (double) DEFAULT_POLL_INTERVAL_S);
 	exit(1);
 }
 
@@ -394,48 +1627,132 @@ static void usage(const char *name)
 int main(int argc, char *argv[])
 {
 	struct mosquitto *mosq;
-	struct rpm_ctx rpm_right, rpm_left;
-	struct rpm_ctx rpm_front_1, rpm_front_2;
-	struct rpm_ctx rpm_rear_1, rpm_rear_2;
+	struct loop_timer pub_stats_timer;
 	char *end;
 	bool bg = 0;
 	bool invert = 0;
 	double s;
-	useconds_t us = DEFAULT_POLL_INTERVAL_S * 1e6;
+	char dummy;
+	unsigned i;
 	int c;
 
 	set_generation();
-	while ((c = getopt(argc, argv, "bfg:it:v")) != EOF)
+	while ((c = getopt(argc, argv, OPTIONS)) != EOF)
 		switch (c) {
+		case 'a':
+			poll_fast_s = strtod(optarg, &end);
+			if (*end || poll_fast_s < 1e-3) {
+				fprintf(stderr, "invalid duration: \"%s\"\n",
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 'A':
+			rt_cpu = strtoul(optarg, &end, 0);
+			if (*end || rt_cpu < 0)
+				usage(*argv);
+			break;
 		case 'b':
 			bg = 1;
 			break;
+		case 'c':
+			ctl_s = strtod(optarg, &end);
+			if (*end || ctl_s < 1e-3) {
+				fprintf(stderr, "invalid duration: \"%s\"\n",
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 'C':
+			conf_read(optarg, conf_tables);
+			break;
 		case 'f':
 			force = 1;
 			break;
+		case 'H':
+			hist_path = optarg;
+			break;
 		case 'i':
 			invert = 1;
 			break;
+		case 'k':
+			if (sscanf(optarg, "%lf,%lf,%lf%c",
+			    &pid_kp, &pid_ki, &pid_kd, &dummy) != 3)
+				usage(*argv);
+			break;
 		case 'g':
 			generation = strtoul(optarg, &end, 0);
 			if (*end || generation > 2)
 				usage(*argv);
 			break;
+		case 'm':
+			if (!strcmp(optarg, "count"))
+				period = 0;
+			else if (!strcmp(optarg, "period"))
+				period = 1;
+			else
+				usage(*argv);
+			break;
+		case 'M':
+			metrics_spec = optarg;
+			break;
+		case 'p':
+			rt_priority = strtoul(optarg, &end, 0);
+			if (*end ||
+			    rt_priority < sched_get_priority_min(SCHED_FIFO) ||
+			    rt_priority > sched_get_priority_max(SCHED_FIFO))
+				usage(*argv);
+			break;
+		case 'P':
+			pclk = strtoul(optarg, &end, 0);
+			if (*end || !pclk)
+				usage(*argv);
+			break;
+		case 'r':
+			regmap_backend(optarg);
+			break;
+		case 'R':
+			trace_path = optarg;
+			break;
+		case 's':
+			if (!strcmp(optarg, "json"))
+				state_format = state_json;
+			else if (!strcmp(optarg, "cbor"))
+				state_format = state_cbor;
+			else
+				usage(*argv);
+			state = 1;
+			break;
+		case 'S':
+			state_only = 1;
+			break;
 		case 't':
 			s = strtof(optarg, &end);
-			us = s * 1e6;
-			if (*end || s <= 0 || !us) {
+			if (*end || s < 1e-6) {
 				fprintf(stderr, "invalid duration: \"%s\"\n",
 				    optarg);
 				exit(1);
 			}
+			poll_s = s;
 			break;
 		case 'v':
 			verbose = 1;
 			break;
+		case 'V':
+			regmap_verify = 1;
+			break;
 		default:
 			usage(*argv);
 		}
+	if (state_only && !state)
+		usage(*argv);
+	if (poll_fast_s > poll_s) {
+		fprintf(stderr, "-a interval must not exceed -t interval\n");
+		exit(1);
+	}
+
+	init_board();
+
 	switch (argc - optind) {
 	case 0:
 		break;
@@ -446,62 +1763,51 @@ int main(int argc, char *argv[])
 		usage(*argv);
 	}
 
-	mosq = setup_mqtt();
-	init_pwm(mosq, invert, 0, 100);
-	init_pwm(mosq, invert, 1, 100);
+	if (trace_path)
+		init_trace(argc, argv);
+	init_commands();
+	init_topics();
 
-	switch (generation) {
-	case 0:
-	case 1:
-		rpm_init(&rpm_right, 0, 1, 0);
-		rpm_init(&rpm_left, 1, 1, 0);
-		break;
-	case 2:
-		rpm_init(&rpm_front_1, 0, 1, 0);
-		rpm_init(&rpm_front_2, 1, 1, 0);
-		rpm_init(&rpm_rear_1, 0, 2, 0);
-		rpm_init(&rpm_rear_2, 1, 2, 0);
-		break;
-	default:
-		abort();
-	}
+	mosq = mqtt_setup(MQTT_HOST, MQTT_PORT, connected, cb);
+	for (i = 0; i != n_fans; i++)
+		init_pwm(mosq, invert, i, 100);
+	if (hist_path)
+		init_history();
 
 	if (bg)
 		daemonize();
-
-	mqtt_start(mosq);
-
-	switch (generation) {
-	case 0:
-	case 1:
-		update_pwm(mosq, MQTT_TOPIC_L_PWM_MIN, FAN_MIN_DUTY);
-		update_pwm(mosq, MQTT_TOPIC_R_PWM_MIN, FAN_MIN_DUTY);
-
-		while (1) {
-			usleep(us);
-			update_rpm(mosq, MQTT_TOPIC_R_RPM, rpm_poll(&rpm_right));
-			update_rpm(mosq, MQTT_TOPIC_L_RPM, rpm_poll(&rpm_left));
-		}
-		break;
-	case 2:
-		update_pwm(mosq, MQTT_TOPIC_F_PWM_MIN, FAN_MIN_DUTY);
-		update_pwm(mosq, MQTT_TOPIC_RE_PWM_MIN, FAN_MIN_DUTY);
-
-		while (1) {
-			usleep(us);
-			update_rpm(mosq, MQTT_TOPIC_F_1_RPM,
-			    rpm_poll(&rpm_front_1));
-			update_rpm(mosq, MQTT_TOPIC_F_2_RPM,
-			    rpm_poll(&rpm_front_2));
-			update_rpm(mosq, MQTT_TOPIC_R_1_RPM,
-			    rpm_poll(&rpm_rear_1));
-			update_rpm(mosq, MQTT_TOPIC_R_2_RPM,
-			    rpm_poll(&rpm_rear_2));
-		}
-		break;
-	default:
-		abort();
-	}
-
+	rt_setup(rt_priority, rt_cpu);
+	if (watchdog_enabled())
+		watchdog_start(watchdog_guard ? failsafe_full : NULL);
+
+	signal(SIGPIPE, SIG_IGN);
+	loop_init();
+	loop_signal(SIGINT, stop, NULL);
+	loop_signal(SIGTERM, stop, NULL);
+	loop_signal(SIGUSR1, dump_stats, NULL);
+	loop_timer_init(&poll_timer, poll_tacho, mosq);
+	poll_cur_s = poll_fast_s ? poll_fast_s : poll_s;
+	poll_busy_ns = mono_ns();
+	loop_timer_set(&poll_timer, poll_cur_s, poll_cur_s);
+	init_control();
+	loop_timer_init(&ctl_timer, control, mosq);
+	loop_timer_init(&slew_timer, slew_tick, NULL);
+	init_alarms(mosq);
+	init_watchdog(mosq);
+	if (metrics_spec)
+		metrics_listen(metrics_spec, write_metrics);
+	curve_mosq = mosq;
+	curve_start(board, apply_curve);
+	pub_start(mosq);
+	loop_timer_init(&pub_stats_timer, pub_stats_update, mosq);
+	loop_timer_set(&pub_stats_timer, PUB_STATS_INTERVAL_S,
+	    PUB_STATS_INTERVAL_S);
+	start_tacho_irqs();
+	mqtt_start();
+
+	loop_run();
+
+	watchdog_stop();
+	mqtt_stop();
 	return 0;
 }
@@ -0,0 +1,302 @@
+/*
+ * fandlog.c - Dump and aggregate the history recorded by fand -H
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _XOPEN_SOURCE	/* for strptime */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "hist.h"
+
+
+#define	MAX_REC \
+	(sizeof(struct hist_rec) + HIST_MAX_FANS * \
+	(sizeof(struct hist_fan) + HIST_MAX_TACHOS * sizeof(struct hist_tacho)))
+
+
+struct acc_tacho {
+	unsigned min, max;
+	double sum;
+};
+
+struct acc_fan {
+	double duty_sum;
+	unsigned flags;
+	struct acc_tacho tachos[HIST_MAX_TACHOS];
+};
+
+struct acc {
+	uint64_t t_ms;		/* start of the bucket */
+	unsigned n;
+	struct acc_fan fans[HIST_MAX_FANS];
+};
+
+
+static struct hist hist;
+
+
+/* ----- Output ------------------------------------------------------------ */
+
+
+static void print_time(uint64_t t_ms)
+{
+	time_t t = t_ms / 1000;
+	char buf[40];
+
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	printf("%s.%03u", buf, (unsigned) (t_ms % 1000));
+}
+
+
+static void dump(const struct hist_rec *r)
+{
+	const struct hist_header *hdr = hist.hdr;
+	struct hist_fan *f;
+	unsigned i, j;
+
+	print_time((uint64_t) r->t_s * 1000 + r->t_ms);
+	for (i = 0; i != hdr->n_fans; i++) {
+		f = hist_fan(&hist, r, i);
+		printf("  %s %u%%", hdr->names[i], f->duty);
+		for (j = 0; j != hdr->fan_tachos[i]; j++)
+			printf(" %u", hist_tacho(f, j)->rpm);
+		if (f->flags)
+			printf(" 0x%x", f->flags);
+	}
+	putchar('\n');
+}
+
+
+static void acc_flush(struct acc *a)
+{
+	const struct hist_header *hdr = hist.hdr;
+	const struct acc_tacho *t;
+	unsigned i, j;
+
+	if (!a->n)
+		return;
+	print_time(a->t_ms);
+	printf("  n=%u", a->n);
+	for (i = 0; i != hdr->n_fans; i++) {
+		printf("  %s %.1f%%", hdr->names[i],
+		    a->fans[i].duty_sum / a->n);
+		for (j = 0; j != hdr->fan_tachos[i]; j++) {
+			t = a->fans[i].tachos + j;
+			printf(" %u/%.0f/%u", t->min, t->sum / a->n, t->max);
+		}
+		if (a->fans[i].flags)
+			printf(" 0x%x", a->fans[i].flags);
+	}
+	putchar('\n');
+	memset(a, 0, sizeof(*a));
+}
+
+
+static void acc_add(struct acc *a, const struct hist_rec *r, uint64_t bucket)
+{
+	const struct hist_header *hdr = hist.hdr;
+	uint64_t t_ms = (uint64_t) r->t_s * 1000 + r->t_ms;
+	struct acc_tacho *t;
+	struct hist_fan *f;
+	unsigned i, j, rpm;
+
+	if (a->n && t_ms - a->t_ms >= bucket)
+		acc_flush(a);
+	if (!a->n)
+		a->t_ms = t_ms - t_ms % bucket;
+	for (i = 0; i != hdr->n_fans; i++) {
+		f = hist_fan(&hist, r, i);
+		a->fans[i].duty_sum += f->duty;
+		a->fans[i].flags |= f->flags;
+		for (j = 0; j != hdr->fan_tachos[i]; j++) {
+			t = a->fans[i].tachos + j;
+			rpm = hist_tacho(f, j)->rpm;
+			if (!a->n || rpm < t->min)
+				t->min = rpm;
+			if (!a->n || rpm > t->max)
+				t->max = rpm;
+			t->sum += rpm;
+		}
+	}
+	a->n++;
+}
+
+
+/* ----- Time ranges ------------------------------------------------------- */
+
+
+/*
+ * A time is either absolute, as seconds since the epoch or as
+ * YYYY-MM-DDTHH:MM:SS (local time), or relative to the last record, as
+ * -N[s|m|h|d].
+ */
+
+static uint64_t parse_time(const char *s, uint64_t last_ms)
+{
+	struct tm tm;
+	const char *p;
+	char *end;
+	double n;
+
+	if (*s == '-') {
+		n = strtod(s + 1, &end);
+		switch (*end) {
+		case 'd':
+			n *= 24;
+			/* fall through */
+		case 'h':
+			n *= 60;
+			/* fall through */
+		case 'm':
+			n *= 60;
+			/* fall through */
+		case 's':
+			end++;
+			break;
+		default:
+			break;
+		}
+		if (end == s + 1 || *end)
+			goto fail;
+		return n * 1000 > last_ms ? 0 : last_ms - n * 1000;
+	}
+
+	memset(&tm, 0, sizeof(tm));
+	p = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (p && !*p) {
+		tm.tm_isdst = -1;
+		return (uint64_t) mktime(&tm) * 1000;
+	}
+	n = strtod(s, &end);
+	if (end != s && !*end && n >= 0)
+		return n * 1000;
+fail:
+	fprintf(stderr, "invalid time \"%s\"\n", s);
+	exit(1);
+}
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-a seconds] [-f from] [-t to] [-i] file\n\n"
+"  -a seconds\n"
+"      aggregate into intervals of this length: average duty cycle, and\n"
+"      minimum/average/maximum RPM of each tacho, and all flags seen\n"
+"  -f from\n"
+"      start at this time (default: oldest record)\n"
+"  -t to\n"
+"      stop before this time (default: after the newest record)\n"
+"  -i  print information about the file instead of records\n\n"
+"Times are seconds since the epoch, YYYY-MM-DDTHH:MM:SS (local time), or\n"
+"-N[s|m|h|d], relative to the newest record.\n"
+    , name);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *from = NULL, *to = NULL;
+	uint8_t buf[MAX_REC];
+	const struct hist_rec *r;
+	struct hist_rec *copy = (struct hist_rec *) buf;
+	uint64_t first, end, n, t_ms, last_ms = 0;
+	uint64_t from_ms = 0, to_ms = UINT64_MAX;
+	uint64_t bucket = 0;
+	unsigned long skipped = 0;
+	bool info = 0;
+	struct acc acc;
+	char *p;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:f:it:")) != EOF)
+		switch (c) {
+		case 'a':
+			bucket = strtod(optarg, &p) * 1000;
+			if (*p || !bucket)
+				usage(*argv);
+			break;
+		case 'f':
+			from = optarg;
+			break;
+		case 'i':
+			info = 1;
+			break;
+		case 't':
+			to = optarg;
+			break;
+		default:
+			usage(*argv);
+		}
+	if (argc - optind != 1)
+		usage(*argv);
+
+	hist_open(&hist, argv[optind]);
+	first = hist_first(&hist);
+	end = hist_end(&hist);
+
+	if (end != first) {
+		r = hist_get(&hist, end - 1);
+		if (r)
+			last_ms = (uint64_t) r->t_s * 1000 + r->t_ms;
+	}
+	if (from)
+		from_ms = parse_time(from, last_ms);
+	if (to)
+		to_ms = parse_time(to, last_ms);
+
+	if (info) {
+		unsigned i;
+
+		printf("records: %llu of %u, %u bytes each\n",
+		    (unsigned long long) (end - first), hist.hdr->capacity,
+		    hist.hdr->rec_size);
+		for (i = 0; i != hist.hdr->n_fans; i++)
+			printf("fan %s: %u tacho(s)\n", hist.hdr->names[i],
+			    hist.hdr->fan_tachos[i]);
+		if (end != first) {
+			printf("newest: ");
+			print_time(last_ms);
+			putchar('\n');
+		}
+		return 0;
+	}
+
+	memset(&acc, 0, sizeof(acc));
+	for (n = first; n != end; n++) {
+		/* fand may overwrite the record while we look at it */
+		r = hist_get(&hist, n);
+		if (r)
+			memcpy(copy, r, hist.hdr->rec_size);
+		if (!r || !hist_get(&hist, n) ||
+		    copy->seq != (uint32_t) (n + 1)) {
+			skipped++;
+			continue;
+		}
+		t_ms = (uint64_t) copy->t_s * 1000 + copy->t_ms;
+		if (t_ms < from_ms || t_ms >= to_ms)
+			continue;
+		if (bucket)
+			acc_add(&acc, copy, bucket);
+		else
+			dump(copy);
+	}
+	acc_flush(&acc);
+	if (skipped)
+		fprintf(stderr, "skipped %lu invalid record(s)\n", skipped);
+	return 0;
+}
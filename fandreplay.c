@@ -0,0 +1,338 @@
+/*
+ * fandreplay.c - Replay a trace recorded by fand
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * We include fand.c, so that the replay runs the very code of the daemon. Its
+ * main sets everything up as usual, with the options from the trace, and then
+ * calls mqtt_start, where we take over and feed it the recorded events, each
+ * at its recorded time, instead of entering the event loop.
+ */
+
+#define _GNU_SOURCE	/* for memfd_create */
+
+int fand_main(int argc, char *argv[]);
+
+#define	main	fand_main
+#include "fand.c"
+#undef	main
+
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "ttc.h"
+#include "mosqstub.h"
+
+
+#define	MAX_ARGS	(2 * TRACE_MAX_OPTS + 8)
+#define	MAX_REPORT	10
+
+
+static struct mosquitto *replay_mosq;
+static void (*replay_connected)(struct mosquitto *mosq);
+static bool replay_up;		/* the recorded state of the connection */
+
+
+/* ----- Register image ---------------------------------------------------- */
+
+
+static int memfd(const char *name)
+{
+	int fd;
+
+	fd = memfd_create(name, 0);
+	if (fd < 0) {
+		perror("memfd_create");
+		exit(1);
+	}
+	return fd;
+}
+
+
+/*
+ * The registers live in a memory file. The tacho timers' inputs come from the
+ * trace. The PWM counters are parked at the end of the period, where pwm_duty
+ * never has to wait for a window, which would never come with the clock
+ * standing still.
+ */
+
+static void setup_registers(void)
+{
+	static char spec[40];	/* regmap_backend keeps a pointer */
+	unsigned ttc, timer;
+
+	snprintf(spec, sizeof(spec), "file:/proc/self/fd/%d",
+	    memfd("fand-regs"));
+	regmap_backend(spec);
+
+	ttc_open();
+	for (ttc = 0; ttc != 2; ttc++)
+		for (timer = 0; timer != 3; timer++)
+			TTC_COUNTER(ttc, timer) = 0xffff;
+}
+
+
+/* ----- Command line ------------------------------------------------------ */
+
+
+/*
+ * Options whose argument is a file get a memory file with the recorded
+ * content.
+ */
+
+static const char *file_arg(const struct trace_opt *o)
+{
+	char *path;
+	int fd;
+
+	fd = memfd("fand-arg");
+	if (write(fd, o->arg, o->len) != (ssize_t) o->len) {
+		perror("write");
+		exit(1);
+	}
+	if (asprintf(&path, "/proc/self/fd/%d", fd) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	return path;
+}
+
+
+static char *number(unsigned long n)
+{
+	char *s;
+
+	if (asprintf(&s, "%lu", n) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	return s;
+}
+
+
+static int build_args(const struct trace_header *h, char *argv0,
+    int argc, char **argv, char **args)
+{
+	const struct trace_opt *o;
+	const char *spec;
+	int n = 0;
+
+	if (h->n_opts * 2 + argc + 5 > MAX_ARGS) {
+		fprintf(stderr, "too many options\n");
+		exit(1);
+	}
+	args[n++] = argv0;
+	args[n++] = "-P";
+	args[n++] = number(h->pclk);
+	args[n++] = "-g";
+	args[n++] = number(h->generation);
+	for (o = h->opts; o != h->opts + h->n_opts; o++) {
+		spec = strchr(OPTIONS, o->opt);
+		if (!spec) {
+			fprintf(stderr, "unknown option -%c in trace\n",
+			    o->opt);
+			exit(1);
+		}
+		if (asprintf(args + n++, "-%c", o->opt) < 0) {
+			perror("asprintf");
+			exit(1);
+		}
+		if (spec[1] != ':')
+			continue;
+		args[n++] = (char *) (o->file ? file_arg(o) : o->arg);
+	}
+	while (argc--)
+		args[n++] = *argv++;
+	args[n] = NULL;
+	return n;
+}
+
+
+/* ----- Replay ------------------------------------------------------------ */
+
+
+static struct tacho *find_tacho(uint8_t ttc, uint8_t timer)
+{
+	struct fan *fan;
+	unsigned i;
+
+	for (fan = fans; fan != fans + n_fans; fan++)
+		for (i = 0; i != fan->n_tachos; i++)
+			if (fan->tachos[i].ttc == ttc &&
+			    fan->tachos[i].timer == timer)
+				return fan->tachos + i;
+	return NULL;
+}
+
+
+static void run(const struct trace_event *ev)
+{
+	struct mosquitto_message msg;
+	struct tacho *t;
+
+	switch (ev->kind) {
+	case trace_poll:
+		poll_tacho(replay_mosq);
+		break;
+	case trace_control:
+		control(replay_mosq);
+		break;
+	case trace_alarm:
+		check_alarms(replay_mosq);
+		break;
+	case trace_slew:
+		slew_tick(NULL);
+		break;
+	case trace_curve:
+		curve_check();
+		break;
+	case trace_irq:
+		t = find_tacho(ev->ttc, ev->timer);
+		if (!t) {
+			fprintf(stderr, "interrupt from TTC%u timer %u, which "
+			    "is not a tacho\n", ev->ttc, ev->timer);
+			exit(1);
+		}
+		tacho_irq(t);
+		break;
+	case trace_command:
+		msg.mid = 0;
+		msg.topic = (char *) ev->topic;
+		msg.payload = (void *) ev->payload;
+		msg.payloadlen = ev->len;
+		msg.qos = 0;
+		msg.retain = 0;
+		cb(replay_mosq, NULL, &msg);
+		break;
+	case trace_watchdog:
+		watchdog_tick(replay_mosq);
+		break;
+	case trace_connect:
+		replay_up = ev->up;
+		if (ev->up)
+			replay_connected(replay_mosq);
+		break;
+	default:
+		abort();
+	}
+}
+
+
+static double real_s(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		perror("clock_gettime");
+		exit(1);
+	}
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ * Called by fand_main once everything is set up. We never return.
+ */
+
+void mqtt_start(void)
+{
+	struct trace_event ev;
+	uint64_t t0 = mono_ns();
+	uint64_t t1 = t0;
+	double start = real_s();
+	double elapsed;
+
+	while (trace_next(&ev)) {
+		run(&ev);
+		t1 = ev.ns;
+	}
+	elapsed = real_s() - start;
+
+	printf("%lu events, %lu reads, %lu outputs, %lu mismatch%s\n",
+	    trace_stats.events, trace_stats.reads, trace_stats.outputs,
+	    trace_stats.mismatches, trace_stats.mismatches == 1 ? "" : "es");
+	printf("%.3f s of trace in %.3f s (%.0fx)\n",
+	    (t1 - t0) * 1e-9, elapsed,
+	    elapsed > 0 ? (t1 - t0) * 1e-9 / elapsed : 0);
+	exit(trace_stats.mismatches ? 1 : 0);
+}
+
+
+/* ----- MQTT stand-in ----------------------------------------------------- */
+
+
+struct mosquitto *mqtt_setup(const char *host, int port,
+    void (*connected_fn)(struct mosquitto *mosq),
+    void (*cb_fn)(struct mosquitto *mosq, void *obj,
+    const struct mosquitto_message *msg))
+{
+	(void) host;
+	(void) port;
+	(void) cb_fn;
+
+	replay_mosq = mosqstub_mosq;
+	replay_connected = connected_fn;
+	return replay_mosq;
+}
+
+
+void mqtt_stop(void)
+{
+}
+
+
+bool mqtt_connected(void)
+{
+	return replay_up;
+}
+
+
+/* ----- Command-line processing ------------------------------------------- */
+
+
+static void replay_usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-v] trace [-- fand-option ...]\n\n"
+"  -v  report all mismatches, not only the first %u\n"
+"  fand-option\n"
+"      additional options for fand, e.g., to try different settings on the\n"
+"      same inputs\n"
+    , name, MAX_REPORT);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct trace_header h;
+	unsigned long max_report = MAX_REPORT;
+	char *args[MAX_ARGS + 1];
+	int c, n;
+
+	while ((c = getopt(argc, argv, "v")) != EOF)
+		switch (c) {
+		case 'v':
+			max_report = ULONG_MAX;
+			break;
+		default:
+			replay_usage(*argv);
+		}
+	if (optind == argc)
+		replay_usage(*argv);
+
+	setup_registers();
+	trace_replay(argv[optind], &h, max_report);
+	setenv("BOARD_GENERATION", h.generation == 2 ? "2" : "1", 1);
+
+	n = build_args(&h, *argv, argc - optind - 1, argv + optind + 1, args);
+	optind = 1;
+	watchdog_guard = 0;	/* the loop never runs */
+	return fand_main(n, args);
+}
@@ -0,0 +1,584 @@
+/*
+ * fansim.c - Simulate fans on emulated TTC registers
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+/*
+ * fansim shares a register file with "fand -r file:PATH". It reads the duty
+ * cycle of each PWM channel from TTC_MATCH_1 / TTC_INTERVAL and advances the
+ * tacho timers of the channel according to a simple fan model: a linear
+ * duty-to-RPM curve, a stall threshold, first-order inertia, and noise.
+ * Faults can be scheduled in the configuration file.
+ *
+ * The wiring comes from the board description, as in fand (see board.h).
+ *
+ * @@@ TTC_ISR is clear-on-read, which shared memory cannot emulate. The
+ * simulator therefore never sets interrupt status bits. In count mode, fand
+ * then detects counter wraps only by comparing counts, which is correct as
+ * long as the counter does not wrap twice between polls. In period mode, we
+ * stop updating TTC_EV_REG if a pulse is too long to measure, and fand finds
+ * the fan stopped when it then counts edges.
+ */
+
+#define _GNU_SOURCE	/* for asprintf */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include "mono.h"
+#include "conf.h"
+#include "board.h"
+#include "regmap.h"
+#include "ttc.h"
+
+
+#define	DEFAULT_TICK_S		0.001
+#define	DEFAULT_PCLK		111111111	/* Zynq-7000 at 667 MHz */
+#define	REPORT_INTERVAL_S	1
+
+#define	DEFAULT_RPM_MIN		1200	/* at stall_duty */
+#define	DEFAULT_RPM_MAX		6000	/* at 100% */
+#define	DEFAULT_STALL_DUTY	20	/* percent */
+#define	DEFAULT_TAU_S		1.5	/* inertia */
+#define	DEFAULT_NOISE		0	/* RPM, standard deviation */
+
+
+enum fault_kind {
+	fault_ok,	/* clear all faults */
+	fault_stall,	/* rotor blocked */
+	fault_slow,	/* reaches only "arg" times the normal speed */
+	fault_stuck,	/* tacho signal stuck, rotor turns */
+};
+
+struct model {
+	double rpm_min, rpm_max;
+	double stall_duty;
+	double tau_s;
+	double noise;
+};
+
+struct fault {
+	const char *fan;
+	int tacho;		/* -1 for all */
+	double at_s;
+	enum fault_kind kind;
+	double arg;
+	bool done;
+	struct fault *next;
+};
+
+struct model_conf {
+	const char *fan;
+	struct model model;
+	struct model_conf *next;
+};
+
+struct sim_tacho {
+	const struct board_tacho *bt;
+	struct model *model;
+	double rpm;
+	double cycles;		/* tacho cycles since start */
+	double next_ev;		/* cycle count of the next event timer update */
+	enum fault_kind fault;
+	double slow;
+};
+
+
+static const struct model default_model = {
+	.rpm_min	= DEFAULT_RPM_MIN,
+	.rpm_max	= DEFAULT_RPM_MAX,
+	.stall_duty	= DEFAULT_STALL_DUTY,
+	.tau_s		= DEFAULT_TAU_S,
+	.noise		= DEFAULT_NOISE,
+};
+
+static struct model_conf *model_confs = NULL;
+static struct fault *faults = NULL;
+static bool verbose = 0;
+static unsigned long pclk = DEFAULT_PCLK;
+
+
+/* ----- Configuration ----------------------------------------------------- */
+
+
+static double number(const char *s, const char *what)
+{
+	char *end;
+	double n;
+
+	n = strtod(s, &end);
+	if (end == s || *end)
+		conf_error("invalid %s \"%s\"", what, s);
+	return n;
+}
+
+
+static char *stralloc(const char *s)
+{
+	char *tmp;
+
+	tmp = strdup(s);
+	if (!tmp) {
+		perror("strdup");
+		exit(1);
+	}
+	return tmp;
+}
+
+
+static void *alloc(size_t size)
+{
+	void *p;
+
+	p = calloc(1, size);
+	if (!p) {
+		perror("calloc");
+		exit(1);
+	}
+	return p;
+}
+
+
+/*
+ * model FAN SETTING VALUE ...
+ */
+
+static void conf_model(int argc, char *const *argv)
+{
+	struct model_conf *mc = alloc(sizeof(*mc));
+	struct model *m = &mc->model;
+	int i;
+
+	if (!(argc & 1))
+		conf_error("settings come in pairs");
+	mc->fan = stralloc(argv[0]);
+	*m = default_model;
+	for (i = 1; i != argc; i += 2) {
+		const char *name = argv[i];
+		double value = number(argv[i + 1], name);
+
+		if (!strcmp(name, "rpm-min"))
+			m->rpm_min = value;
+		else if (!strcmp(name, "rpm-max"))
+			m->rpm_max = value;
+		else if (!strcmp(name, "stall-duty"))
+			m->stall_duty = value;
+		else if (!strcmp(name, "tau"))
+			m->tau_s = value;
+		else if (!strcmp(name, "noise"))
+			m->noise = value;
+		else
+			conf_error("unknown setting \"%s\"", name);
+	}
+	if (m->stall_duty < 0 || m->stall_duty >= 100)
+		conf_error("stall duty must be 0 <= duty < 100");
+	if (m->tau_s < 0)
+		conf_error("tau must not be negative");
+	mc->next = model_confs;
+	model_confs = mc;
+}
+
+
+/*
+ * fault FAN[/TACHO] SECONDS ok|stall|slow FACTOR|stuck
+ */
+
+static void conf_fault(int argc, char *const *argv)
+{
+	struct fault *f = alloc(sizeof(*f));
+	struct fault **anchor;
+	char *slash, *end;
+
+	f->fan = stralloc(argv[0]);
+	f->tacho = -1;
+	slash = strchr(f->fan, '/');
+	if (slash) {
+		*slash = 0;
+		f->tacho = strtoul(slash + 1, &end, 0) - 1;
+		if (*end || f->tacho < 0 || f->tacho >= BOARD_MAX_TACHOS)
+			conf_error("invalid tacho \"%s\"", slash + 1);
+	}
+	f->at_s = number(argv[1], "time");
+	if (!strcmp(argv[2], "ok"))
+		f->kind = fault_ok;
+	else if (!strcmp(argv[2], "stall"))
+		f->kind = fault_stall;
+	else if (!strcmp(argv[2], "slow"))
+		f->kind = fault_slow;
+	else if (!strcmp(argv[2], "stuck"))
+		f->kind = fault_stuck;
+	else
+		conf_error("unknown fault \"%s\"", argv[2]);
+	if ((f->kind == fault_slow) != (argc == 4))
+		conf_error("only \"slow\" takes an argument");
+	if (argc == 4)
+		f->arg = number(argv[3], "factor");
+	for (anchor = &faults; *anchor; anchor = &(*anchor)->next);
+	*anchor = f;
+}
+
+
+static const struct conf_keyword sim_conf[] = {
+	{ "model",	1, 11,	conf_model },
+	{ "fault",	3, 4,	conf_fault },
+	{ NULL, 0, 0, NULL }
+};
+
+static const struct conf_keyword *const conf_tables[] = {
+	board_conf,
+	sim_conf,
+	NULL
+};
+
+
+/* ----- Model ------------------------------------------------------------- */
+
+
+static double gauss(void)
+{
+	double u1 = drand48();
+	double u2 = drand48();
+
+	if (u1 < 1e-300)
+		u1 = 1e-300;
+	return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+
+/*
+ * A stopped PWM timer leaves the output static. 4-wire fans have a pull-up
+ * on the PWM input, so we treat this as 100%.
+ */
+
+static double read_duty(const struct board_fan *bf)
+{
+	uint32_t intv = TTC_INTERVAL(bf->ttc, bf->timer) & 0xffff;
+
+	if (TTC_CNT_CTRL(bf->ttc, bf->timer) & 1 << TTC_CNT_CTRL_nEN_SHIFT)
+		return 100;
+	if (!intv)
+		return 0;
+	return 100.0 * (TTC_MATCH_1(bf->ttc, bf->timer) & 0xffff) / intv;
+}
+
+
+static double target_rpm(const struct model *m, double duty)
+{
+	if (duty < m->stall_duty)
+		return 0;
+	return m->rpm_min + (m->rpm_max - m->rpm_min) *
+	    (duty - m->stall_duty) / (100 - m->stall_duty);
+}
+
+
+/*
+ * The event timer counts the prescaled pclk while the tacho signal is high,
+ * i.e., for half a tacho cycle.
+ */
+
+static void update_ev(struct sim_tacho *st, double hz)
+{
+	const struct board_tacho *bt = st->bt;
+	uint32_t clk = TTC_CLK_CTRL(bt->ttc, bt->timer);
+	double tick_s = 1.0 / pclk;
+	double ticks;
+
+	if (clk & 1 << TTC_CLK_CTRL_PRE_EN_SHIFT)
+		tick_s *= 2 << (clk >> TTC_CLK_CTRL_PRE_SHR_SHIFT &
+		    TTC_CLK_CTRL_PRE_SHR_MASK);
+	ticks = 1 / (2 * hz * tick_s);
+	if (ticks > 0xffff)
+		return;
+	TTC_EV_REG(bt->ttc, bt->timer) = ticks;
+}
+
+
+static void step_tacho(struct sim_tacho *st, double duty, double dt)
+{
+	const struct board_tacho *bt = st->bt;
+	const struct model *m = st->model;
+	double target, hz;
+	uint64_t edges;
+
+	switch (st->fault) {
+	case fault_stall:
+		target = 0;
+		break;
+	case fault_slow:
+		target = target_rpm(m, duty) * st->slow;
+		break;
+	default:
+		target = target_rpm(m, duty);
+		break;
+	}
+	if (m->tau_s)
+		st->rpm += (target - st->rpm) * (1 - exp(-dt / m->tau_s));
+	else
+		st->rpm = target;
+
+	hz = st->rpm / 60 * bt->ppr;
+	if (hz > 0 && m->noise)
+		hz *= 1 + m->noise * gauss() / st->rpm;
+	if (hz <= 0 || st->fault == fault_stuck)
+		return;
+	edges = (uint64_t) (st->cycles + hz * dt) - (uint64_t) st->cycles;
+	st->cycles += hz * dt;
+
+	/* the counter keeps its value when the clock source changes */
+	if (TTC_CLK_CTRL(bt->ttc, bt->timer) &
+	    1 << TTC_CLK_CTRL_EXT_CLK_SHIFT) {
+		TTC_COUNTER(bt->ttc, bt->timer) =
+		    (TTC_COUNTER(bt->ttc, bt->timer) + edges) & 0xffff;
+	} else if (TTC_EV_CTRL(bt->ttc, bt->timer) &
+	    1 << TTC_EV_CTRL_EN_SHIFT) {
+		if (st->cycles >= st->next_ev) {
+			update_ev(st, hz);
+			st->next_ev = floor(st->cycles) + 1;
+		}
+	}
+}
+
+
+/* ----- Faults ------------------------------------------------------------ */
+
+
+static void apply_fault(struct sim_tacho *st, const struct fault *f)
+{
+	st->fault = f->kind;
+	st->slow = f->arg;
+}
+
+
+static void check_faults(const struct board *b,
+    struct sim_tacho tachos[][BOARD_MAX_TACHOS], double t_s)
+{
+	struct fault *f;
+	unsigned channels, i, j;
+
+	for (f = faults; f; f = f->next) {
+		if (f->done || t_s < f->at_s)
+			continue;
+		f->done = 1;
+		channels = board_channels(b, f->fan);
+		for (i = 0; i != b->n_fans; i++) {
+			if (!(channels & 1 << i))
+				continue;
+			for (j = 0; j != b->fans[i].n_tachos; j++)
+				if (f->tacho < 0 || (unsigned) f->tacho == j)
+					apply_fault(&tachos[i][j], f);
+		}
+		if (verbose)
+			fprintf(stderr, "%.3f s: fault on %s\n", t_s, f->fan);
+	}
+}
+
+
+/* ----- Setup ------------------------------------------------------------- */
+
+
+static struct model *find_model(const struct board *b, unsigned ch)
+{
+	struct model_conf *mc;
+
+	for (mc = model_confs; mc; mc = mc->next)
+		if (board_channels(b, mc->fan) & 1 << ch)
+			return &mc->model;
+	return (struct model *) &default_model;
+}
+
+
+static void check_names(const struct board *b)
+{
+	const struct model_conf *mc;
+	const struct fault *f;
+
+	for (mc = model_confs; mc; mc = mc->next)
+		if (!board_channels(b, mc->fan)) {
+			fprintf(stderr, "unknown fan \"%s\"\n", mc->fan);
+			exit(1);
+		}
+	for (f = faults; f; f = f->next)
+		if (!board_channels(b, f->fan)) {
+			fprintf(stderr, "unknown fan \"%s\"\n", f->fan);
+			exit(1);
+		}
+}
+
+
+/* ----- Main loop --------------------------------------------------------- */
+
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec		= ns / 1000000000,
+		.tv_nsec	= ns % 1000000000,
+	};
+	int res;
+
+	do res = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	while (res == EINTR);
+	if (res) {
+		fprintf(stderr, "clock_nanosleep: %s\n", strerror(res));
+		exit(1);
+	}
+}
+
+
+static void report(const struct board *b,
+    struct sim_tacho tachos[][BOARD_MAX_TACHOS], double t_s)
+{
+	unsigned i, j;
+
+	fprintf(stderr, "%8.1f", t_s);
+	for (i = 0; i != b->n_fans; i++) {
+		fprintf(stderr, "  %s %3.0f%%", b->fans[i].name,
+		    read_duty(b->fans + i));
+		for (j = 0; j != b->fans[i].n_tachos; j++)
+			fprintf(stderr, " %5.0f", tachos[i][j].rpm);
+	}
+	fprintf(stderr, "\n");
+}
+
+
+static void run(const struct board *b, double tick_s)
+{
+	struct sim_tacho tachos[BOARD_MAX_FANS][BOARD_MAX_TACHOS];
+	uint64_t t0 = mono_ns();
+	uint64_t tick_ns = tick_s * 1e9;
+	uint64_t next = t0, last = t0, next_report = t0, now;
+	double duty, dt;
+	unsigned i, j;
+
+	memset(tachos, 0, sizeof(tachos));
+	for (i = 0; i != b->n_fans; i++)
+		for (j = 0; j != b->fans[i].n_tachos; j++) {
+			tachos[i][j].bt = b->fans[i].tachos + j;
+			tachos[i][j].model = find_model(b, i);
+			tachos[i][j].fault = fault_ok;
+		}
+
+	while (1) {
+		next += tick_ns;
+		sleep_until(next);
+		now = mono_ns();
+		dt = (now - last) * 1e-9;
+		last = now;
+
+		check_faults(b, tachos, (now - t0) * 1e-9);
+		for (i = 0; i != b->n_fans; i++) {
+			duty = read_duty(b->fans + i);
+			for (j = 0; j != b->fans[i].n_tachos; j++)
+				step_tacho(&tachos[i][j], duty, dt);
+		}
+		if (verbose && now >= next_report) {
+			report(b, tachos, (now - t0) * 1e-9);
+			next_report += REPORT_INTERVAL_S * 1000000000ULL;
+		}
+		/* don't try to catch up after a long delay */
+		if (now > next + tick_ns)
+			next = now;
+	}
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-C config] [-g 0|1|2] [-P hz] [-s seed] [-t seconds] [-v]\n"
+"       %*s file\n\n"
+"  -C config\n"
+"      read the wiring, fan models and faults from the configuration file\n"
+"  -g  LC001 generation: 0 = .01, 1 = .02 to .04, 2 = .05 (default: 2 if\n"
+"      BOARD_GENERATION is 2, like fand, 1 otherwise)\n"
+"  -P hz\n"
+"      cpu_1x (pclk) frequency (default: %u). Must match fand -P.\n"
+"  -s seed\n"
+"      seed of the noise generator (default: 0)\n"
+"  -t seconds\n"
+"      simulation step (default: %g s)\n"
+"  -v  report the duty cycles and speeds once per second\n\n"
+"  file  register file, shared with fand -r file:FILE\n\n"
+"Configuration (in addition to fan and tacho, see board.h):\n\n"
+"  model FAN SETTING VALUE ...\n"
+"      rpm-min (at stall-duty, default %u), rpm-max (at 100%%, default\n"
+"      %u), stall-duty (in %%, default %u), tau (inertia in seconds,\n"
+"      default %g), noise (standard deviation in RPM, default %u)\n"
+"  fault FAN[/TACHO] SECONDS ok|stall|slow FACTOR|stuck\n"
+"      at the given time after start, make all tachos of the fan (or only\n"
+"      the given one, counting from 1) fail, or clear the fault\n"
+    , name, (int) strlen(name), "", DEFAULT_PCLK,
+    (double) DEFAULT_TICK_S,
+    DEFAULT_RPM_MIN, DEFAULT_RPM_MAX, DEFAULT_STALL_DUTY,
+    (double) DEFAULT_TAU_S, DEFAULT_NOISE);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	const struct board *b;
+	const char *gen = getenv("BOARD_GENERATION");
+	unsigned generation = gen && !strcmp(gen, "2") ? 2 : 1;
+	double tick_s = DEFAULT_TICK_S;
+	char *end;
+	char *spec;
+	int c;
+
+	while ((c = getopt(argc, argv, "C:g:P:s:t:v")) != EOF)
+		switch (c) {
+		case 'C':
+			conf_read(optarg, conf_tables);
+			break;
+		case 'g':
+			generation = strtoul(optarg, &end, 0);
+			if (*end || generation > 2)
+				usage(*argv);
+			break;
+		case 'P':
+			pclk = strtoul(optarg, &end, 0);
+			if (*end || !pclk)
+				usage(*argv);
+			break;
+		case 's':
+			srand48(strtol(optarg, &end, 0));
+			if (*end)
+				usage(*argv);
+			break;
+		case 't':
+			tick_s = strtod(optarg, &end);
+			if (*end || tick_s < 1e-6)
+				usage(*argv);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(*argv);
+		}
+	if (argc != optind + 1)
+		usage(*argv);
+
+	b = board_setup(generation);
+	check_names(b);
+
+	if (asprintf(&spec, "file:%s", argv[optind]) < 0) {
+		perror("asprintf");
+		exit(1);
+	}
+	regmap_backend(spec);
+	ttc_open();
+
+	run(b, tick_s);
+	return 0;
+}
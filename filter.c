@@ -0,0 +1,215 @@
+/*
+ * filter.c - Smooth RPM readings
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "conf.h"
+#include "board.h"
+#include "filter.h"
+
+
+struct setting {
+	const char *name;	/* fan group */
+	unsigned mask;		/* 1 << SET_x of the settings given */
+	struct filter_settings set;
+	struct setting *next;
+};
+
+enum {
+	SET_SPIKE,
+	SET_SPIKE_MAX,
+	SET_MEDIAN,
+	SET_EMA,
+};
+
+
+static const struct filter_settings defaults = {
+	.spike		= 0,
+	.spike_max	= 2,
+	.median		= 0,
+	.ema_s		= 0,
+};
+
+static struct setting *settings = NULL;
+static struct setting **last_setting = &settings;
+
+
+/* ----- Configuration ----------------------------------------------------- */
+
+
+static double number(const char *s, const char *what, const char *suffix)
+{
+	char *end;
+	double n;
+
+	n = strtod(s, &end);
+	if (end == s || strcmp(end, suffix) || n < 0)
+		conf_error("invalid %s \"%s\"", what, s);
+	return n;
+}
+
+
+static void conf_filter(int argc, char *const *argv)
+{
+	struct setting *st;
+	struct filter_settings *set;
+	int i;
+
+	if (!(argc & 1))
+		conf_error("settings come in pairs");
+	st = calloc(1, sizeof(*st));
+	if (!st) {
+		perror("calloc");
+		exit(1);
+	}
+	st->name = strdup(argv[0]);
+	if (!st->name) {
+		perror("strdup");
+		exit(1);
+	}
+	set = &st->set;
+	for (i = 1; i != argc; i += 2) {
+		const char *name = argv[i];
+		const char *value = argv[i + 1];
+
+		if (!strcmp(name, "spike")) {
+			set->spike = number(value, name, "%") / 100;
+			st->mask |= 1 << SET_SPIKE;
+		} else if (!strcmp(name, "spike-max")) {
+			set->spike_max = number(value, name, "");
+			st->mask |= 1 << SET_SPIKE_MAX;
+		} else if (!strcmp(name, "median")) {
+			set->median = number(value, name, "");
+			if (set->median > FILTER_RING)
+				conf_error("median window must be at most %u",
+				    FILTER_RING);
+			st->mask |= 1 << SET_MEDIAN;
+		} else if (!strcmp(name, "ema")) {
+			set->ema_s = number(value, name, "");
+			st->mask |= 1 << SET_EMA;
+		} else {
+			conf_error("unknown setting \"%s\"", name);
+		}
+	}
+	*last_setting = st;
+	last_setting = &st->next;
+}
+
+
+const struct conf_keyword filter_conf[] = {
+	{ "filter",	3, 9,	conf_filter },
+	{ NULL, 0, 0, NULL }
+};
+
+
+void filter_setup(struct filter_settings *set, const struct board *board,
+    unsigned ch)
+{
+	const struct setting *st;
+	unsigned channels;
+
+	*set = defaults;
+	for (st = settings; st; st = st->next) {
+		channels = board_channels(board, st->name);
+		if (!channels) {
+			fprintf(stderr, "unknown fan group \"%s\"\n", st->name);
+			exit(1);
+		}
+		if (!(channels & 1 << ch))
+			continue;
+		if (st->mask & 1 << SET_SPIKE)
+			set->spike = st->set.spike;
+		if (st->mask & 1 << SET_SPIKE_MAX)
+			set->spike_max = st->set.spike_max;
+		if (st->mask & 1 << SET_MEDIAN)
+			set->median = st->set.median;
+		if (st->mask & 1 << SET_EMA)
+			set->ema_s = st->set.ema_s;
+	}
+}
+
+
+bool filter_enabled(const struct filter_settings *set)
+{
+	return set->spike || set->median > 1 || set->ema_s;
+}
+
+
+/* ----- Filtering --------------------------------------------------------- */
+
+
+void filter_init(struct filter *f, const struct filter_settings *set)
+{
+	f->set = set;
+	f->head = 0;
+	f->n = 0;
+	f->spikes = 0;
+	f->out = 0;
+}
+
+
+static bool spike(struct filter *f, double sample)
+{
+	const struct filter_settings *set = f->set;
+	double d = sample > f->out ? sample - f->out : f->out - sample;
+
+	if (!set->spike || !f->n || !f->out || d <= f->out * set->spike ||
+	    f->spikes >= set->spike_max) {
+		f->spikes = 0;
+		return 0;
+	}
+	f->spikes++;
+	return 1;
+}
+
+
+static double median(const struct filter *f)
+{
+	unsigned n = f->n < f->set->median ? f->n : f->set->median;
+	double v[FILTER_RING];
+	unsigned i, j;
+	double tmp;
+
+	/* insertion sort of the newest n samples */
+	for (i = 0; i != n; i++) {
+		tmp = f->ring[(f->head + FILTER_RING - 1 - i) % FILTER_RING];
+		for (j = i; j && v[j - 1] > tmp; j--)
+			v[j] = v[j - 1];
+		v[j] = tmp;
+	}
+	if (n & 1)
+		return v[n / 2];
+	return (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+
+double filter_update(struct filter *f, double sample, double dt)
+{
+	const struct filter_settings *set = f->set;
+	double v, a;
+
+	if (spike(f, sample))
+		sample = f->ring[(f->head + FILTER_RING - 1) % FILTER_RING];
+	f->ring[f->head] = sample;
+	f->head = (f->head + 1) % FILTER_RING;
+	if (f->n < FILTER_RING)
+		f->n++;
+
+	v = set->median > 1 ? median(f) : sample;
+	if (set->ema_s && f->n > 1) {
+		a = dt / set->ema_s;
+		f->out += (v - f->out) * (a < 1 ? a : 1);
+	} else {
+		f->out = v;
+	}
+	return f->out;
+}
@@ -0,0 +1,91 @@
+/*
+ * filter.h - Smooth RPM readings
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef FILTER_H
+#define	FILTER_H
+
+#include <stdbool.h>
+
+#include "conf.h"
+#include "board.h"
+
+
+/*
+ * Samples pass through the spike rejector, then the moving median, then the
+ * EMA. Each stage can be disabled. By default, all are, and the output is the
+ * input.
+ */
+
+#define	FILTER_RING	16	/* longest median window */
+
+
+struct filter_settings {
+	double spike;		/* relative deviation, 0 = off */
+	unsigned spike_max;	/* consecutive spikes to reject */
+	unsigned median;	/* window, in samples; 0 or 1 = off */
+	double ema_s;		/* time constant, 0 = off */
+};
+
+struct filter {
+	const struct filter_settings *set;
+	double ring[FILTER_RING];	/* samples after spike rejection */
+	unsigned head;			/* next slot */
+	unsigned n;			/* samples in the ring */
+	unsigned spikes;		/* consecutive samples rejected */
+	double out;
+};
+
+
+/*
+ * Configuration:
+ *
+ * filter GROUP SETTING VALUE ...
+ *	RPM filter of the fan group (a fan name or alias, or all). Settings:
+ *
+ *	spike N%	replace a sample that deviates from the filter output
+ *			by more than N% with the previous one. Default: off.
+ *	spike-max N	accept the sample after N consecutive rejections,
+ *			since the speed has then really changed. Default: 2.
+ *	median N	median of the last N samples (at most 16). Default:
+ *			off.
+ *	ema S		exponential moving average with a time constant
+ *			of S seconds. Default: off.
+ */
+
+extern const struct conf_keyword filter_conf[];
+
+
+/*
+ * Settings of channel "ch" of the board. Exits if the configuration names an
+ * unknown group.
+ */
+
+void filter_setup(struct filter_settings *set, const struct board *board,
+    unsigned ch);
+
+/*
+ * 1 if any stage is enabled.
+ */
+
+bool filter_enabled(const struct filter_settings *set);
+
+/*
+ * "set" must remain valid.
+ */
+
+void filter_init(struct filter *f, const struct filter_settings *set);
+
+/*
+ * Add a sample taken "dt" seconds after the previous one, and return the
+ * filter output.
+ */
+
+double filter_update(struct filter *f, double sample, double dt);
+
+#endif /* !FILTER_H */
@@ -0,0 +1,221 @@
+/*
+ * hist.c - History of fan readings in a memory-mapped ring file
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hist.h"
+
+
+static void map(struct hist *h, int fd, const char *path, bool write)
+{
+	void *p;
+
+	p = mmap(NULL, h->size, write ? PROT_READ | PROT_WRITE : PROT_READ,
+	    MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		perror(path);
+		exit(1);
+	}
+	(void) close(fd);
+	h->hdr = p;
+	h->recs = (uint8_t *) p + HIST_HEADER_SIZE;
+}
+
+
+static struct hist_rec *slot(const struct hist *h, uint64_t n)
+{
+	return (struct hist_rec *)
+	    (h->recs + (n % h->hdr->capacity) * h->hdr->rec_size);
+}
+
+
+/* ----- Writing ----------------------------------------------------------- */
+
+
+void hist_create(struct hist *h, const char *path, unsigned capacity,
+    unsigned n_fans, const char *const *names, const unsigned *n_tachos)
+{
+	struct hist_header hdr;
+	struct stat st;
+	unsigned i;
+	int fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = HIST_MAGIC;
+	hdr.version = HIST_VERSION;
+	hdr.capacity = capacity;
+	hdr.n_fans = n_fans;
+	for (i = 0; i != n_fans; i++) {
+		strncpy(hdr.names[i], names[i], HIST_NAME_LEN - 1);
+		hdr.fan_tachos[i] = n_tachos[i];
+		if (n_tachos[i] > hdr.n_tachos)
+			hdr.n_tachos = n_tachos[i];
+	}
+	hdr.rec_size = hist_rec_size(n_fans, hdr.n_tachos);
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(path);
+		exit(1);
+	}
+	h->size = HIST_HEADER_SIZE + (size_t) capacity * hdr.rec_size;
+	if ((size_t) st.st_size != h->size && ftruncate(fd, h->size) < 0) {
+		perror(path);
+		exit(1);
+	}
+	map(h, fd, path, 1);
+
+	/* continue the existing history if nothing but "head" differs */
+	hdr.head = h->hdr->head;
+	if ((size_t) st.st_size == h->size &&
+	    !memcmp(h->hdr, &hdr, sizeof(hdr))) {
+		/* records after "head" may have made it to the file */
+		h->hdr->head = hist_end(h);
+		return;
+	}
+	memset(h->recs, 0, h->size - HIST_HEADER_SIZE);
+	hdr.head = 0;
+	*h->hdr = hdr;
+}
+
+
+/*
+ * A record from the same second as the last one replaces it, so that the ring
+ * covers the same time span at any poll interval.
+ */
+
+struct hist_rec *hist_begin(struct hist *h)
+{
+	uint64_t head = h->hdr->head;
+	struct hist_rec *r;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	h->n = head;
+	if (head) {
+		r = slot(h, head - 1);
+		if (r->seq == (uint32_t) head && r->t_s == (uint32_t) ts.tv_sec)
+			h->n = head - 1;
+	}
+	r = slot(h, h->n);
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELEASE);
+	memset(r + 1, 0, h->hdr->rec_size - sizeof(*r));
+	r->t_s = ts.tv_sec;
+	r->t_ms = ts.tv_nsec / 1000000;
+	return r;
+}
+
+
+void hist_commit(struct hist *h, struct hist_rec *r)
+{
+	__atomic_store_n(&r->seq, (uint32_t) (h->n + 1), __ATOMIC_RELEASE);
+	__atomic_store_n(&h->hdr->head, h->n + 1, __ATOMIC_RELEASE);
+}
+
+
+/* ----- Reading ----------------------------------------------------------- */
+
+
+void hist_open(struct hist *h, const char *path)
+{
+	struct hist_header *hdr;
+	struct stat st;
+	unsigned i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(path);
+		exit(1);
+	}
+	if ((size_t) st.st_size < HIST_HEADER_SIZE) {
+		fprintf(stderr, "%s: file too short\n", path);
+		exit(1);
+	}
+	h->size = st.st_size;
+	map(h, fd, path, 0);
+
+	hdr = h->hdr;
+	if (hdr->magic != HIST_MAGIC || hdr->version != HIST_VERSION) {
+		fprintf(stderr, "%s: not a fand history (version %u)\n", path,
+		    HIST_VERSION);
+		exit(1);
+	}
+	if (!hdr->capacity || hdr->n_fans > HIST_MAX_FANS ||
+	    hdr->n_tachos > HIST_MAX_TACHOS ||
+	    hdr->rec_size != hist_rec_size(hdr->n_fans, hdr->n_tachos) ||
+	    h->size < HIST_HEADER_SIZE +
+	    (size_t) hdr->capacity * hdr->rec_size) {
+		fprintf(stderr, "%s: corrupt header\n", path);
+		exit(1);
+	}
+	for (i = 0; i != hdr->n_fans; i++)
+		if (hdr->fan_tachos[i] > hdr->n_tachos ||
+		    !memchr(hdr->names[i], 0, HIST_NAME_LEN)) {
+			fprintf(stderr, "%s: corrupt header\n", path);
+			exit(1);
+		}
+}
+
+
+/*
+ * The header may lag behind the records if we crashed between writing a
+ * record and advancing "head", or if the kernel wrote the record page back
+ * before the header page.
+ */
+
+uint64_t hist_end(const struct hist *h)
+{
+	uint64_t end = __atomic_load_n(&h->hdr->head, __ATOMIC_ACQUIRE);
+	unsigned i;
+
+	for (i = 0; i != h->hdr->capacity; i++) {
+		if (__atomic_load_n(&slot(h, end)->seq, __ATOMIC_ACQUIRE) !=
+		    (uint32_t) (end + 1))
+			break;
+		end++;
+	}
+	return end;
+}
+
+
+uint64_t hist_first(const struct hist *h)
+{
+	uint64_t end = hist_end(h);
+
+	return end > h->hdr->capacity ? end - h->hdr->capacity : 0;
+}
+
+
+const struct hist_rec *hist_get(const struct hist *h, uint64_t n)
+{
+	const struct hist_rec *r = slot(h, n);
+
+	if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != (uint32_t) (n + 1))
+		return NULL;
+	return r;
+}
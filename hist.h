@@ -0,0 +1,155 @@
+/*
+ * hist.h - History of fan readings in a memory-mapped ring file
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef HIST_H
+#define	HIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * The file begins with a header page, followed by a ring of fixed-size
+ * records. Each record consists of a struct hist_rec, then, for each fan, a
+ * struct hist_fan followed by "n_tachos" times struct hist_tacho. All fields
+ * are in host byte order.
+ *
+ * Appending a record does not make any system calls: we first invalidate the
+ * slot (seq = 0), then fill it, then set its sequence number, and then
+ * advance "head" in the header. A reader only accepts a record if its
+ * sequence number is the one expected for its slot, so a record that was
+ * being written when fand or the system crashed is skipped, and does not
+ * disturb the rest of the ring. The kernel writes dirty pages back on its
+ * own, i.e., after a power failure, the last 30 s or so may be missing.
+ */
+
+#define	HIST_MAGIC		0x48444e46	/* "FNDH" */
+#define	HIST_VERSION		1
+#define	HIST_HEADER_SIZE	4096
+
+/*
+ * Two days at one record per second. With two fans with two tachos each,
+ * records are 40 bytes, for a file of about 7 MB.
+ */
+
+#define	HIST_DEFAULT_RECORDS	(2 * 24 * 3600)
+
+#define	HIST_MAX_FANS		4
+#define	HIST_MAX_TACHOS		2	/* per fan */
+#define	HIST_NAME_LEN		16	/* including the NUL */
+
+
+struct hist_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t rec_size;
+	uint32_t capacity;	/* number of records */
+	uint8_t n_fans;
+	uint8_t n_tachos;	/* slots per fan */
+	uint8_t fan_tachos[HIST_MAX_FANS];	/* tachos the fan has */
+	uint8_t reserved[2];
+	char names[HIST_MAX_FANS][HIST_NAME_LEN];
+	uint64_t head;		/* records appended so far */
+};
+
+struct hist_rec {
+	uint32_t seq;		/* low 32 bits of the record number + 1 */
+	uint32_t t_s;		/* CLOCK_REALTIME */
+	uint16_t t_ms;
+	uint8_t reserved[2];
+} __attribute__((packed));
+
+struct hist_fan {
+	uint8_t duty;		/* percent */
+	uint8_t flags;		/* FAN_F_* of state.h */
+} __attribute__((packed));
+
+struct hist_tacho {
+	uint32_t edges;		/* tacho cycles counted, modulo 2^32 */
+	uint16_t rpm;
+} __attribute__((packed));
+
+struct hist {
+	struct hist_header *hdr;
+	uint8_t *recs;
+	size_t size;		/* of the mapping */
+	uint64_t n;		/* number of the record being written */
+};
+
+
+static inline size_t hist_rec_size(unsigned n_fans, unsigned n_tachos)
+{
+	return sizeof(struct hist_rec) + n_fans *
+	    (sizeof(struct hist_fan) + n_tachos * sizeof(struct hist_tacho));
+}
+
+
+static inline struct hist_fan *hist_fan(const struct hist *h,
+    const struct hist_rec *r, unsigned fan)
+{
+	return (struct hist_fan *) ((uint8_t *) (r + 1) + fan *
+	    (sizeof(struct hist_fan) +
+	    h->hdr->n_tachos * sizeof(struct hist_tacho)));
+}
+
+
+static inline struct hist_tacho *hist_tacho(struct hist_fan *f,
+    unsigned tacho)
+{
+	return (struct hist_tacho *) (f + 1) + tacho;
+}
+
+
+/*
+ * Open the history for appending. An existing file is continued if it has
+ * the same layout and fan names, otherwise it is started over. Exits on
+ * error.
+ */
+
+void hist_create(struct hist *h, const char *path, unsigned capacity,
+    unsigned n_fans, const char *const *names, const unsigned *n_tachos);
+
+/*
+ * Return the slot of the next record, already invalidated, and with the
+ * time set. There is at most one record per second: if the last record is
+ * from the same second, we return its slot again, and the new record replaces
+ * it.
+ */
+
+struct hist_rec *hist_begin(struct hist *h);
+
+/*
+ * Make the record returned by hist_begin visible.
+ */
+
+void hist_commit(struct hist *h, struct hist_rec *r);
+
+/*
+ * Open an existing history read-only. Exits on error.
+ */
+
+void hist_open(struct hist *h, const char *path);
+
+/*
+ * Number of the first record still in the ring, and one past the last valid
+ * one.
+ */
+
+uint64_t hist_first(const struct hist *h);
+uint64_t hist_end(const struct hist *h);
+
+/*
+ * Record number "n", or NULL if the slot does not hold a valid record with
+ * this number.
+ */
+
+const struct hist_rec *hist_get(const struct hist *h, uint64_t n);
+
+#endif /* !HIST_H */
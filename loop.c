@@ -0,0 +1,342 @@
+/*
+ * loop.c - Event loop
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <assert.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "mono.h"
+#include "loop.h"
+
+
+#define	MAX_WATCH	32
+#define	MAX_IDLE	8
+#define	MAX_EVENTS	16
+
+
+struct watch {
+	int fd;		/* -1 if unused */
+	void (*fn)(void *user, uint32_t events);
+	void *user;
+};
+
+struct idle {
+	void (*fn)(void *user);
+	void *user;
+};
+
+struct sig {
+	void (*fn)(void *user, int sig);
+	void *user;
+};
+
+
+static int epfd = -1;
+static int sigfd = -1;
+static sigset_t sigmask;
+static struct watch watches[MAX_WATCH];
+static struct idle idles[MAX_IDLE];
+static unsigned n_idle = 0;
+static struct sig sigs[NSIG];
+static bool running;
+
+struct loop_stats loop_stats;
+
+
+/* ----- File descriptors -------------------------------------------------- */
+
+
+static struct watch *find_watch(int fd)
+{
+	struct watch *w;
+
+	for (w = watches; w != watches + MAX_WATCH; w++)
+		if (w->fd == fd)
+			return w;
+	return NULL;
+}
+
+
+void loop_add(int fd, uint32_t events,
+    void (*fn)(void *user, uint32_t events), void *user)
+{
+	struct epoll_event ev = {
+		.events	= events,
+	};
+	struct watch *w;
+
+	assert(!find_watch(fd));
+	w = find_watch(-1);
+	if (!w) {
+		fprintf(stderr, "loop_add: too many file descriptors\n");
+		exit(1);
+	}
+	w->fd = fd;
+	w->fn = fn;
+	w->user = user;
+	ev.data.ptr = w;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl(EPOLL_CTL_ADD)");
+		exit(1);
+	}
+}
+
+
+void loop_mod(int fd, uint32_t events)
+{
+	struct epoll_event ev = {
+		.events	= events,
+	};
+
+	ev.data.ptr = find_watch(fd);
+	assert(ev.data.ptr);
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		perror("epoll_ctl(EPOLL_CTL_MOD)");
+		exit(1);
+	}
+}
+
+
+void loop_del(int fd)
+{
+	struct watch *w = find_watch(fd);
+
+	assert(w);
+	/*
+	 * The file descriptor may already be closed, in which case the kernel
+	 * has removed it from the epoll set and we get EBADF.
+	 */
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != EBADF &&
+	    errno != ENOENT) {
+		perror("epoll_ctl(EPOLL_CTL_DEL)");
+		exit(1);
+	}
+	w->fd = -1;
+}
+
+
+/* ----- Signals ----------------------------------------------------------- */
+
+
+static void signal_event(void *user, uint32_t events)
+{
+	struct signalfd_siginfo si;
+	ssize_t got;
+
+	(void) user;
+	(void) events;
+
+	got = read(sigfd, &si, sizeof(si));
+	if (got < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		perror("read(signalfd)");
+		exit(1);
+	}
+	assert(got == sizeof(si));
+	assert(si.ssi_signo < NSIG && sigs[si.ssi_signo].fn);
+	sigs[si.ssi_signo].fn(sigs[si.ssi_signo].user, si.ssi_signo);
+}
+
+
+void loop_signal(int sig, void (*fn)(void *user, int sig), void *user)
+{
+	assert(sig > 0 && sig < NSIG);
+	sigs[sig].fn = fn;
+	sigs[sig].user = user;
+	sigaddset(&sigmask, sig);
+	if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0) {
+		perror("sigprocmask");
+		exit(1);
+	}
+	if (signalfd(sigfd, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC) < 0) {
+		perror("signalfd");
+		exit(1);
+	}
+}
+
+
+/* ----- Idle functions ---------------------------------------------------- */
+
+
+void loop_idle(void (*fn)(void *user), void *user)
+{
+	if (n_idle == MAX_IDLE) {
+		fprintf(stderr, "loop_idle: too many functions\n");
+		exit(1);
+	}
+	idles[n_idle].fn = fn;
+	idles[n_idle].user = user;
+	n_idle++;
+}
+
+
+/* ----- Timers ------------------------------------------------------------ */
+
+
+static void timer_arm(const struct loop_timer *t)
+{
+	struct itimerspec its = {
+		.it_interval	= { 0, 0 },
+		.it_value	= {
+			.tv_sec		= t->next_ns / 1000000000,
+			.tv_nsec	= t->next_ns % 1000000000,
+		},
+	};
+
+	if (timerfd_settime(t->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("timerfd_settime");
+		exit(1);
+	}
+}
+
+
+static void timer_event(void *user, uint32_t events)
+{
+	struct loop_timer *t = user;
+	uint64_t n, now, late;
+
+	(void) events;
+
+	if (read(t->fd, &n, sizeof(n)) < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		perror("read(timerfd)");
+		exit(1);
+	}
+	now = mono_ns();
+	t->late_ns = now > t->next_ns ? now - t->next_ns : 0;
+	if (t->interval_ns) {
+		t->next_ns += t->interval_ns;
+		if (now >= t->next_ns) {
+			late = (now - t->next_ns) / t->interval_ns + 1;
+			t->missed += late;
+			t->next_ns += late * t->interval_ns;
+		}
+		timer_arm(t);
+	}
+	t->fn(t->user);
+}
+
+
+void loop_timer_init(struct loop_timer *t, void (*fn)(void *user),
+    void *user)
+{
+	t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (t->fd < 0) {
+		perror("timerfd_create");
+		exit(1);
+	}
+	t->fn = fn;
+	t->user = user;
+	t->next_ns = 0;
+	t->interval_ns = 0;
+	t->missed = 0;
+	t->late_ns = 0;
+	loop_add(t->fd, EPOLLIN, timer_event, t);
+}
+
+
+/*
+ * If "interval_s" is zero, the timer fires only once. The first deadline is
+ * "first_s" from now.
+ */
+
+void loop_timer_set(struct loop_timer *t, double first_s, double interval_s)
+{
+	t->next_ns = mono_ns() + (uint64_t) (first_s * 1e9) + 1;
+	t->interval_ns = interval_s * 1e9;
+	timer_arm(t);
+}
+
+
+void loop_timer_stop(struct loop_timer *t)
+{
+	const struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	t->interval_ns = 0;
+	if (timerfd_settime(t->fd, 0, &its, NULL) < 0) {
+		perror("timerfd_settime");
+		exit(1);
+	}
+}
+
+
+/* ----- Main loop --------------------------------------------------------- */
+
+
+void loop_init(void)
+{
+	struct watch *w;
+
+	for (w = watches; w != watches + MAX_WATCH; w++)
+		w->fd = -1;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	sigemptyset(&sigmask);
+	sigfd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigfd < 0) {
+		perror("signalfd");
+		exit(1);
+	}
+	loop_add(sigfd, EPOLLIN, signal_event, NULL);
+}
+
+
+void loop_run(void)
+{
+	struct epoll_event evs[MAX_EVENTS];
+	const struct idle *idle;
+	uint64_t t0;
+	int n, i;
+
+	running = 1;
+	while (running) {
+		for (idle = idles; idle != idles + n_idle; idle++)
+			idle->fn(idle->user);
+		n = epoll_wait(epfd, evs, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(1);
+		}
+		t0 = mono_ns();
+		for (i = 0; i != n; i++) {
+			const struct watch *w = evs[i].data.ptr;
+
+			/*
+			 * A previous callback in this round may have removed
+			 * the watch.
+			 */
+			if (w->fd < 0)
+				continue;
+			w->fn(w->user, evs[i].events);
+		}
+		loop_stats.rounds++;
+		loop_stats.busy_ns += mono_ns() - t0;
+	}
+}
+
+
+void loop_stop(void)
+{
+	running = 0;
+}
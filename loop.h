@@ -0,0 +1,80 @@
+/*
+ * loop.h - Event loop
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef LOOP_H
+#define	LOOP_H
+
+#include <stdint.h>
+
+
+/*
+ * Timers run on absolute deadlines on CLOCK_MONOTONIC. A periodic timer
+ * advances its deadline by exactly one interval per expiry, so the time we
+ * spend in the callback does not add up. If we fall behind by more than one
+ * interval, the deadlines we can no longer meet are skipped and counted in
+ * "missed". "late_ns" is how long after its deadline the callback was called
+ * the last time.
+ */
+
+struct loop_timer {
+	int fd;
+	void (*fn)(void *user);
+	void *user;
+	uint64_t next_ns;	/* next deadline */
+	uint64_t interval_ns;	/* 0 if one-shot */
+	unsigned long missed;
+	uint64_t late_ns;
+};
+
+
+/*
+ * Watch a file descriptor. "events" is a mask of EPOLLIN, EPOLLOUT, etc.
+ * Only one watcher per file descriptor.
+ */
+
+void loop_add(int fd, uint32_t events,
+    void (*fn)(void *user, uint32_t events), void *user);
+void loop_mod(int fd, uint32_t events);
+void loop_del(int fd);
+
+/*
+ * Signals are delivered synchronously, from the loop, through a signalfd.
+ */
+
+void loop_signal(int sig, void (*fn)(void *user, int sig), void *user);
+
+/*
+ * Functions to call after each round of event processing, e.g., to flush
+ * queued output.
+ */
+
+void loop_idle(void (*fn)(void *user), void *user);
+
+/*
+ * Rounds of event processing, and the time spent in callbacks.
+ */
+
+struct loop_stats {
+	unsigned long rounds;
+	uint64_t busy_ns;
+};
+
+extern struct loop_stats loop_stats;
+
+
+void loop_timer_init(struct loop_timer *t, void (*fn)(void *user),
+    void *user);
+void loop_timer_set(struct loop_timer *t, double first_s, double interval_s);
+void loop_timer_stop(struct loop_timer *t);
+
+void loop_init(void);
+void loop_run(void);
+void loop_stop(void);
+
+#endif /* !LOOP_H */
@@ -0,0 +1,363 @@
+/*
+ * metrics.c - Serve metrics in the Prometheus text format
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for accept4 */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mono.h"
+#include "loop.h"
+#include "metrics.h"
+
+
+#define	MAX_REQUEST	1024
+#define	BACKLOG		4
+#define	MAX_CLIENTS	4	/* each takes a watch of the event loop */
+
+/*
+ * A client that neither sends nor receives anything for IDLE_TIMEOUT_S is
+ * dropped, so that it can't hold one of the MAX_CLIENTS slots forever. We
+ * check every IDLE_CHECK_S while there are clients.
+ */
+
+#define	IDLE_TIMEOUT_S	5
+#define	IDLE_CHECK_S	1
+
+#define	CONTENT_TYPE	"text/plain; version=0.0.4"
+
+
+struct client {
+	int fd;
+	uint64_t deadline_ns;	/* drop the client if idle until then */
+	size_t len;
+	char buf[MAX_REQUEST + 1];
+	char *out;		/* response, NULL while reading the request */
+	size_t out_len;
+	size_t out_pos;		/* bytes sent */
+};
+
+
+static void (*metrics_fn)(FILE *file);
+static struct client *clients[MAX_CLIENTS];
+static unsigned n_clients = 0;
+static struct loop_timer idle_timer;
+
+
+/* ----- Formatting -------------------------------------------------------- */
+
+
+void metrics_help(FILE *file, const char *name, const char *type,
+    const char *help)
+{
+	fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+void metrics_value(FILE *file, const char *name, const char *labels,
+    double value)
+{
+	if (labels)
+		fprintf(file, "%s{%s} %.17g\n", name, labels, value);
+	else
+		fprintf(file, "%s %.17g\n", name, value);
+}
+
+
+/* ----- Clients ---------------------------------------------------------- */
+
+
+static void drop(struct client *c)
+{
+	unsigned i;
+
+	loop_del(c->fd);
+	(void) close(c->fd);
+	for (i = 0; i != MAX_CLIENTS; i++)
+		if (clients[i] == c)
+			clients[i] = NULL;
+	free(c->out);
+	free(c);
+	if (!--n_clients)
+		loop_timer_stop(&idle_timer);
+}
+
+
+static void check_idle(void *user)
+{
+	uint64_t now = mono_ns();
+	unsigned i;
+
+	(void) user;
+
+	for (i = 0; i != MAX_CLIENTS; i++)
+		if (clients[i] && now >= clients[i]->deadline_ns)
+			drop(clients[i]);
+}
+
+
+/* ----- HTTP -------------------------------------------------------------- */
+
+
+static void reply(struct client *c, const char *status, const char *body,
+    size_t len)
+{
+	char head[200];
+	int n;
+
+	n = snprintf(head, sizeof(head),
+	    "HTTP/1.0 %s\r\n"
+	    "Content-Type: " CONTENT_TYPE "\r\n"
+	    "Content-Length: %zu\r\n"
+	    "Connection: close\r\n\r\n", status, len);
+
+	c->out = malloc(n + len);
+	if (!c->out) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(c->out, head, n);
+	if (len)
+		memcpy(c->out + n, body, len);
+	c->out_len = n + len;
+	c->out_pos = 0;
+}
+
+
+static void serve(struct client *c, const char *req)
+{
+	char *body = NULL;
+	size_t len = 0;
+	FILE *file;
+
+	if (strncmp(req, "GET ", 4)) {
+		reply(c, "405 Method Not Allowed", NULL, 0);
+		return;
+	}
+	req += 4;
+	if (strncmp(req, "/metrics", 8) || (req[8] != ' ' && req[8] != '?' &&
+	    req[8] != '\r' && req[8] != '\n')) {
+		reply(c, "404 Not Found", NULL, 0);
+		return;
+	}
+
+	file = open_memstream(&body, &len);
+	if (!file) {
+		perror("open_memstream");
+		reply(c, "500 Internal Server Error", NULL, 0);
+		return;
+	}
+	metrics_fn(file);
+	if (fclose(file)) {
+		perror("fclose");
+		reply(c, "500 Internal Server Error", NULL, 0);
+	} else {
+		reply(c, "200 OK", body, len);
+	}
+	free(body);
+}
+
+
+/*
+ * Send as much of the response as the socket takes. Returns 0 if the client
+ * is done (and gone), 1 if we have to wait for the socket to drain.
+ */
+
+static bool send_reply(struct client *c)
+{
+	ssize_t got;
+
+	while (c->out_pos != c->out_len) {
+		got = write(c->fd, c->out + c->out_pos,
+		    c->out_len - c->out_pos);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0 && errno == EAGAIN)
+			return 1;
+		if (got <= 0)
+			break;
+		c->out_pos += got;
+	}
+	drop(c);
+	return 0;
+}
+
+
+/*
+ * We only look at the request line, so we answer as soon as we have it. If
+ * the client does not read the response as fast as we write it, we continue
+ * on EPOLLOUT.
+ */
+
+static void client_event(void *user, uint32_t events)
+{
+	struct client *c = user;
+	ssize_t got;
+
+	(void) events;
+
+	c->deadline_ns = mono_ns() + IDLE_TIMEOUT_S * 1e9;
+	if (c->out) {
+		send_reply(c);
+		return;
+	}
+
+	got = read(c->fd, c->buf + c->len, MAX_REQUEST - c->len);
+	if (got < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (got <= 0) {
+		drop(c);
+		return;
+	}
+	c->len += got;
+	c->buf[c->len] = 0;
+	if (!strchr(c->buf, '\n') && c->len != MAX_REQUEST)
+		return;
+	serve(c, c->buf);
+	if (send_reply(c))
+		loop_mod(c->fd, EPOLLOUT);
+}
+
+
+static void listen_event(void *user, uint32_t events)
+{
+	int sock = (intptr_t) user;
+	struct client *c;
+	unsigned i;
+	int fd;
+
+	(void) events;
+
+	fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			perror("accept");
+		return;
+	}
+	if (n_clients == MAX_CLIENTS) {
+		(void) close(fd);
+		return;
+	}
+	c = malloc(sizeof(*c));
+	if (!c) {
+		perror("malloc");
+		exit(1);
+	}
+	c->fd = fd;
+	c->deadline_ns = mono_ns() + IDLE_TIMEOUT_S * 1e9;
+	c->len = 0;
+	c->out = NULL;
+	for (i = 0; clients[i]; i++);
+	clients[i] = c;
+	loop_add(fd, EPOLLIN, client_event, c);
+	if (!n_clients++)
+		loop_timer_set(&idle_timer, IDLE_CHECK_S, IDLE_CHECK_S);
+}
+
+
+/* ----- Setup ------------------------------------------------------------- */
+
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		exit(1);
+	}
+	strcpy(addr.sun_path, path);
+	(void) unlink(path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if (bind(sock, (const struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror(path);
+		exit(1);
+	}
+	return sock;
+}
+
+
+static int listen_inet(const char *spec)
+{
+	struct sockaddr_in addr = {
+		.sin_family	= AF_INET,
+		.sin_addr	= { htonl(INADDR_LOOPBACK) },
+	};
+	const char *colon = strrchr(spec, ':');
+	unsigned long port;
+	int one = 1;
+	char *end;
+	int sock;
+
+	if (colon) {
+		char host[colon - spec + 1];
+
+		memcpy(host, spec, colon - spec);
+		host[colon - spec] = 0;
+		if (!inet_aton(host, &addr.sin_addr)) {
+			fprintf(stderr, "invalid address \"%s\"\n", host);
+			exit(1);
+		}
+		spec = colon + 1;
+	}
+	port = strtoul(spec, &end, 0);
+	if (*end || !port || port > 0xffff) {
+		fprintf(stderr, "invalid port \"%s\"\n", spec);
+		exit(1);
+	}
+	addr.sin_port = htons(port);
+
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+		perror("SO_REUSEADDR");
+	if (bind(sock, (const struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("bind");
+		exit(1);
+	}
+	return sock;
+}
+
+
+void metrics_listen(const char *spec, void (*fn)(FILE *file))
+{
+	int sock;
+
+	if (!strncmp(spec, "unix:", 5))
+		sock = listen_unix(spec + 5);
+	else
+		sock = listen_inet(spec);
+	if (listen(sock, BACKLOG) < 0) {
+		perror("listen");
+		exit(1);
+	}
+	metrics_fn = fn;
+	loop_timer_init(&idle_timer, check_idle, NULL);
+	loop_add(sock, EPOLLIN, listen_event, (void *) (intptr_t) sock);
+}
@@ -0,0 +1,38 @@
+/*
+ * metrics.h - Serve metrics in the Prometheus text format
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef METRICS_H
+#define	METRICS_H
+
+#include <stdio.h>
+
+
+/*
+ * Listen for HTTP requests on "spec", which is unix:PATH, PORT (on
+ * localhost), or ADDRESS:PORT. Each GET /metrics is answered with whatever
+ * "fn" writes to "file". Exits if "spec" is invalid or we cannot listen.
+ *
+ * Requests are served from the event loop. The reply is generated in one go,
+ * and sent as fast as the client takes it. Idle clients are dropped after a
+ * few seconds.
+ */
+
+void metrics_listen(const char *spec, void (*fn)(FILE *file));
+
+/*
+ * Helpers for "fn". "labels" is a comma-separated list of label="value"
+ * pairs, or NULL.
+ */
+
+void metrics_help(FILE *file, const char *name, const char *type,
+    const char *help);
+void metrics_value(FILE *file, const char *name, const char *labels,
+    double value);
+
+#endif /* !METRICS_H */
@@ -7,18 +7,62 @@
  * A copy of the license can be found in the file COPYING.txt
  */
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #include "regmap.h"
 #include "mio.h"
 
 
+#define	N_PINS		54
+
+
 volatile void *mio_base;
 
 static unsigned ref = 0;
 static struct regmap mio_map;
 
+static uint32_t shadow[N_PINS];
+static bool valid[N_PINS];
+
+
+uint32_t mio_get(uint8_t pin)
+{
+	uint32_t v;
+
+	assert(pin < N_PINS);
+	if (!valid[pin] || regmap_verify) {
+		regmap_stats.reads++;
+		v = MIO_PIN(pin);
+		if (valid[pin] && v != shadow[pin]) {
+			fprintf(stderr, "MIO %u: shadow 0x%x, hardware 0x%x\n",
+			    pin, shadow[pin], v);
+			regmap_stats.mismatches++;
+		}
+		shadow[pin] = v;
+		valid[pin] = 1;
+	}
+	return shadow[pin];
+}
+
+
+void mio_set(uint8_t pin, uint32_t value)
+{
+	assert(pin < N_PINS);
+	if (valid[pin] && mio_get(pin) == value) {
+		regmap_stats.skipped++;
+		return;
+	}
+	regmap_stats.writes++;
+	MIO_PIN(pin) = value;
+	shadow[pin] = value;
+	valid[pin] = 1;
+}
+
 
 void mio_open(void)
 {
@@ -34,4 +78,5 @@ void mio_close(void)
 	if (--ref)
 		return;
 	regmap_close(&mio_map);
+	memset(valid, 0, sizeof(valid));
 }
@@ -10,6 +10,8 @@
 #ifndef MIO_H
 #define	MIO_H
 
+#include <stdint.h>
+
 #define	MIO_BASE	0xF8000700
 #define	MIO_SIZE	0xD4
 
@@ -45,6 +47,13 @@ enum mio_sel {
 extern volatile void *mio_base;
 
 
+/*
+ * Shadowed and counted access to MIO_PIN, like ttc_get and ttc_set.
+ */
+
+uint32_t mio_get(uint8_t pin);
+void mio_set(uint8_t pin, uint32_t value);
+
 void mio_open(void);
 void mio_close(void);
 
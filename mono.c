@@ -0,0 +1,38 @@
+/*
+ * mono.c - Monotonic time
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "mono.h"
+
+
+static uint64_t fixed_ns = 0;
+
+
+void mono_set(uint64_t ns)
+{
+	fixed_ns = ns;
+}
+
+
+uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	if (fixed_ns)
+		return fixed_ns;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		perror("clock_gettime");
+		exit(1);
+	}
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,30 @@
+/*
+ * mono.h - Monotonic time
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef MONO_H
+#define	MONO_H
+
+#include <stdint.h>
+
+
+/*
+ * Nanoseconds on CLOCK_MONOTONIC. Unlike gettimeofday, this is not affected
+ * by NTP or manual changes of the system time.
+ */
+
+uint64_t mono_ns(void);
+
+/*
+ * For replaying traces: from now on, mono_ns returns "ns", or, if "ns" is
+ * zero, the time again.
+ */
+
+void mono_set(uint64_t ns);
+
+#endif /* !MONO_H */
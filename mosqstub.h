@@ -0,0 +1,26 @@
+/*
+ * mosqstub.h - Stand-in for the parts of libmosquitto used by benchmarks
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef MOSQSTUB_H
+#define	MOSQSTUB_H
+
+#include <mosquitto.h>
+
+
+/*
+ * mosquitto_publish only counts messages and bytes. Nothing is sent.
+ * mosquitto_subscribe does nothing. mosqstub_mosq can be passed where a
+ * client is expected.
+ */
+
+extern struct mosquitto *const mosqstub_mosq;
+extern unsigned long mosqstub_published;
+extern unsigned long mosqstub_bytes;
+
+#endif /* !MOSQSTUB_H */
@@ -0,0 +1,229 @@
+/*
+ * mqtt.c - Run the MQTT client from the event loop
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+
+#include <mosquitto.h>
+
+#include "loop.h"
+#include "trace.h"
+#include "mqtt.h"
+
+
+#define	MQTT_KEEPALIVE_S	3600
+
+#define	MISC_INTERVAL_S		1	/* keepalive, retries */
+#define	RECONNECT_MIN_S		1
+#define	RECONNECT_MAX_S		16
+
+
+static struct mosquitto *mosq;
+static void (*connected_fn)(struct mosquitto *mosq);
+
+static int sock = -1;
+static uint32_t sock_events;
+static bool up;		/* the broker has accepted the connection */
+static struct loop_timer misc_timer;
+static struct loop_timer reconnect_timer;
+static double reconnect_s = RECONNECT_MIN_S;
+
+
+static void on_connect(struct mosquitto *m, void *obj, int rc)
+{
+	(void) obj;
+
+	if (rc) {
+		fprintf(stderr, "connection refused: %d\n", rc);
+		return;
+	}
+	up = 1;
+	trace_begin_connect(1);
+	connected_fn(m);
+}
+
+
+struct mosquitto *mqtt_setup(const char *host, int port,
+    void (*connected)(struct mosquitto *mosq),
+    void (*cb)(struct mosquitto *mosq, void *obj,
+    const struct mosquitto_message *msg))
+{
+	mosquitto_lib_init();
+	mosq = mosquitto_new(NULL, 1, NULL);
+	if (!mosq) {
+		fprintf(stderr, "mosquitto_new failed\n");
+		exit(1);
+	}
+	connected_fn = connected;
+	mosquitto_connect_callback_set(mosq, on_connect);
+	mosquitto_message_callback_set(mosq, cb);
+	if (mosquitto_connect_async(mosq, host, port, MQTT_KEEPALIVE_S)) {
+		fprintf(stderr, "unable to connect\n");
+		exit(1);
+	}
+	return mosq;
+}
+
+
+/* ----- Socket ------------------------------------------------------------ */
+
+
+static void connection_lost(int res);
+
+
+static void mqtt_io(void *user, uint32_t events)
+{
+	int res;
+
+	(void) user;
+
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		res = mosquitto_loop_read(mosq, 1);
+		if (res != MOSQ_ERR_SUCCESS) {
+			connection_lost(res);
+			return;
+		}
+	}
+	if (events & EPOLLOUT) {
+		res = mosquitto_loop_write(mosq, 1);
+		if (res != MOSQ_ERR_SUCCESS)
+			connection_lost(res);
+	}
+}
+
+
+/*
+ * With an asynchronous connect, libmosquitto queues the CONNECT packet right
+ * away, so we also wait for EPOLLOUT, which tells us that the TCP connection
+ * is established (or has failed, which the write then reports).
+ */
+
+static void watch_socket(void)
+{
+	sock = mosquitto_socket(mosq);
+	if (sock < 0)
+		return;
+	sock_events = EPOLLIN | (mosquitto_want_write(mosq) ? EPOLLOUT : 0);
+	loop_add(sock, sock_events, mqtt_io, NULL);
+}
+
+
+/*
+ * libmosquitto only sends directly if we're not in one of its callbacks.
+ * Otherwise, it queues the data, and we have to wait for the socket to become
+ * writeable.
+ */
+
+static void mqtt_idle(void *user)
+{
+	uint32_t events;
+
+	(void) user;
+
+	if (sock < 0)
+		return;
+	events = EPOLLIN | (mosquitto_want_write(mosq) ? EPOLLOUT : 0);
+	if (events == sock_events)
+		return;
+	loop_mod(sock, events);
+	sock_events = events;
+}
+
+
+/* ----- Reconnect --------------------------------------------------------- */
+
+
+static void connection_lost(int res)
+{
+	if (sock < 0)
+		return;
+	loop_del(sock);
+	sock = -1;
+	if (up) {
+		up = 0;
+		trace_begin_connect(0);
+	}
+	fprintf(stderr, "MQTT connection lost: %s\n", mosquitto_strerror(res));
+	loop_timer_set(&reconnect_timer, reconnect_s, 0);
+}
+
+
+/*
+ * mosquitto_reconnect_async only starts the connect, which then completes in
+ * mqtt_io. Only the name lookup still blocks, so the broker should be given
+ * by address or by a name from /etc/hosts, like the default "localhost".
+ */
+
+static void reconnect(void *user)
+{
+	int res;
+
+	(void) user;
+
+	res = mosquitto_reconnect_async(mosq);
+	if (res != MOSQ_ERR_SUCCESS) {
+		if (reconnect_s < RECONNECT_MAX_S)
+			reconnect_s *= 2;
+		loop_timer_set(&reconnect_timer, reconnect_s, 0);
+		return;
+	}
+	reconnect_s = RECONNECT_MIN_S;
+	watch_socket();
+}
+
+
+static void misc(void *user)
+{
+	int res;
+
+	(void) user;
+
+	if (sock < 0)
+		return;
+	res = mosquitto_loop_misc(mosq);
+	/* keepalive timeout closes the socket */
+	if (res != MOSQ_ERR_SUCCESS || mosquitto_socket(mosq) != sock)
+		connection_lost(res == MOSQ_ERR_SUCCESS ?
+		    MOSQ_ERR_CONN_LOST : res);
+}
+
+
+/* ----- Start/stop -------------------------------------------------------- */
+
+
+void mqtt_start(void)
+{
+	loop_timer_init(&misc_timer, misc, NULL);
+	loop_timer_init(&reconnect_timer, reconnect, NULL);
+	loop_timer_set(&misc_timer, MISC_INTERVAL_S, MISC_INTERVAL_S);
+	loop_idle(mqtt_idle, NULL);
+	watch_socket();
+}
+
+
+void mqtt_stop(void)
+{
+	if (sock >= 0) {
+		loop_del(sock);
+		sock = -1;
+	}
+	up = 0;
+	mosquitto_disconnect(mosq);
+	mosquitto_destroy(mosq);
+	mosquitto_lib_cleanup();
+}
+
+
+bool mqtt_connected(void)
+{
+	return up;
+}
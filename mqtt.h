@@ -0,0 +1,58 @@
+/*
+ * mqtt.h - Run the MQTT client from the event loop
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef MQTT_H
+#define	MQTT_H
+
+#include <stdbool.h>
+
+#include <mosquitto.h>
+
+
+/*
+ * Libmosquitto documentation:
+ * https://mosquitto.org/api/files/mosquitto-h.htm
+ */
+
+
+enum mqtt_qos {
+	qos_be		= 0,
+	qos_ack		= 1,
+	qos_once	= 2
+};
+
+
+/*
+ * mqtt_setup starts connecting and exits if this fails immediately, e.g.,
+ * because the broker's name does not resolve. The connection is completed by
+ * the event loop, and "connected" is called whenever a connection has been
+ * (re)established, and should (re)subscribe.
+ */
+
+struct mosquitto *mqtt_setup(const char *host, int port,
+    void (*connected)(struct mosquitto *mosq),
+    void (*cb)(struct mosquitto *mosq, void *obj,
+    const struct mosquitto_message *msg));
+
+/*
+ * mqtt_start attaches the client to the event loop. After this, all
+ * libmosquitto processing, including reconnects, happens in the loop.
+ */
+
+void mqtt_start(void);
+void mqtt_stop(void);
+
+/*
+ * 1 while the broker has accepted our connection. A connection that dies
+ * quietly is closed by the keepalive timeout.
+ */
+
+bool mqtt_connected(void);
+
+#endif /* !MQTT_H */
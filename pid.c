@@ -0,0 +1,74 @@
+/*
+ * pid.c - PID controller
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+
+#include "pid.h"
+
+
+static double clamp(const struct pid *pid, double v)
+{
+	if (v < pid->min)
+		return pid->min;
+	if (v > pid->max)
+		return pid->max;
+	return v;
+}
+
+
+void pid_init(struct pid *pid, double kp, double ki, double kd,
+    double min, double max)
+{
+	pid->kp = kp;
+	pid->ki = ki;
+	pid->kd = kd;
+	pid->min = min;
+	pid->max = max;
+	pid_reset(pid, min);
+}
+
+
+void pid_reset(struct pid *pid, double out)
+{
+	pid->integ = clamp(pid, out);
+	pid->have_last = 0;
+}
+
+
+double pid_update(struct pid *pid, double target, double measured, double dt)
+{
+	double err = target - measured;
+	double p, d = 0;
+	double integ, out;
+
+	p = pid->kp * err;
+
+	/*
+	 * Differentiate the measurement, not the error, so that changing the
+	 * target does not produce a spike.
+	 */
+	if (pid->have_last && dt > 0)
+		d = -pid->kd * (measured - pid->last) / dt;
+	pid->last = measured;
+	pid->have_last = 1;
+
+	/*
+	 * Anti-windup: only accept the new integral if it does not push an
+	 * already saturated output further into saturation. Also keep the
+	 * integral itself within the output range.
+	 */
+	integ = clamp(pid, pid->integ + pid->ki * err * dt);
+	out = p + integ + d;
+	if ((out > pid->max && err > 0) || (out < pid->min && err < 0))
+		out = p + pid->integ + d;
+	else
+		pid->integ = integ;
+
+	return clamp(pid, out);
+}
@@ -0,0 +1,43 @@
+/*
+ * pid.h - PID controller
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef PID_H
+#define	PID_H
+
+#include <stdbool.h>
+
+
+struct pid {
+	double kp, ki, kd;
+	double min, max;	/* output limits */
+	double integ;		/* integral term, including ki */
+	double last;		/* last measurement */
+	bool have_last;
+};
+
+
+void pid_init(struct pid *pid, double kp, double ki, double kd,
+    double min, double max);
+
+/*
+ * pid_reset prepares the controller for a (re)start, such that, if the error
+ * is zero, its output is "out". This avoids a bump when switching from open to
+ * closed-loop control.
+ */
+
+void pid_reset(struct pid *pid, double out);
+
+/*
+ * "dt" is the time since the previous update, in seconds. Returns the new
+ * output, clamped to min ... max.
+ */
+
+double pid_update(struct pid *pid, double target, double measured, double dt);
+
+#endif /* !PID_H */
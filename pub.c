@@ -0,0 +1,277 @@
+/*
+ * pub.c - Publish policy
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <mosquitto.h>
+
+#include "mono.h"
+#include "loop.h"
+#include "conf.h"
+#include "stats.h"
+#include "pub.h"
+
+
+#define	FLUSH_INTERVAL_S	0.1
+
+#define	MAX_VALUE_MSG		24	/* 64-bit integer */
+
+
+struct pub_policy pub_policies[pub_n_classes] = {
+	[pub_rpm ... pub_alarm] = {
+		.deadband	= -1,
+		.deadband_pct	= 0,
+		.min_ns		= 0,
+		.max_ns		= 0,
+		.qos		= 1,
+		.retain		= 1,
+	},
+};
+
+struct pub_stats pub_stats[pub_n_classes];
+
+const char *const pub_class_names[pub_n_classes] = {
+	[pub_rpm]	= "rpm",
+	[pub_pwm]	= "pwm",
+	[pub_status]	= "status",
+	[pub_state]	= "state",
+	[pub_alarm]	= "alarm",
+};
+
+static struct pub_topic *topics = NULL;
+static struct loop_timer flush_timer;
+
+
+/* ----- Configuration ----------------------------------------------------- */
+
+
+static double number(const char *s, const char *what, const char *suffix)
+{
+	char *end;
+	double n;
+
+	n = strtod(s, &end);
+	if (end == s || strcmp(end, suffix) || n < 0)
+		conf_error("invalid %s \"%s\"", what, s);
+	return n;
+}
+
+
+static void conf_publish(int argc, char *const *argv)
+{
+	struct pub_policy *p = NULL;
+	unsigned i;
+	int j;
+
+	for (i = 0; i != pub_n_classes; i++)
+		if (!strcmp(pub_class_names[i], argv[0]))
+			p = pub_policies + i;
+	if (!p)
+		conf_error("unknown class \"%s\"", argv[0]);
+	if (!(argc & 1))
+		conf_error("settings come in pairs");
+	for (j = 1; j != argc; j += 2) {
+		const char *name = argv[j];
+		const char *value = argv[j + 1];
+
+		if (!strcmp(name, "deadband")) {
+			if (strchr(value, '%'))
+				p->deadband_pct = number(value, name, "%");
+			else
+				p->deadband = number(value, name, "");
+			if (p->deadband < 0)
+				p->deadband = 0;
+		} else if (!strcmp(name, "min-interval")) {
+			p->min_ns = number(value, name, "") * 1e9;
+		} else if (!strcmp(name, "max-interval")) {
+			p->max_ns = number(value, name, "") * 1e9;
+		} else if (!strcmp(name, "qos")) {
+			p->qos = number(value, name, "");
+			if (p->qos > 2)
+				conf_error("QoS must be 0, 1, or 2");
+		} else if (!strcmp(name, "retain")) {
+			p->retain = number(value, name, "");
+		} else {
+			conf_error("unknown setting \"%s\"", name);
+		}
+	}
+}
+
+
+const struct conf_keyword pub_conf[] = {
+	{ "publish",	3, 11,	conf_publish },
+	{ NULL, 0, 0, NULL }
+};
+
+
+/* ----- Decision ---------------------------------------------------------- */
+
+
+struct pub_topic *pub_topic(const char *topic, enum pub_class class)
+{
+	struct pub_topic *t;
+
+	for (t = topics; t; t = t->next_topic)
+		if (t->topic == topic || !strcmp(t->topic, topic))
+			return t;
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		perror("calloc");
+		exit(1);
+	}
+	t->topic = topic;
+	t->class = class;
+	t->next_topic = topics;
+	topics = t;
+	return t;
+}
+
+
+static bool significant(const struct pub_policy *p, double last, double value)
+{
+	double delta = fabs(value - last);
+
+	if (p->deadband < 0 && !p->deadband_pct)
+		return 1;
+	if (delta <= p->deadband)
+		return 0;
+	return delta > fabs(last) * p->deadband_pct / 100;
+}
+
+
+static void sent(struct pub_topic *t, double value, uint64_t now)
+{
+	t->sent = 1;
+	t->value = value;
+	t->sent_ns = now;
+	t->pending = 0;
+	pub_stats[t->class].sent++;
+}
+
+
+bool pub_check(struct pub_topic *t, double value, uint64_t now)
+{
+	const struct pub_policy *p = pub_policies + t->class;
+	uint64_t elapsed = now - t->sent_ns;
+
+	if (!t->sent || (p->max_ns && elapsed >= p->max_ns))
+		goto send;
+	if (!significant(p, t->value, value)) {
+		t->pending = 0;
+		pub_stats[t->class].suppressed++;
+		return 0;
+	}
+	if (p->min_ns && elapsed < p->min_ns) {
+		t->pending = 1;
+		t->next = value;
+		pub_stats[t->class].suppressed++;
+		return 0;
+	}
+
+send:
+	sent(t, value, now);
+	return 1;
+}
+
+
+void pub_reset(void)
+{
+	struct pub_topic *t;
+
+	for (t = topics; t; t = t->next_topic) {
+		if (t->sent && !t->pending) {
+			t->pending = 1;
+			t->next = t->value;
+		}
+		t->sent = 0;
+	}
+}
+
+
+/* ----- Publishing ------------------------------------------------------- */
+
+
+void pub_send_raw(struct mosquitto *mosq, const struct pub_topic *t,
+    const void *payload, size_t len)
+{
+	const struct pub_policy *p = pub_policies + t->class;
+	uint64_t t0 = mono_ns();
+	int res;
+
+	res = mosquitto_publish(mosq, NULL, t->topic, len, payload, p->qos,
+	    p->retain);
+	stats_add(stats_publish, mono_ns() - t0);
+	switch (res) {
+	case MOSQ_ERR_SUCCESS:
+		return;
+	case MOSQ_ERR_NO_CONN:
+	case MOSQ_ERR_CONN_LOST:
+		/* we'll send fresh values once we've reconnected */
+		pub_stats[t->class].errors++;
+		stats_error(stats_err_publish);
+		return;
+	default:
+		fprintf(stderr, "mosquitto_publish: %d\n", res);
+		exit(1);
+	}
+}
+
+
+void pub_send(struct mosquitto *mosq, const struct pub_topic *t,
+    double value)
+{
+	char buf[MAX_VALUE_MSG];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%lu", (unsigned long) value);
+	pub_send_raw(mosq, t, buf, len);
+}
+
+
+void pub_update(struct mosquitto *mosq, struct pub_topic *t, double value)
+{
+	if (pub_check(t, value, mono_ns()))
+		pub_send(mosq, t, value);
+}
+
+
+/* ----- Held-back values and heartbeats ----------------------------------- */
+
+
+static void flush(void *user)
+{
+	struct mosquitto *mosq = user;
+	uint64_t now = mono_ns();
+	struct pub_topic *t;
+
+	for (t = topics; t; t = t->next_topic) {
+		const struct pub_policy *p = pub_policies + t->class;
+		uint64_t elapsed = now - t->sent_ns;
+
+		if (t->pending && (!t->sent || elapsed >= p->min_ns)) {
+			sent(t, t->next, now);
+			pub_send(mosq, t, t->value);
+		} else if (t->sent && p->max_ns && elapsed >= p->max_ns) {
+			sent(t, t->value, now);
+			pub_send(mosq, t, t->value);
+		}
+	}
+}
+
+
+void pub_start(struct mosquitto *mosq)
+{
+	loop_timer_init(&flush_timer, flush, mosq);
+	loop_timer_set(&flush_timer, FLUSH_INTERVAL_S, FLUSH_INTERVAL_S);
+}
@@ -0,0 +1,131 @@
+/*
+ * pub.h - Publish policy
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef PUB_H
+#define	PUB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mosquitto.h>
+
+#include "conf.h"
+
+
+enum pub_class {
+	pub_rpm,	/* measured RPM */
+	pub_pwm,	/* duty cycle we set */
+	pub_status,	/* everything else: pwm-min, counters, ... */
+	pub_state,	/* snapshot of the fan system */
+	pub_alarm,	/* fault conditions */
+	pub_n_classes
+};
+
+/*
+ * Configuration:
+ *
+ * publish CLASS SETTING VALUE ...
+ *	CLASS is rpm, pwm, status, state, or alarm. For state, only qos and
+ *	retain apply. Settings:
+ *
+ *	deadband N	only publish if the value differs from the last one
+ *			published by more than N. Default: publish every
+ *			update.
+ *	deadband N%	same, but relative to the last value published
+ *	min-interval S
+ *			publish at most every S seconds. Changes in between
+ *			are held back, and the last of them is published when
+ *			the interval has passed.
+ *	max-interval S
+ *			publish at least every S seconds, even if nothing
+ *			changed (heartbeat)
+ *	qos 0|1|2	MQTT QoS level. Default: 1
+ *	retain 0|1	MQTT retain flag. Default: 1
+ */
+
+struct pub_policy {
+	double deadband;	/* absolute, < 0 if disabled */
+	double deadband_pct;	/* relative, in percent */
+	uint64_t min_ns;	/* 0 if no limit */
+	uint64_t max_ns;	/* 0 if no heartbeat */
+	int qos;
+	bool retain;
+};
+
+struct pub_topic {
+	const char *topic;
+	enum pub_class class;
+	bool sent;		/* we have published "value" */
+	double value;		/* last value published */
+	uint64_t sent_ns;
+	bool pending;		/* "next" is waiting for min-interval */
+	double next;
+	struct pub_topic *next_topic;
+};
+
+struct pub_stats {
+	unsigned long sent;
+	unsigned long suppressed;
+	unsigned long errors;	/* not connected */
+};
+
+
+extern const struct conf_keyword pub_conf[];
+extern struct pub_policy pub_policies[pub_n_classes];
+extern struct pub_stats pub_stats[pub_n_classes];
+extern const char *const pub_class_names[pub_n_classes];
+
+
+/*
+ * Look up the state of a topic, creating it if necessary. "topic" must
+ * remain valid. This is meant to be done once, at startup. The publish
+ * functions below then neither look up nor allocate anything.
+ */
+
+struct pub_topic *pub_topic(const char *topic, enum pub_class class);
+
+/*
+ * Decide whether to publish "value" now. If yes, the caller must then publish
+ * it.
+ */
+
+bool pub_check(struct pub_topic *t, double value, uint64_t now);
+
+/*
+ * Make sure all topics get published at the next update, e.g., after
+ * reconnecting. Topics that have been published before are also re-sent with
+ * their last value if no update comes before the next flush.
+ */
+
+void pub_reset(void);
+
+/*
+ * Publish a value, subject to the publish policy of its class.
+ */
+
+void pub_update(struct mosquitto *mosq, struct pub_topic *t, double value);
+
+/*
+ * Publish unconditionally. pub_send formats the value as an integer.
+ */
+
+void pub_send(struct mosquitto *mosq, const struct pub_topic *t,
+    double value);
+void pub_send_raw(struct mosquitto *mosq, const struct pub_topic *t,
+    const void *payload, size_t len);
+
+/*
+ * Start the timer that publishes held-back values, heartbeats, and the values
+ * pub_reset left to re-send.
+ */
+
+void pub_start(struct mosquitto *mosq);
+
+#endif /* !PUB_H */
@@ -12,24 +12,51 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "mono.h"
 #include "mio.h"
 #include "ttc.h"
 #include "pwm.h"
 
 
+/*
+ * The match register takes effect immediately. If we move it across the
+ * counter, the output toggles twice in this period (a short spike) or not at
+ * all (a full period at the wrong level). We therefore wait until the counter
+ * is outside the range between the old and the new match value, with
+ * SYNC_MARGIN ticks to spare for the write to reach the timer. This takes at
+ * most one PWM period.
+ *
+ * The counter runs at pclk, so it advances many times during each register
+ * read. If it reads the same value STUCK_READS times in a row, it does not
+ * move at all (e.g., with the file backend), and we write right away. In any
+ * case, we give up after SYNC_TIMEOUT_NS and write anyway.
+ */
+
+#define	SYNC_MARGIN		64
+#define	SYNC_TIMEOUT_NS		1000000
+#define	STUCK_READS		3
+
+
 void pwm_init(uint8_t ttc, uint8_t timer, enum pwm_clk clk, uint8_t clk_shr,
     bool invert, uint8_t mio)
 {
+	/* only the wave of timer 0 can be routed to MIO */
+	if (timer && mio) {
+		fprintf(stderr, "for MIO, timer must be 0, not %u\n", timer);
+		exit(1);
+	}
 	switch (ttc) {
 	case 0:
-		if (mio == 18 || mio == 30 || mio == 42)
+		if (!mio || mio == 18 || mio == 30 || mio == 42)
 			break;
-		fprintf(stderr, "MIO must be 18, 30, or 42, not %u\n", mio);
+		fprintf(stderr, "MIO must be 0 (EMIO), 18, 30, or 42, not %u\n",
+		    mio);
 		exit(1);
 	case 1:
-		if (mio == 16 || mio == 28 || mio == 40)
+		if (!mio || mio == 16 || mio == 28 || mio == 40)
 			break;
-		fprintf(stderr, "MIO must be 16, 28, or 40, not %u\n", mio);
+		fprintf(stderr, "MIO must be 0 (EMIO), 16, 28, or 40, not %u\n",
+		    mio);
 		exit(1);
 	default:
 		fprintf(stderr, "pwm_init: ttc must be 0 or 1, not %d\n", ttc);
@@ -37,38 +64,69 @@ void pwm_init(uint8_t ttc, uint8_t timer, enum pwm_clk clk, uint8_t clk_shr,
 	}
 
 	ttc_open();
-	TTC_CLK_CTRL(ttc, timer) =
+	ttc_set(ttc, timer, ttc_clk_ctrl,
 	    (clk == pwm_ext ? 1 << TTC_CLK_CTRL_EXT_CLK_SHIFT : 0) |
 	    (clk_shr ? (clk_shr - 1) << TTC_CLK_CTRL_PRE_SHR_SHIFT : 0) |
-	    (clk_shr ? 1 << TTC_CLK_CTRL_PRE_EN_SHIFT : 0);
-	TTC_CNT_CTRL(ttc, timer) =
+	    (clk_shr ? 1 << TTC_CLK_CTRL_PRE_EN_SHIFT : 0));
+	ttc_set(ttc, timer, ttc_cnt_ctrl,
 	    invert << TTC_CNT_CTRL_WAVE_HL_SHIFT |
 	    1 << TTC_CNT_CTRL_MATCH_EN_SHIFT |
 	    1 << TTC_CNT_CTRL_INTERVAL_SHIFT |
-	    1 << TTC_CNT_CTRL_nEN_SHIFT;
+	    1 << TTC_CNT_CTRL_nEN_SHIFT);
 
+	if (!mio)
+		return;
 	mio_open();
-	MIO_PIN(mio) =
-	    (MIO_PIN(mio) & ~(MIO_SEL_MASK << MIO_SEL_SHIFT)) |
-	    MIO_SEL_WAVE << MIO_SEL_SHIFT;
+	mio_set(mio,
+	    (mio_get(mio) & ~(MIO_SEL_MASK << MIO_SEL_SHIFT)) |
+	    MIO_SEL_WAVE << MIO_SEL_SHIFT);
 }
 
 
 void pwm_interval(uint8_t ttc, uint8_t timer, uint16_t intv)
 {
-	TTC_INTERVAL(ttc, timer) = intv;
+	ttc_set(ttc, timer, ttc_interval, intv);
+}
+
+
+static void wait_window(uint8_t ttc, uint8_t timer, uint16_t lo, uint16_t hi)
+{
+	uint64_t end = mono_ns() + SYNC_TIMEOUT_NS;
+	unsigned same = 0;
+	uint16_t c, last = 0;
+
+	while (mono_ns() < end) {
+		c = ttc_get(ttc, timer, ttc_counter);
+		if (c + SYNC_MARGIN < lo || c > hi)
+			return;
+		if (same && c != last)
+			same = 0;
+		if (++same == STUCK_READS)
+			return;
+		last = c;
+	}
 }
 
 
 void pwm_duty(uint8_t ttc, uint8_t timer, float duty)
 {
-	uint16_t interval = TTC_INTERVAL(ttc, timer);
+	uint16_t interval = ttc_get(ttc, timer, ttc_interval);
+	uint16_t match = duty * interval;
+	uint16_t old = ttc_get(ttc, timer, ttc_match_1);
+	uint16_t lo = match < old ? match : old;
+	uint16_t hi = match < old ? old : match;
+	bool running = !(ttc_get(ttc, timer, ttc_cnt_ctrl) &
+	    1 << TTC_CNT_CTRL_nEN_SHIFT);
 
-	TTC_MATCH_1(ttc, timer) = duty * interval;
+	/* a jump across the whole period has no window, and glitches anyway */
+	if (match != old && running && (lo > SYNC_MARGIN || hi < interval))
+		wait_window(ttc, timer, lo, hi);
+	ttc_set(ttc, timer, ttc_match_1, match);
 }
 
 
 void pwm_start(uint8_t ttc, uint8_t timer)
 {
-	TTC_CNT_CTRL(ttc, timer) &= ~(1 << TTC_CNT_CTRL_nEN_SHIFT);
+	ttc_set(ttc, timer, ttc_cnt_ctrl,
+	    ttc_get(ttc, timer, ttc_cnt_ctrl) & ~(1 << TTC_CNT_CTRL_nEN_SHIFT));
 }
@@ -27,6 +27,12 @@ enum pwm_clk {
 void pwm_init(uint8_t ttc, uint8_t timer, enum pwm_clk clk, uint8_t clk_shr,
     bool invert, uint8_t mio);
 void pwm_interval(uint8_t ttc, uint8_t timer, uint16_t intv);
+
+/*
+ * Change the duty cycle (0-1) of a running PWM without disturbing the current
+ * period. This may busy-wait for up to one PWM period.
+ */
+
 void pwm_duty(uint8_t ttc, uint8_t timer, float duty);
 void pwm_start(uint8_t ttc, uint8_t timer);
 
@@ -9,14 +9,31 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/mman.h>
 
+#include "uio.h"
 #include "regmap.h"
 
 
+enum backend {
+	be_mem,
+	be_uio,
+	be_file,
+};
+
+
+struct regmap_stats regmap_stats;
+bool regmap_verify = 0;
+
+static enum backend backend = be_mem;
+static const char *file_path;
+
+
 static size_t round_down_to_page(size_t bytes)
 {
 	int page = getpagesize();
@@ -33,29 +50,154 @@ static size_t round_up_to_page(size_t bytes)
 }
 
 
-volatile void *regmap_open(struct regmap *regmap, off_t addr, size_t size)
+void regmap_backend(const char *spec)
 {
-	off_t start;
+	if (!strcmp(spec, "mem")) {
+		backend = be_mem;
+	} else if (!strcmp(spec, "uio")) {
+		backend = be_uio;
+	} else if (!strncmp(spec, "file:", 5) && spec[5]) {
+		backend = be_file;
+		file_path = spec + 5;
+	} else {
+		fprintf(stderr,
+		    "register access must be mem, uio, or file:PATH, not "
+		    "\"%s\"\n", spec);
+		exit(1);
+	}
+}
+
+
+/* ----- /dev/mem and files ------------------------------------------------ */
+
+
+static volatile void *map_fd(int fd, off_t start, size_t size)
+{
+	volatile void *base;
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, start);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return base;
+}
 
-	regmap->fd = open("/dev/mem", O_RDWR | O_SYNC);
-	if (regmap->fd < 0) {
+
+static volatile void *map_mem(off_t start, size_t size)
+{
+	volatile void *base;
+	int fd;
+
+	fd = open("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC);
+	if (fd < 0) {
 		perror("/dev/mem");
 		exit(1);
 	}
-	start = round_down_to_page(addr);
-	regmap->size = round_up_to_page(size + addr - start);
-	regmap->base = mmap(NULL, regmap->size, PROT_READ | PROT_WRITE,
-	    MAP_SHARED, regmap->fd, start);
-	if (regmap->base == MAP_FAILED) {
+	base = map_fd(fd, start, size);
+	(void) close(fd);
+	return base;
+}
+
+
+static volatile void *map_file(off_t start, size_t size)
+{
+	unsigned long offset = start;
+	volatile void *base;
+	struct stat st;
+	int fd;
+
+	if (offset < REGMAP_FILE_BASE) {
+		fprintf(stderr, "0x%lx is below the file's base address\n",
+		    offset);
+		exit(1);
+	}
+	offset -= REGMAP_FILE_BASE;
+
+	fd = open(file_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		perror(file_path);
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(file_path);
+		exit(1);
+	}
+	if ((unsigned long) st.st_size < offset + size &&
+	    ftruncate(fd, offset + size) < 0) {
+		perror(file_path);
+		exit(1);
+	}
+	base = map_fd(fd, offset, size);
+	(void) close(fd);
+	return base;
+}
+
+
+/* ----- UIO --------------------------------------------------------------- */
+
+
+/*
+ * The registers may be spread over several UIO maps, e.g., one per TTC. We
+ * reserve the address space for the whole range, and then map the UIO maps
+ * into it, so that the caller sees one contiguous region.
+ */
+
+static volatile void *map_uio(off_t start, size_t size)
+{
+	void *base;
+	size_t pos, map_size;
+	unsigned index;
+	int fd;
+
+	base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
 		perror("mmap");
 		exit(1);
 	}
-#if 0
-fprintf(stderr, "0x%lx+0x%lx: 0x%lx+0x%lx, %p->%p\n",
-    (unsigned long) addr, (unsigned long) size,
-    (unsigned long) start, (unsigned long) regmap->size,
-    regmap->base, regmap->base + addr - start);
-#endif
+	for (pos = 0; pos < size; pos += map_size) {
+		fd = uio_find_map(start + pos, &index, &map_size);
+		if (fd < 0) {
+			fprintf(stderr, "no UIO map at 0x%lx\n",
+			    (unsigned long) (start + pos));
+			exit(1);
+		}
+		if (map_size > size - pos)
+			map_size = size - pos;
+		if (mmap(base + pos, map_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_FIXED, fd, index * getpagesize()) ==
+		    MAP_FAILED) {
+			perror("mmap(uio)");
+			exit(1);
+		}
+		(void) close(fd);
+	}
+	return base;
+}
+
+
+/* ----- Open/close -------------------------------------------------------- */
+
+
+volatile void *regmap_open(struct regmap *regmap, off_t addr, size_t size)
+{
+	off_t start;
+
+	start = round_down_to_page(addr);
+	regmap->size = round_up_to_page(size + addr - start);
+	switch (backend) {
+	case be_mem:
+		regmap->base = map_mem(start, regmap->size);
+		break;
+	case be_uio:
+		regmap->base = map_uio(start, regmap->size);
+		break;
+	case be_file:
+		regmap->base = map_file(start, regmap->size);
+		break;
+	default:
+		abort();
+	}
 	return regmap->base + addr - start;
 }
 
@@ -66,8 +208,4 @@ void regmap_close(const struct regmap *regmap)
 		perror("munmap");
 		exit(1);
 	}
-	if (close(regmap->fd) < 0) {
-		perror("close");
-		exit(1);
-	}
 }
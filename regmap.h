@@ -10,15 +10,60 @@
 #ifndef REGMAP_H
 #define	REGMAP_H
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 
+/*
+ * With the "file" backend, the file holds the register space from this
+ * address on. E.g., MIO_PIN(0) is at offset 0x700 and TTC 0 at 0x1000.
+ */
+
+#define	REGMAP_FILE_BASE	0xF8000000
+
+
 struct regmap {
-	int fd;
 	volatile void *base;
 	size_t size;
 };
 
+/*
+ * Register accessors that keep a shadow copy of configuration registers
+ * (ttc_get/ttc_set, mio_get/mio_set) count their bus transactions here.
+ * "skipped" are writes that did not reach the bus because the register
+ * already had the value.
+ *
+ * If regmap_verify is set, reading a shadowed register also reads the
+ * hardware, and differences are counted in "mismatches" and reported.
+ */
+
+struct regmap_stats {
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long skipped;
+	unsigned long mismatches;
+};
+
+
+extern struct regmap_stats regmap_stats;
+extern bool regmap_verify;
+
+
+/*
+ * Select how registers are accessed:
+ *
+ * mem		/dev/mem (default)
+ * uio		the maps of UIO devices (e.g., generic-uio). The maps must
+ *		cover the registers without gaps, each beginning where the
+ *		previous one ended.
+ * file:PATH	a regular file or shared memory object, e.g., for
+ *		simulation. The file is extended if it is too small.
+ *
+ * The backend must be selected before the first regmap_open. Exits if "spec"
+ * is invalid.
+ */
+
+void regmap_backend(const char *spec);
 
 volatile void *regmap_open(struct regmap *regmap, off_t addr, size_t size);
 void regmap_close(const struct regmap *regmap);
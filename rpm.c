@@ -7,26 +7,246 @@
  * A copy of the license can be found in the file COPYING.txt
  */
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/time.h>
 
 #include "mio.h"
 #include "ttc.h"
+#include "stats.h"
+#include "trace.h"
 #include "rpm.h"
 
 
 /*
- * Fan tacho signal has four edges per revolution, so the tacho signal
- * frequency is twice the rotation speed.
+ * Period measurement: the event timer counts the timer's (prescaled) clock
+ * while the tacho signal is high, and latches the count at the end of the
+ * pulse. The tacho signal has a duty cycle of about 50%, so the period is
+ * twice the pulse width.
+ *
+ * We pick the prescaler such that the longest pulse we can measure is at
+ * least MAX_PULSE_S, i.e., period mode works down to
+ * 60 / (2 * MAX_PULSE_S * ppr) RPM, which is 60 RPM for the usual two pulses
+ * per revolution.
+ *
+ * If a pulse is shorter than MIN_TICKS, the resolution of the measurement is
+ * worse than 1 / MIN_TICKS, and we switch to counting edges. We switch back
+ * when the frequency drops below 80% of that threshold.
+ *
+ * @@@ UG585 is not very explicit about the clock of the event timer. This
+ * assumes that it is the timer's clock after the prescaler.
+ */
+
+#define	MAX_PULSE_S		0.25
+#define	MIN_TICKS		250
+#define	PERIOD_HYSTERESIS	0.8
+
+
+/*
+ * TTC_EV_REG only tells us the width of the last pulse, not whether there has
+ * been a new one, and TTC_ISR has no bit for a new event either. So if the
+ * register keeps its value, we can't tell a fan that runs at a steady speed
+ * from one that stopped with the tacho signal low. We then count edges for
+ * PROBE_S, which is long enough to see at least one edge at the slowest speed
+ * period mode can measure.
  */
 
-#define	CYCLES_PER_REVOLUTION	2.0
+#define	STALE_S			(2 * MAX_PULSE_S)
+#define	PROBE_S			(2 * MAX_PULSE_S)
+
 
+/* ----- Interrupt status ------------------------------------------------- */
 
-void rpm_init(struct rpm_ctx *ctx, uint8_t ttc, uint8_t timer, uint8_t mio)
+
+/*
+ * TTC_ISR is clear-on-read, so we collect the bits in t->isr and hand them
+ * out one by one.
+ */
+
+static bool take_isr(struct tacho *t, unsigned shift)
+{
+	t->isr |= ttc_get(t->ttc, t->timer, ttc_isr);
+	if (!(t->isr & 1 << shift))
+		return 0;
+	t->isr &= ~(1 << shift);
+	return 1;
+}
+
+
+static void update_ier(const struct tacho *t)
+{
+	ttc_set(t->ttc, t->timer, ttc_ier,
+	    t->irq && t->mode == rpm_count ? 1 << TTC_INT_OVR_SHIFT : 0);
+}
+
+
+/* ----- Mode selection ---------------------------------------------------- */
+
+
+static double max_period_hz(const struct tacho *t)
+{
+	return 1 / (2 * MIN_TICKS * t->tick_s);
+}
+
+
+static void set_mode(struct tacho *t, enum rpm_mode mode, uint64_t now)
+{
+	uint8_t ttc = t->ttc;
+	uint8_t timer = t->timer;
+
+	switch (mode) {
+	case rpm_count:
+		ttc_set(ttc, timer, ttc_ev_ctrl, 0);
+		ttc_set(ttc, timer, ttc_clk_ctrl,
+		    1 << TTC_CLK_CTRL_EXT_CLK_SHIFT);
+		(void) ttc_get(ttc, timer, ttc_isr);	/* clear on read */
+		t->isr = 0;
+		t->count = ttc_get(ttc, timer, ttc_counter);
+		t->wrap_seen = 0;
+		t->probe_ns = 0;
+		break;
+	case rpm_period:
+		ttc_set(ttc, timer, ttc_clk_ctrl,
+		    t->shr << TTC_CLK_CTRL_PRE_SHR_SHIFT |
+		    1 << TTC_CLK_CTRL_PRE_EN_SHIFT);
+		/* the event timer may have disabled itself on overflow */
+		ttc_write(ttc, timer, ttc_ev_ctrl, 1 << TTC_EV_CTRL_EN_SHIFT);
+		(void) ttc_get(ttc, timer, ttc_isr);	/* clear on read */
+		t->isr = 0;
+		t->last_ev = ttc_get(ttc, timer, ttc_ev_reg);
+		t->ev_ns = now;
+		t->ev_valid = 0;
+		break;
+	default:
+		abort();
+	}
+	t->mode = mode;
+	update_ier(t);
+}
+
+
+/* ----- Measurement ------------------------------------------------------- */
+
+
+/*
+ * Returns the frequency in period mode. Until we have a fresh measurement,
+ * e.g., right after switching, we use the last frequency we know.
+ */
+
+static double period_hz(struct tacho *t, uint64_t now)
+{
+	uint8_t ttc = t->ttc;
+	uint8_t timer = t->timer;
+	uint16_t ev;
+
+	/*
+	 * With E_Ov = 0, the event timer stops when it overflows. In this case,
+	 * the pulse was too long to measure, so the fan is (nearly) stopped.
+	 */
+	if (take_isr(t, TTC_INT_EV_SHIFT)) {
+		/* re-enable; the hardware may have cleared E_En */
+		ttc_write(ttc, timer, ttc_ev_ctrl, 1 << TTC_EV_CTRL_EN_SHIFT);
+		t->last_ev = ttc_get(ttc, timer, ttc_ev_reg);
+		t->ev_ns = now;
+		t->ev_valid = 0;
+		return 0;
+	}
+
+	ev = ttc_get(ttc, timer, ttc_ev_reg);
+	if (ev != t->last_ev) {
+		t->last_ev = ev;
+		t->ev_ns = now;
+		t->ev_valid = 1;
+	}
+	if (!t->ev_valid)
+		return t->hz;
+	if (!ev)
+		return 0;
+	return 1 / (2 * ev * t->tick_s);
+}
+
+
+static uint64_t read_count(struct tacho *t)
+{
+	uint64_t base = t->count;
+	uint64_t count;
+	uint16_t n;
+
+	if (take_isr(t, TTC_INT_OVR_SHIFT)) {
+		if (t->wrap_seen)
+			t->wrap_seen = 0;
+		else
+			base += 0x10000;
+	}
+	n = ttc_get(t->ttc, t->timer, ttc_counter);
+	count = (base & ~(uint64_t) 0xffff) | n;
+
+	/*
+	 * The counter wrapped after we looked at the overflow flag. Count the
+	 * overflow now, and ignore the flag next time.
+	 */
+	if (count < t->count) {
+		count += 0x10000;
+		t->wrap_seen = 1;
+	}
+	return count;
+}
+
+
+static void tacho_update(struct tacho *t)
+{
+	uint64_t now = trace_now();
+	uint64_t count, d;
+	double dt;
+
+	if (now <= t->last_ns)
+		return;
+	dt = (now - t->last_ns) * 1e-9;
+	switch (t->mode) {
+	case rpm_count:
+		count = read_count(t);
+		d = count - t->count;
+		t->count = count;
+		t->cycles += d;
+		if (t->probe_ns) {
+			/* keep the last frequency until the probe is done */
+			if (now - t->probe_ns < PROBE_S * 1e9)
+				break;
+			t->hz = (count - t->probe_count) /
+			    ((now - t->probe_ns) * 1e-9);
+			t->probe_ns = 0;
+		} else {
+			t->hz = d / dt;
+		}
+		if (t->period_ok &&
+		    t->hz < max_period_hz(t) * PERIOD_HYSTERESIS)
+			set_mode(t, rpm_period, now);
+		break;
+	case rpm_period:
+		t->hz = period_hz(t, now);
+		t->cycles += t->hz * dt;
+		if (t->hz > max_period_hz(t)) {
+			set_mode(t, rpm_count, now);
+		} else if (now - t->ev_ns > STALE_S * 1e9) {
+			set_mode(t, rpm_count, now);
+			t->probe_ns = now;
+			t->probe_count = t->count;
+		}
+		break;
+	default:
+		abort();
+	}
+	t->last_ns = now;
+}
+
+
+/* ----- Setup ------------------------------------------------------------- */
+
+
+void tacho_init(struct tacho *t, uint8_t ttc, uint8_t timer, uint8_t mio,
+    unsigned ppr)
 {
 	switch (ttc) {
 	case 0:
@@ -42,7 +262,8 @@ void rpm_init(struct rpm_ctx *ctx, uint8_t ttc, uint8_t timer, uint8_t mio)
 		    "MIO must be 0 (EMIO), 17, 29, or 41, not %u\n", mio);
 		exit(1);
 	default:
-		fprintf(stderr, "rpm_init: ttc must be 0 or 1, not %u\n", ttc);
+		fprintf(stderr,
+		    "tacho_init: ttc must be 0 or 1, not %u\n", ttc);
 		exit(1);
 	}
 
@@ -51,44 +272,80 @@ void rpm_init(struct rpm_ctx *ctx, uint8_t ttc, uint8_t timer, uint8_t mio)
 		exit(1);
 	}
 
+	t->ttc = ttc;
+	t->timer = timer;
+	t->ppr = ppr;
+	t->period_ok = 0;
+	t->last_ns = trace_now();
+	t->cycles = 0;
+	t->hz = 0;
+	t->irq = 0;
+
 	ttc_open();
-	TTC_CLK_CTRL(ttc, timer) = 1 << TTC_CLK_CTRL_EXT_CLK_SHIFT;
-	TTC_CNT_CTRL(ttc, timer) = 0;
+	set_mode(t, rpm_count, t->last_ns);
+	ttc_set(ttc, timer, ttc_cnt_ctrl, 0);
 
 	if (mio) {
 		mio_open();
-		MIO_PIN(mio) =
-		    (MIO_PIN(mio) & ~(MIO_SEL_MASK << MIO_SEL_SHIFT)) |
+		mio_set(mio,
+		    (mio_get(mio) & ~(MIO_SEL_MASK << MIO_SEL_SHIFT)) |
 		    MIO_SEL_TTC_CLK << MIO_SEL_SHIFT |
-		    1 << MIO_TRI_EN_SHIFT;
+		    1 << MIO_TRI_EN_SHIFT);
 	}
+}
+
+
+void tacho_period(struct tacho *t, unsigned long pclk)
+{
+	/* the prescaler divides by 2^(shr + 1) */
+	t->shr = 0;
+	t->tick_s = 2.0 / pclk;
+	while (t->shr != TTC_CLK_CTRL_PRE_SHR_MASK &&
+	    65535 * t->tick_s < MAX_PULSE_S) {
+		t->shr++;
+		t->tick_s *= 2;
+	}
+	t->period_ok = 1;
+	set_mode(t, rpm_period, t->last_ns);
+}
+
+
+void tacho_irq_enable(struct tacho *t)
+{
+	t->irq = 1;
+	update_ier(t);
+}
+
 
-	ctx->ttc = ttc;
-	ctx->timer = timer;
-	gettimeofday(&ctx->last_t, NULL);
-	ctx->last_n = TTC_COUNTER(ttc, timer);
+void tacho_irq(struct tacho *t)
+{
+	tacho_update(t);
+}
+
+
+void rpm_init(struct rpm_ctx *ctx, struct tacho *t)
+{
+	tacho_update(t);
+	ctx->tacho = t;
+	ctx->last_cycles = t->cycles;
+	ctx->last_ns = t->last_ns;
 }
 
 
 double rpm_poll(struct rpm_ctx *ctx)
 {
-	struct timeval t;
+	struct tacho *t = ctx->tacho;
 	double dt, rpm;
-	uint16_t n;
 
-	if (gettimeofday(&t, NULL) < 0) {
-		perror("gettimeofday");
-		exit(1);
-	}
-	n = TTC_COUNTER(ctx->ttc, ctx->timer);
-	dt = t.tv_sec + t.tv_usec * 1e-6 -
-	    ctx->last_t.tv_sec - ctx->last_t.tv_usec * 1e-6;
-	if (dt <= 0) {
-		fprintf(stderr, "time stood still or went backwards ?\n");
+	tacho_update(t);
+	if (t->last_ns <= ctx->last_ns) {
+		fprintf(stderr, "time stood still ?\n");
+		stats_error(stats_err_clock);
 		return 0;
 	}
-	rpm = (uint16_t) (n - ctx->last_n) * 60 / dt / CYCLES_PER_REVOLUTION;
-	ctx->last_t = t;
-	ctx->last_n = n;
+	dt = (t->last_ns - ctx->last_ns) * 1e-9;
+	rpm = (t->cycles - ctx->last_cycles) * 60 / dt / t->ppr;
+	ctx->last_cycles = t->cycles;
+	ctx->last_ns = t->last_ns;
 	return rpm;
 }
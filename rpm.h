@@ -10,15 +10,86 @@
 #ifndef RPM_H
 #define	RPM_H
 
-struct rpm_ctx {
+enum rpm_mode {
+	rpm_count,	/* count tacho edges */
+	rpm_period,	/* time tacho pulses with the event timer */
+};
+
+
+/*
+ * A tacho input. The tacho keeps a running count of tacho cycles. In count
+ * mode, this is simply the number of edges the counter has seen. In period
+ * mode, we integrate the frequency derived from the pulse width.
+ */
+
+struct tacho {
 	uint8_t ttc;
 	uint8_t timer;
-	uint16_t last_n;
-	struct timeval last_t;
+	unsigned ppr;		/* tacho pulses per revolution */
+	enum rpm_mode mode;
+	bool period_ok;		/* may switch to period mode */
+	uint8_t shr;		/* prescaler setting for period mode */
+	double tick_s;		/* event timer resolution */
+	uint64_t last_ns;	/* CLOCK_MONOTONIC */
+	double cycles;		/* running count */
+	double hz;		/* last frequency */
+	uint32_t isr;		/* ISR bits read but not yet handled */
+	bool irq;		/* overflow interrupt is delivered to us */
+
+	/*
+	 * Count mode. The hardware counter has only 16 bits. We extend it to
+	 * 64 bits with the help of the overflow flag. Without interrupts, this
+	 * is correct as long as we poll before the counter wraps twice.
+	 */
+	uint64_t count;		/* extended counter */
+	bool wrap_seen;		/* pending overflow already counted */
+
+	/* period mode */
+	uint16_t last_ev;	/* last event timer value */
+	uint64_t ev_ns;		/* time when last_ev changed */
+	bool ev_valid;		/* last_ev is a valid measurement */
+
+	/*
+	 * Probe: a stale TTC_EV_REG means either a stopped fan or pulses of
+	 * the same width as before, so we count edges for a while to tell.
+	 */
+	uint64_t probe_ns;	/* start of the probe, 0 if none */
+	uint64_t probe_count;	/* extended counter at the start */
 };
 
+/*
+ * A measurement window on a tacho. Several contexts can share the same
+ * tacho, e.g., for reporting and for control, without disturbing each other.
+ */
+
+struct rpm_ctx {
+	struct tacho *tacho;
+	double last_cycles;
+	uint64_t last_ns;	/* CLOCK_MONOTONIC */
+};
+
+
+void tacho_init(struct tacho *t, uint8_t ttc, uint8_t timer, uint8_t mio,
+    unsigned ppr);
+
+/*
+ * Enable period measurement. The tacho then times pulses while the fan is
+ * slow, and goes back to counting edges when the fan is too fast for the
+ * event timer to resolve the pulse width well. "pclk" is the cpu_1x
+ * frequency in Hz.
+ */
+
+void tacho_period(struct tacho *t, unsigned long pclk);
+
+/*
+ * Enable the overflow interrupt, and call tacho_irq whenever it occurs. Then
+ * any poll interval yields correct results.
+ */
+
+void tacho_irq_enable(struct tacho *t);
+void tacho_irq(struct tacho *t);
 
-void rpm_init(struct rpm_ctx *ctx, uint8_t ttc, uint8_t timer, uint8_t mio);
+void rpm_init(struct rpm_ctx *ctx, struct tacho *t);
 double rpm_poll(struct rpm_ctx *ctx);
 
 #endif /* !RPM_H */
@@ -0,0 +1,81 @@
+/*
+ * rt.c - Real-time scheduling
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#define _GNU_SOURCE	/* for sched_setaffinity */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "rt.h"
+
+
+/*
+ * Enough for the deepest call chain of the event loop, with the message
+ * buffers on the stack.
+ */
+
+#define	RT_STACK_PREFAULT	(128 * 1024)
+
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu >= CPU_SETSIZE) {
+		fprintf(stderr, "CPU %d is out of range\n", cpu);
+		exit(1);
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		perror("sched_setaffinity");
+		exit(1);
+	}
+}
+
+
+/*
+ * mlockall locks the stack only as far as it has grown. Touch the pages we
+ * may need later, so that they are faulted in, and locked, now.
+ */
+
+static void prefault_stack(void)
+{
+	char buf[RT_STACK_PREFAULT];
+	volatile char *p = buf;	/* the stores must not be optimized away */
+	long page = sysconf(_SC_PAGESIZE);
+	long i;
+
+	for (i = 0; i < RT_STACK_PREFAULT; i += page)
+		p[i] = 0;
+}
+
+
+void rt_setup(int priority, int cpu)
+{
+	struct sched_param param = {
+		.sched_priority = priority,
+	};
+
+	if (cpu >= 0)
+		pin(cpu);
+	if (!priority)
+		return;
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		perror("mlockall");
+		exit(1);
+	}
+	prefault_stack();
+	if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+		perror("sched_setscheduler");
+		exit(1);
+	}
+}
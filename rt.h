@@ -0,0 +1,23 @@
+/*
+ * rt.h - Real-time scheduling
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef RT_H
+#define	RT_H
+
+/*
+ * Pin the process to "cpu", unless negative. If "priority" is not zero, also
+ * lock all current and future memory, pre-fault the stack, and switch to
+ * SCHED_FIFO at that priority. Exits on failure.
+ *
+ * This must be done after forking, since memory locks are not inherited.
+ */
+
+void rt_setup(int priority, int cpu);
+
+#endif /* !RT_H */
@@ -0,0 +1,135 @@
+/*
+ * slew.c - Limit the rate at which duty cycles change
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "conf.h"
+#include "board.h"
+#include "slew.h"
+
+
+struct rate {
+	const char *name;	/* fan group */
+	double up, down;
+	struct rate *next;
+};
+
+
+static struct rate *rates = NULL;
+static struct rate **last_rate = &rates;
+
+
+/* ----- Configuration ----------------------------------------------------- */
+
+
+static double rate(const char *s)
+{
+	double r;
+	char *end;
+
+	r = strtod(s, &end);
+	if (end == s || *end || r < 0)
+		conf_error("invalid rate \"%s\"", s);
+	return r;
+}
+
+
+static void conf_slew(int argc, char *const *argv)
+{
+	struct rate *r;
+
+	r = malloc(sizeof(*r));
+	if (!r) {
+		perror("malloc");
+		exit(1);
+	}
+	r->name = strdup(argv[0]);
+	if (!r->name) {
+		perror("strdup");
+		exit(1);
+	}
+	r->up = rate(argv[1]);
+	r->down = argc > 2 ? rate(argv[2]) : SLEW_DEFAULT_DOWN;
+	r->next = NULL;
+	*last_rate = r;
+	last_rate = &r->next;
+}
+
+
+const struct conf_keyword slew_conf[] = {
+	{ "slew",	2, 3,	conf_slew },
+	{ NULL, 0, 0, NULL }
+};
+
+
+/* ----- Ramping ----------------------------------------------------------- */
+
+
+void slew_init(struct slew *s, const struct board *board, unsigned ch,
+    double duty)
+{
+	const struct rate *r;
+	unsigned channels;
+
+	s->up = SLEW_DEFAULT_UP;
+	s->down = SLEW_DEFAULT_DOWN;
+	s->start = board->fans[ch].min_duty;
+	for (r = rates; r; r = r->next) {
+		channels = board_channels(board, r->name);
+		if (!channels) {
+			fprintf(stderr, "unknown fan group \"%s\"\n", r->name);
+			exit(1);
+		}
+		if (channels & 1 << ch) {
+			s->up = r->up;
+			s->down = r->down;
+		}
+	}
+	slew_force(s, duty);
+}
+
+
+/*
+ * Below its minimum, the fan may not turn at all, so there is no point in
+ * ramping through this range.
+ */
+
+bool slew_set(struct slew *s, double target)
+{
+	s->target = target;
+	if (target > s->duty && s->duty < s->start)
+		s->duty = target < s->start ? target : s->start;
+	if ((target > s->duty && !s->up) || (target < s->duty && !s->down))
+		s->duty = target;
+	return s->duty != target;
+}
+
+
+void slew_force(struct slew *s, double duty)
+{
+	s->duty = s->target = duty;
+}
+
+
+bool slew_step(struct slew *s, double dt)
+{
+	if (s->target > s->duty) {
+		s->duty += s->up * dt;
+		if (!s->up || s->duty > s->target)
+			s->duty = s->target;
+	} else if (s->target < s->duty) {
+		s->duty -= s->down * dt;
+		if (!s->down || s->duty < s->target)
+			s->duty = s->target;
+	}
+	return s->duty != s->target;
+}
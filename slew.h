@@ -0,0 +1,83 @@
+/*
+ * slew.h - Limit the rate at which duty cycles change
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef SLEW_H
+#define	SLEW_H
+
+#include <stdbool.h>
+
+#include "conf.h"
+#include "board.h"
+
+
+/*
+ * Default ramp rates, in percent per second. Speeding a fan up draws a large
+ * current, so this is limited. Slowing down is not. 0 means "no limit".
+ */
+
+#define	SLEW_DEFAULT_UP		50
+#define	SLEW_DEFAULT_DOWN	0
+
+/*
+ * Interval at which a ramping duty cycle is updated.
+ */
+
+#define	SLEW_STEP_S		0.02
+
+
+struct slew {
+	double up, down;	/* % per second, 0 for no limit */
+	double duty;		/* current duty cycle, 0-100 */
+	double target;
+	double start;		/* ramps from below this begin here */
+};
+
+
+/*
+ * Configuration:
+ *
+ * slew GROUP UP [DOWN]
+ *	Ramp rates of the fan group (a fan name or alias, or all), in percent
+ *	per second. 0 disables the limit. DOWN defaults to the built-in
+ *	default. Later lines override earlier ones.
+ */
+
+extern const struct conf_keyword slew_conf[];
+
+
+/*
+ * Set up the limiter of channel "ch" of the board, starting at "duty". Exits
+ * if the configuration names an unknown group.
+ */
+
+void slew_init(struct slew *s, const struct board *board, unsigned ch,
+    double duty);
+
+/*
+ * Set a new target. Returns 1 if the duty cycle has to ramp, 0 if it has
+ * reached the target already (e.g., if the rate is not limited). A ramp up
+ * from below the fan's minimum duty cycle begins at the minimum.
+ */
+
+bool slew_set(struct slew *s, double target);
+
+/*
+ * Go to "duty" immediately, e.g., in an emergency.
+ */
+
+void slew_force(struct slew *s, double duty);
+
+/*
+ * Advance the ramp by "dt" seconds. Returns 1 while the target has not been
+ * reached.
+ */
+
+bool slew_step(struct slew *s, double dt);
+
+#endif /* !SLEW_H */
@@ -0,0 +1,182 @@
+/*
+ * state.c - Encode a snapshot of the fan system
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "state.h"
+
+
+struct buf {
+	uint8_t *p;
+	size_t size;
+	size_t len;
+	bool overflow;
+};
+
+
+static void put(struct buf *b, const void *data, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->overflow = 1;
+		return;
+	}
+	memcpy(b->p + b->len, data, len);
+	b->len += len;
+}
+
+
+/* ----- JSON -------------------------------------------------------------- */
+
+
+static void json(struct buf *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+
+static void json(struct buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (b->overflow)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf((char *) b->p + b->len, b->size - b->len, fmt, ap);
+	va_end(ap);
+	if (n < 0 || (size_t) n >= b->size - b->len)
+		b->overflow = 1;
+	else
+		b->len += n;
+}
+
+
+static void encode_json(struct buf *b, uint64_t t_ms,
+    const struct state_fan *fans, unsigned n_fans)
+{
+	const struct state_fan *f;
+	unsigned i;
+
+	json(b, "{\"t\":%llu,\"fans\":[", (unsigned long long) t_ms);
+	for (f = fans; f != fans + n_fans; f++) {
+		json(b, "%s{\"name\":\"%s\",\"duty\":%u,\"rpm\":[",
+		    f == fans ? "" : ",", f->name, f->duty);
+		for (i = 0; i != f->n_rpm; i++)
+			json(b, "%s%u", i ? "," : "", f->rpm[i]);
+		json(b, "],\"flags\":%u}", f->flags);
+	}
+	json(b, "]}");
+}
+
+
+/* ----- CBOR -------------------------------------------------------------- */
+
+
+enum cbor_major {
+	cbor_uint	= 0,
+	cbor_text	= 3,
+	cbor_array	= 4,
+	cbor_map	= 5,
+};
+
+
+static void cbor_head(struct buf *b, enum cbor_major major, uint64_t n)
+{
+	uint8_t h[9];
+	unsigned len, i;
+
+	if (n < 24) {
+		h[0] = major << 5 | n;
+		put(b, h, 1);
+		return;
+	}
+	if (n <= 0xff) {
+		h[0] = major << 5 | 24;
+		len = 1;
+	} else if (n <= 0xffff) {
+		h[0] = major << 5 | 25;
+		len = 2;
+	} else if (n <= 0xffffffff) {
+		h[0] = major << 5 | 26;
+		len = 4;
+	} else {
+		h[0] = major << 5 | 27;
+		len = 8;
+	}
+	for (i = 0; i != len; i++)
+		h[len - i] = n >> (8 * i);
+	put(b, h, len + 1);
+}
+
+
+static void cbor_string(struct buf *b, const char *s)
+{
+	size_t len = strlen(s);
+
+	cbor_head(b, cbor_text, len);
+	put(b, s, len);
+}
+
+
+static void encode_cbor(struct buf *b, uint64_t t_ms,
+    const struct state_fan *fans, unsigned n_fans)
+{
+	const struct state_fan *f;
+	unsigned i;
+
+	cbor_head(b, cbor_map, 2);
+	cbor_string(b, "t");
+	cbor_head(b, cbor_uint, t_ms);
+	cbor_string(b, "fans");
+	cbor_head(b, cbor_array, n_fans);
+	for (f = fans; f != fans + n_fans; f++) {
+		cbor_head(b, cbor_map, 4);
+		cbor_string(b, "name");
+		cbor_string(b, f->name);
+		cbor_string(b, "duty");
+		cbor_head(b, cbor_uint, f->duty);
+		cbor_string(b, "rpm");
+		cbor_head(b, cbor_array, f->n_rpm);
+		for (i = 0; i != f->n_rpm; i++)
+			cbor_head(b, cbor_uint, f->rpm[i]);
+		cbor_string(b, "flags");
+		cbor_head(b, cbor_uint, f->flags);
+	}
+}
+
+
+/* ----- Interface --------------------------------------------------------- */
+
+
+size_t state_encode(enum state_format format, void *buf, size_t size,
+    uint64_t t_ms, const struct state_fan *fans, unsigned n_fans)
+{
+	struct buf b = {
+		.p		= buf,
+		.size		= size,
+		.len		= 0,
+		.overflow	= 0,
+	};
+
+	switch (format) {
+	case state_json:
+		encode_json(&b, t_ms, fans, n_fans);
+		break;
+	case state_cbor:
+		encode_cbor(&b, t_ms, fans, n_fans);
+		break;
+	default:
+		abort();
+	}
+	return b.overflow ? 0 : b.len;
+}
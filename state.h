@@ -0,0 +1,60 @@
+/*
+ * state.h - Encode a snapshot of the fan system
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef STATE_H
+#define	STATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * The snapshot is a map with the keys
+ *
+ * "t"		time of the measurement, in milliseconds since the epoch
+ * "fans"	array of PWM channels, each a map with the keys
+ *	"name"	channel name, e.g., "front"
+ *	"duty"	duty cycle, in percent
+ *	"rpm"	array with the RPM of each tacho of the channel
+ *	"flags"	bit mask of FAN_F_* flags
+ *
+ * encoded either as JSON or as CBOR (RFC 8949).
+ */
+
+#define	FAN_F_STALL	(1 << 0)	/* duty > 0 but a tacho reads 0 RPM */
+#define	FAN_F_FORCED	(1 << 1)	/* forced to 100% */
+#define	FAN_F_RPM_CTL	(1 << 2)	/* under closed-loop RPM control */
+#define	FAN_F_ALARM	(1 << 3)	/* fault detected */
+
+#define	STATE_MAX_RPM	2
+
+
+enum state_format {
+	state_json,
+	state_cbor,
+};
+
+struct state_fan {
+	const char *name;
+	unsigned duty;
+	unsigned n_rpm;
+	unsigned rpm[STATE_MAX_RPM];
+	unsigned flags;
+};
+
+
+/*
+ * Returns the number of bytes written to "buf", or 0 if "buf" is too small.
+ * JSON output is NUL-terminated, but the NUL is not included in the length.
+ */
+
+size_t state_encode(enum state_format format, void *buf, size_t size,
+    uint64_t t_ms, const struct state_fan *fans, unsigned n_fans);
+
+#endif /* !STATE_H */
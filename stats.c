@@ -0,0 +1,178 @@
+/*
+ * stats.c - Latency histograms and error counts
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+
+#define	SUB_BITS	2	/* log2(STATS_SUB) */
+
+
+struct stats_hist stats_hists[stats_n_lats];
+unsigned long stats_errors[stats_n_errs];
+
+const char *const stats_lat_names[stats_n_lats] = {
+	[stats_command]	= "command",
+	[stats_wakeup]	= "wakeup",
+	[stats_read]	= "read",
+	[stats_publish]	= "publish",
+	[stats_failsafe] = "failsafe",
+};
+
+const char *const stats_err_names[stats_n_errs] = {
+	[stats_err_command]	= "command",
+	[stats_err_topic]	= "topic",
+	[stats_err_publish]	= "publish",
+	[stats_err_clock]	= "clock",
+};
+
+
+/* ----- Buckets ----------------------------------------------------------- */
+
+
+/*
+ * Values below STATS_SUB get a bucket each. Above, the bucket is given by the
+ * position of the most significant bit and the SUB_BITS bits below it.
+ */
+
+static unsigned bucket(uint64_t ns)
+{
+	unsigned msb, n;
+
+	if (ns < STATS_SUB)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	n = (msb - SUB_BITS + 1) * STATS_SUB +
+	    ((ns >> (msb - SUB_BITS)) & (STATS_SUB - 1));
+	return n < STATS_BUCKETS ? n : STATS_BUCKETS - 1;
+}
+
+
+/* lowest value of the bucket */
+
+static uint64_t bucket_ns(unsigned n)
+{
+	unsigned octave = n / STATS_SUB;
+
+	if (!octave)
+		return n;
+	return (uint64_t) (STATS_SUB + n % STATS_SUB) << (octave - 1);
+}
+
+
+/* ----- Recording and evaluation ------------------------------------------ */
+
+
+void stats_add(enum stats_lat lat, uint64_t ns)
+{
+	struct stats_hist *h = stats_hists + lat;
+
+	h->count++;
+	h->sum_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->bucket[bucket(ns)]++;
+}
+
+
+uint64_t stats_quantile(const struct stats_hist *h, double q)
+{
+	unsigned long rank, sum = 0;
+	unsigned i;
+
+	if (!h->count)
+		return 0;
+	rank = q * h->count;
+	if (rank >= h->count)
+		rank = h->count - 1;
+	for (i = 0; i != STATS_BUCKETS - 1; i++) {
+		sum += h->bucket[i];
+		if (sum > rank)
+			break;
+	}
+	if (i == STATS_BUCKETS - 1 || bucket_ns(i + 1) > h->max_ns)
+		return h->max_ns;
+	return bucket_ns(i + 1);
+}
+
+
+/* ----- Output ------------------------------------------------------------ */
+
+
+size_t stats_summary(char *buf, size_t size)
+{
+	const struct stats_hist *h;
+	size_t len = 0;
+	unsigned i;
+	int n;
+
+#define	ADD(...)							\
+	do {								\
+		n = snprintf(buf + len, size - len, __VA_ARGS__);	\
+		if (n < 0 || (size_t) n >= size - len)			\
+			return 0;					\
+		len += n;						\
+	} while (0)
+
+	ADD("{");
+	for (i = 0; i != stats_n_lats; i++) {
+		h = stats_hists + i;
+		ADD("\"%s\":{\"count\":%lu,\"mean\":%.1f,\"p50\":%.1f,"
+		    "\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},",
+		    stats_lat_names[i], h->count,
+		    h->count ? h->sum_ns * 1e-3 / h->count : 0,
+		    stats_quantile(h, 0.5) * 1e-3,
+		    stats_quantile(h, 0.99) * 1e-3,
+		    stats_quantile(h, 0.999) * 1e-3, h->max_ns * 1e-3);
+	}
+	ADD("\"errors\":{");
+	for (i = 0; i != stats_n_errs; i++)
+		ADD("%s\"%s\":%lu", i ? "," : "", stats_err_names[i],
+		    stats_errors[i]);
+	ADD("}}");
+
+#undef ADD
+
+	return len;
+}
+
+
+void stats_dump(FILE *file)
+{
+	const struct stats_hist *h;
+	unsigned i, j;
+
+	for (i = 0; i != stats_n_lats; i++) {
+		h = stats_hists + i;
+		fprintf(file, "%s: %lu, mean %.1f us, p50 %.1f us, "
+		    "p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+		    stats_lat_names[i], h->count,
+		    h->count ? h->sum_ns * 1e-3 / h->count : 0,
+		    stats_quantile(h, 0.5) * 1e-3,
+		    stats_quantile(h, 0.99) * 1e-3,
+		    stats_quantile(h, 0.999) * 1e-3, h->max_ns * 1e-3);
+		for (j = 0; j != STATS_BUCKETS; j++) {
+			if (!h->bucket[j])
+				continue;
+			if (j == STATS_BUCKETS - 1)
+				fprintf(file, "  >= %12.3f us %10lu\n",
+				    bucket_ns(j) * 1e-3, h->bucket[j]);
+			else
+				fprintf(file, "  < %13.3f us %10lu\n",
+				    bucket_ns(j + 1) * 1e-3, h->bucket[j]);
+		}
+	}
+	fprintf(file, "errors:");
+	for (i = 0; i != stats_n_errs; i++)
+		fprintf(file, " %s %lu", stats_err_names[i], stats_errors[i]);
+	fprintf(file, "\n");
+}
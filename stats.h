@@ -0,0 +1,86 @@
+/*
+ * stats.h - Latency histograms and error counts
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef STATS_H
+#define	STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+enum stats_lat {
+	stats_command,	/* MQTT message callback to duty cycle register write */
+	stats_wakeup,	/* poll timer deadline to the poll running */
+	stats_read,	/* rpm_poll, i.e., reading the tacho registers */
+	stats_publish,	/* mosquitto_publish */
+	stats_failsafe,	/* missed watchdog deadline to fans at 100% */
+	stats_n_lats
+};
+
+enum stats_err {
+	stats_err_command,	/* malformed pwm-set or rpm-set */
+	stats_err_topic,	/* message on a topic we don't handle */
+	stats_err_publish,	/* publishing while not connected */
+	stats_err_clock,	/* tacho read with no time elapsed */
+	stats_n_errs
+};
+
+/*
+ * Each octave of nanoseconds is split into STATS_SUB buckets, so a bucket is
+ * at most 1 / STATS_SUB (25%) wide. The last bucket also holds everything
+ * above it, from about 7.5 s on. Quantiles are reported as the upper end of
+ * their bucket, but never above the largest value recorded.
+ */
+
+#define	STATS_SUB	4
+#define	STATS_BUCKETS	128
+
+struct stats_hist {
+	unsigned long count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	unsigned long bucket[STATS_BUCKETS];
+};
+
+
+extern struct stats_hist stats_hists[stats_n_lats];
+extern unsigned long stats_errors[stats_n_errs];
+extern const char *const stats_lat_names[stats_n_lats];
+extern const char *const stats_err_names[stats_n_errs];
+
+
+/*
+ * Recording does not allocate or make system calls; the caller takes the
+ * time stamps.
+ */
+
+static inline void stats_error(enum stats_err err)
+{
+	stats_errors[err]++;
+}
+
+void stats_add(enum stats_lat lat, uint64_t ns);
+
+uint64_t stats_quantile(const struct stats_hist *h, double q);
+
+/*
+ * Summary of all histograms and error counts as a JSON object, with times in
+ * microseconds. Returns the length, or 0 if "size" is too small.
+ */
+
+size_t stats_summary(char *buf, size_t size);
+
+/*
+ * Print the summaries and all non-empty buckets.
+ */
+
+void stats_dump(FILE *file);
+
+#endif /* !STATS_H */
@@ -0,0 +1,744 @@
+/*
+ * trace.c - Record and replay tacho samples, commands, and duty cycles
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "mono.h"
+#include "ttc.h"
+#include "trace.h"
+
+
+/*
+ * Record codes. The low bits hold:
+ *
+ * CODE_EVENT	the enum trace_kind. trace_irq is followed by a byte with
+ *		TTC << 2 | timer, trace_command by the topic and the payload,
+ *		each as length and bytes, trace_connect by a byte that is 1
+ *		if the connection is up, 0 if not. All events then have the
+ *		time.
+ * CODE_READ	TTC << 4 | timer << 2 | READ_*, followed by the value
+ * CODE_DUTY	the fan, followed by the duty cycle in 1/100 %
+ * CODE_RPM	fan << 1 | tacho, followed by the RPM
+ */
+
+#define	CODE_EVENT	0x00
+#define	CODE_READ	0x40
+#define	CODE_DUTY	0x80
+#define	CODE_RPM	0xc0
+#define	CODE_MASK	0xc0
+
+#define	READ_COUNTER	0
+#define	READ_ISR	1
+#define	READ_EV		2
+#define	N_READS		3
+
+#define	N_TTCS		2
+#define	N_TIMERS	3
+
+#define	MAX_READS	1024	/* per event */
+#define	MAX_OUTPUTS	64	/* per event */
+#define	MAX_TOPIC	65535	/* MQTT's limits */
+#define	MAX_PAYLOAD	268435455
+#define	MAX_FILE	(1024 * 1024)
+
+
+struct read {
+	uint8_t ttc, timer, reg;
+	uint32_t value;
+	bool used;
+};
+
+struct output {
+	uint8_t code;
+	uint32_t value;
+	bool done;
+};
+
+
+struct trace_stats trace_stats;
+
+static const char *const kind_names[trace_n_kinds] = {
+	[trace_init]	= "init",
+	[trace_poll]	= "poll",
+	[trace_control]	= "control",
+	[trace_alarm]	= "alarm",
+	[trace_slew]	= "slew",
+	[trace_curve]	= "curve",
+	[trace_irq]	= "irq",
+	[trace_command]	= "command",
+	[trace_watchdog] = "watchdog",
+	[trace_connect]	= "connect",
+};
+
+static enum {
+	mode_off,
+	mode_record,
+	mode_replay,
+} mode = mode_off;
+
+static const char *trace_path;
+static FILE *file;
+static uint8_t traced;		/* trace_header.tachos */
+static uint64_t last_ns;	/* time of the last event */
+static uint16_t last_count[N_TTCS][N_TIMERS];
+
+/* replay */
+static uint64_t t0_ns;
+static int pending;		/* code of the next event, or EOF */
+static struct trace_event cur;
+static char *topic_buf;
+static size_t topic_size;
+static uint8_t *payload_buf;
+static size_t payload_size;
+static struct read reads[MAX_READS];
+static unsigned n_reads;
+static struct output outputs[MAX_OUTPUTS];
+static unsigned n_outputs;
+static uint32_t last_value[N_TTCS][N_TIMERS][N_READS];
+static unsigned long max_report;
+
+
+static bool is_traced(uint8_t ttc, uint8_t timer)
+{
+	return traced & 1 << (ttc * N_TIMERS + timer);
+}
+
+
+static int read_code(enum ttc_reg reg)
+{
+	switch (reg) {
+	case ttc_counter:
+		return READ_COUNTER;
+	case ttc_isr:
+		return READ_ISR;
+	case ttc_ev_reg:
+		return READ_EV;
+	default:
+		return -1;
+	}
+}
+
+
+/* ----- Recording --------------------------------------------------------- */
+
+
+static void write_failed(void)
+{
+	perror(trace_path);
+	fprintf(stderr, "%s: recording stopped\n", trace_path);
+	(void) fclose(file);
+	file = NULL;
+	ttc_trace = NULL;
+	mode = mode_off;
+}
+
+
+static void put_bytes(const void *buf, size_t len)
+{
+	if (mode == mode_record && fwrite(buf, 1, len, file) != len)
+		write_failed();
+}
+
+
+static void put_byte(uint8_t c)
+{
+	put_bytes(&c, 1);
+}
+
+
+static void put_uint(uint64_t n)
+{
+	uint8_t buf[10];
+	unsigned len = 0;
+
+	do {
+		buf[len] = n & 0x7f;
+		n >>= 7;
+		if (n)
+			buf[len] |= 0x80;
+		len++;
+	} while (n);
+	put_bytes(buf, len);
+}
+
+
+static char *slurp(const char *path, size_t *len)
+{
+	FILE *f;
+	char *buf;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	buf = malloc(MAX_FILE);
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+	*len = fread(buf, 1, MAX_FILE, f);
+	if (ferror(f)) {
+		perror(path);
+		exit(1);
+	}
+	if (!feof(f)) {
+		fprintf(stderr, "%s: too large\n", path);
+		exit(1);
+	}
+	(void) fclose(f);
+	return buf;
+}
+
+
+static void record_read(uint8_t ttc, uint8_t timer, enum ttc_reg reg,
+    uint32_t value)
+{
+	int code = read_code(reg);
+
+	if (code < 0 || !is_traced(ttc, timer))
+		return;
+	put_byte(CODE_READ | ttc << 4 | timer << 2 | code);
+	if (code == READ_COUNTER) {
+		put_uint((uint16_t) (value - last_count[ttc][timer]));
+		last_count[ttc][timer] = value;
+	} else {
+		put_uint(value);
+	}
+}
+
+
+void trace_record(const char *path, const struct trace_header *h)
+{
+	const struct trace_opt *o;
+	size_t len;
+	char *buf;
+
+	file = fopen(path, "w");
+	if (!file) {
+		perror(path);
+		exit(1);
+	}
+	trace_path = path;
+	mode = mode_record;
+	traced = h->tachos;
+
+	put_bytes(TRACE_MAGIC, strlen(TRACE_MAGIC));
+	put_uint(h->t0_ns);
+	put_uint(h->pclk);
+	put_uint(h->generation);
+	put_uint(h->tachos);
+	put_uint(h->n_opts);
+	for (o = h->opts; o != h->opts + h->n_opts; o++) {
+		put_byte(o->opt);
+		put_byte(o->file);
+		if (o->file) {
+			buf = slurp(o->arg, &len);
+			put_uint(len);
+			put_bytes(buf, len);
+			free(buf);
+		} else {
+			put_uint(o->len);
+			put_bytes(o->arg, o->len);
+		}
+	}
+
+	put_byte(CODE_EVENT | trace_init);
+	put_uint(0);
+	last_ns = h->t0_ns;
+	ttc_trace = record_read;
+}
+
+
+static void begin(enum trace_kind kind)
+{
+	put_byte(CODE_EVENT | kind);
+}
+
+
+static void begin_time(void)
+{
+	uint64_t now = mono_ns();
+
+	put_uint(now - last_ns);
+	last_ns = now;
+}
+
+
+/*
+ * We flush at each poll, so that a crash loses at most one poll interval.
+ */
+
+void trace_begin(enum trace_kind kind)
+{
+	if (mode != mode_record)
+		return;
+	if (kind == trace_poll && fflush(file) == EOF) {
+		write_failed();
+		return;
+	}
+	begin(kind);
+	begin_time();
+}
+
+
+void trace_begin_irq(uint8_t ttc, uint8_t timer)
+{
+	if (mode != mode_record)
+		return;
+	begin(trace_irq);
+	put_byte(ttc << 2 | timer);
+	begin_time();
+}
+
+
+void trace_begin_command(const char *topic, const void *payload, int len)
+{
+	size_t topic_len = strlen(topic);
+
+	if (mode != mode_record)
+		return;
+	if (len < 0)
+		len = 0;
+	begin(trace_command);
+	put_uint(topic_len);
+	put_bytes(topic, topic_len);
+	put_uint(len);
+	put_bytes(payload, len);
+	begin_time();
+}
+
+
+void trace_begin_connect(bool up)
+{
+	if (mode != mode_record)
+		return;
+	begin(trace_connect);
+	put_byte(up);
+	begin_time();
+}
+
+
+uint64_t trace_now(void)
+{
+	return mode == mode_record ? last_ns : mono_ns();
+}
+
+
+/* ----- Comparing outputs ------------------------------------------------- */
+
+
+static void mismatch(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (trace_stats.mismatches++ >= max_report)
+		return;
+	fprintf(stderr, "%.6f s: %s: ", (cur.ns - t0_ns) * 1e-9,
+	    kind_names[cur.kind]);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+
+static void describe(char *buf, size_t size, uint8_t code)
+{
+	if ((code & CODE_MASK) == CODE_DUTY)
+		snprintf(buf, size, "fan %u duty", code & 3);
+	else
+		snprintf(buf, size, "fan %u tacho %u RPM", (code >> 1) & 3,
+		    (code & 1) + 1);
+}
+
+
+static double scale(uint8_t code)
+{
+	return (code & CODE_MASK) == CODE_DUTY ? 100 : 1;
+}
+
+
+static bool agree(uint8_t code, uint32_t a, uint32_t b)
+{
+	uint32_t d = a > b ? a - b : b - a;
+
+	if ((code & CODE_MASK) == CODE_DUTY)
+		return d <= 1;
+	return d <= 1 + TRACE_RPM_TOLERANCE * (a > b ? a : b);
+}
+
+
+static void check(uint8_t code, uint32_t value)
+{
+	struct output *o;
+	char what[40];
+
+	trace_stats.outputs++;
+	describe(what, sizeof(what), code);
+	for (o = outputs; o != outputs + n_outputs; o++)
+		if (!o->done && o->code == code)
+			break;
+	if (o == outputs + n_outputs) {
+		mismatch("%s %g, none recorded", what, value / scale(code));
+		return;
+	}
+	o->done = 1;
+	if (!agree(code, value, o->value))
+		mismatch("%s %g, recorded %g", what, value / scale(code),
+		    o->value / scale(code));
+}
+
+
+static void output(uint8_t code, uint32_t value)
+{
+	if (mode == mode_record) {
+		put_byte(code);
+		put_uint(value);
+	} else if (mode == mode_replay) {
+		check(code, value);
+	}
+}
+
+
+void trace_duty(unsigned fan, double duty)
+{
+	output(CODE_DUTY | fan, lround(duty * 100));
+}
+
+
+void trace_rpm(unsigned fan, unsigned tacho, double rpm)
+{
+	output(CODE_RPM | fan << 1 | tacho, rpm < 0 ? 0 : lround(rpm));
+}
+
+
+/* ----- Replaying --------------------------------------------------------- */
+
+
+static void invalid(void)
+{
+	fprintf(stderr, "%s: invalid trace\n", trace_path);
+	exit(1);
+}
+
+
+static bool get_bytes(void *buf, size_t len)
+{
+	return fread(buf, 1, len, file) == len;
+}
+
+
+static bool get_uint(uint64_t *n)
+{
+	unsigned shift = 0;
+	int c;
+
+	*n = 0;
+	do {
+		c = getc(file);
+		if (c == EOF)
+			return 0;
+		/* the 10th byte only has room for bit 63 */
+		if (shift > 63 || (shift == 63 && (c & 0x7e)))
+			invalid();
+		*n |= (uint64_t) (c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 1;
+}
+
+
+static uint64_t header_uint(void)
+{
+	uint64_t n;
+
+	if (!get_uint(&n))
+		invalid();
+	return n;
+}
+
+
+/*
+ * A trace that was being written when fand went down can end in the middle
+ * of a record. We drop that record, and end there.
+ */
+
+static void truncated(void)
+{
+	fprintf(stderr, "%s: trace ends in the middle of a record\n",
+	    trace_path);
+	pending = EOF;
+}
+
+
+static void *grow(void *buf, size_t *size, size_t need)
+{
+	if (need <= *size)
+		return buf;
+	buf = realloc(buf, need);
+	if (!buf) {
+		perror("realloc");
+		exit(1);
+	}
+	*size = need;
+	return buf;
+}
+
+
+static bool get_event(void)
+{
+	uint64_t n, dt;
+	uint8_t tt;
+
+	cur.kind = pending & ~CODE_MASK;
+	if (cur.kind >= trace_n_kinds)
+		invalid();
+	switch (cur.kind) {
+	case trace_irq:
+		if (!get_bytes(&tt, 1))
+			return 0;
+		cur.ttc = tt >> 2;
+		cur.timer = tt & 3;
+		if (cur.ttc >= N_TTCS || cur.timer >= N_TIMERS)
+			invalid();
+		break;
+	case trace_command:
+		if (!get_uint(&n))
+			return 0;
+		if (n > MAX_TOPIC)
+			invalid();
+		topic_buf = grow(topic_buf, &topic_size, n + 1);
+		if (!get_bytes(topic_buf, n))
+			return 0;
+		topic_buf[n] = 0;
+		cur.topic = topic_buf;
+		if (!get_uint(&n))
+			return 0;
+		if (n > MAX_PAYLOAD)
+			invalid();
+		payload_buf = grow(payload_buf, &payload_size, n + 1);
+		if (!get_bytes(payload_buf, n))
+			return 0;
+		cur.payload = payload_buf;
+		cur.len = n;
+		break;
+	case trace_connect:
+		if (!get_bytes(&tt, 1))
+			return 0;
+		if (tt > 1)
+			invalid();
+		cur.up = tt;
+		break;
+	default:
+		break;
+	}
+	if (!get_uint(&dt))
+		return 0;
+	last_ns += dt;
+	cur.ns = last_ns;
+	return 1;
+}
+
+
+static bool get_read(uint8_t code)
+{
+	struct read *r = reads + n_reads;
+	uint64_t value;
+
+	if (n_reads == MAX_READS)
+		invalid();
+	r->ttc = code >> 4 & 3;
+	r->timer = code >> 2 & 3;
+	r->reg = code & 3;
+	if (r->ttc >= N_TTCS || r->timer >= N_TIMERS || r->reg >= N_READS)
+		invalid();
+	if (!get_uint(&value))
+		return 0;
+	if (r->reg == READ_COUNTER) {
+		value = (uint16_t) (last_count[r->ttc][r->timer] + value);
+		last_count[r->ttc][r->timer] = value;
+	}
+	r->value = value;
+	r->used = 0;
+	n_reads++;
+	return 1;
+}
+
+
+static bool get_output(uint8_t code)
+{
+	struct output *o = outputs + n_outputs;
+	uint64_t value;
+
+	if (n_outputs == MAX_OUTPUTS)
+		invalid();
+	if (!get_uint(&value))
+		return 0;
+	o->code = code;
+	o->value = value;
+	o->done = 0;
+	n_outputs++;
+	return 1;
+}
+
+
+/*
+ * Read the event whose code is in "pending", and everything up to the next
+ * event. Returns 0 if the trace ends within the event itself.
+ */
+
+static bool read_event(void)
+{
+	int c;
+
+	n_reads = 0;
+	n_outputs = 0;
+	if (!get_event()) {
+		truncated();
+		return 0;
+	}
+	while (1) {
+		c = getc(file);
+		if (c == EOF || (c & CODE_MASK) == CODE_EVENT) {
+			pending = c;
+			return 1;
+		}
+		if (!((c & CODE_MASK) == CODE_READ ? get_read(c) :
+		    get_output(c))) {
+			truncated();
+			return 1;
+		}
+	}
+}
+
+
+static void finish_event(void)
+{
+	const struct output *o;
+	char what[40];
+
+	for (o = outputs; o != outputs + n_outputs; o++)
+		if (!o->done) {
+			describe(what, sizeof(what), o->code);
+			mismatch("%s %g recorded, but not output", what,
+			    o->value / scale(o->code));
+		}
+}
+
+
+/*
+ * Serve reads from the event's reads, in order. Registers the event did not
+ * read (e.g., because the code has changed) keep their last value, except
+ * for TTC_ISR, which clears on read.
+ */
+
+static bool replay_read(uint8_t ttc, uint8_t timer, enum ttc_reg reg,
+    uint32_t *value)
+{
+	int code = read_code(reg);
+	struct read *r;
+
+	if (code < 0 || !is_traced(ttc, timer))
+		return 0;
+	for (r = reads; r != reads + n_reads; r++)
+		if (!r->used && r->ttc == ttc && r->timer == timer &&
+		    r->reg == code) {
+			r->used = 1;
+			trace_stats.reads++;
+			last_value[ttc][timer][code] = r->value;
+			break;
+		}
+	*value = last_value[ttc][timer][code];
+	if (code == READ_ISR)
+		last_value[ttc][timer][code] = 0;
+	return 1;
+}
+
+
+void trace_replay(const char *path, struct trace_header *h,
+    unsigned long max)
+{
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	struct trace_opt *o;
+	char *buf;
+	int c;
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		exit(1);
+	}
+	trace_path = path;
+	max_report = max;
+	if (!get_bytes(magic, sizeof(magic)) ||
+	    memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+		fprintf(stderr, "%s: not a fand trace\n", path);
+		exit(1);
+	}
+	h->t0_ns = header_uint();
+	h->pclk = header_uint();
+	h->generation = header_uint();
+	h->tachos = header_uint();
+	h->n_opts = header_uint();
+	if (h->n_opts > TRACE_MAX_OPTS)
+		invalid();
+	for (o = h->opts; o != h->opts + h->n_opts; o++) {
+		c = getc(file);
+		if (c == EOF)
+			invalid();
+		o->opt = c;
+		c = getc(file);
+		if (c == EOF)
+			invalid();
+		o->file = c;
+		o->len = header_uint();
+		if (o->len > MAX_FILE)
+			invalid();
+		buf = malloc(o->len + 1);
+		if (!buf) {
+			perror("malloc");
+			exit(1);
+		}
+		if (!get_bytes(buf, o->len))
+			invalid();
+		buf[o->len] = 0;
+		o->arg = buf;
+	}
+
+	traced = h->tachos;
+	t0_ns = last_ns = h->t0_ns;
+	pending = getc(file);
+	if (pending != (CODE_EVENT | trace_init) || !read_event())
+		invalid();
+	trace_stats.events++;
+	mono_set(cur.ns);
+	ttc_replay = replay_read;
+	mode = mode_replay;
+}
+
+
+bool trace_next(struct trace_event *ev)
+{
+	finish_event();
+	n_outputs = 0;
+	if (pending == EOF || !read_event())
+		return 0;
+	trace_stats.events++;
+	mono_set(cur.ns);
+	*ev = cur;
+	return 1;
+}
@@ -0,0 +1,141 @@
+/*
+ * trace.h - Record and replay tacho samples, commands, and duty cycles
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef TRACE_H
+#define	TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * A trace is a sequence of events: timer ticks, tacho interrupts, MQTT
+ * messages, and the broker connection coming up or going down. Each event is
+ * followed by its inputs, the values read from the tacho timers' counter,
+ * interrupt status, and event registers, and by its outputs, the duty cycles
+ * written and the RPM readings of polls. The first event (trace_init) covers
+ * fand's setup.
+ *
+ * Replaying runs each event at the time it was recorded, with the recorded
+ * register values, and compares the outputs with the recorded ones. Since
+ * fand read the registers a little after the event began, RPM values may
+ * differ slightly; we accept TRACE_RPM_TOLERANCE.
+ *
+ * File format: the magic, then the header, then the records, each beginning
+ * with a code byte. Integers are LEB128-coded, times relative to the previous
+ * event, and TTC_COUNTER values relative to the previous value read from the
+ * same counter. See trace.c for the codes.
+ */
+
+#define	TRACE_MAGIC		"fandtrc2"
+
+#define	TRACE_MAX_OPTS		32
+#define	TRACE_RPM_TOLERANCE	0.001	/* relative, plus 1 RPM */
+
+enum trace_kind {
+	trace_init,
+	trace_poll,
+	trace_control,
+	trace_alarm,
+	trace_slew,
+	trace_curve,
+	trace_irq,
+	trace_command,
+	trace_watchdog,
+	trace_connect,
+	trace_n_kinds
+};
+
+/*
+ * The header has what is needed to set up fand as it was: the cpu_1x
+ * frequency, the board generation, and the command-line options that affect
+ * control. For options whose argument is a file (e.g., -C), the trace holds
+ * the content of the file.
+ */
+
+struct trace_opt {
+	char opt;
+	bool file;
+	const char *arg;	/* file content if "file" */
+	size_t len;
+};
+
+struct trace_header {
+	uint64_t t0_ns;		/* CLOCK_MONOTONIC of the trace_init event */
+	unsigned long pclk;
+	unsigned generation;
+	uint8_t tachos;		/* bit 3 * TTC + timer: a tacho timer */
+	unsigned n_opts;
+	struct trace_opt opts[TRACE_MAX_OPTS];
+};
+
+struct trace_event {
+	enum trace_kind kind;
+	uint64_t ns;
+	uint8_t ttc, timer;	/* trace_irq */
+	const char *topic;	/* trace_command */
+	const void *payload;
+	int len;
+	bool up;		/* trace_connect */
+};
+
+struct trace_stats {
+	unsigned long events;
+	unsigned long reads;
+	unsigned long outputs;	/* compared */
+	unsigned long mismatches;
+};
+
+
+extern struct trace_stats trace_stats;
+
+
+/*
+ * Recording. Only reads from the timers in h->tachos are recorded. If
+ * writing fails, we report it and stop recording, but carry on otherwise.
+ */
+
+void trace_record(const char *path, const struct trace_header *h);
+
+/*
+ * Called at the beginning of each event, and with each output. They do
+ * nothing unless recording, except for the outputs when replaying.
+ */
+
+void trace_begin(enum trace_kind kind);
+void trace_begin_irq(uint8_t ttc, uint8_t timer);
+void trace_begin_command(const char *topic, const void *payload, int len);
+void trace_begin_connect(bool up);
+
+void trace_duty(unsigned fan, double duty);
+void trace_rpm(unsigned fan, unsigned tacho, double rpm);
+
+/*
+ * The time of the current event, which is what mono_ns returns when
+ * replaying. Code that decides by comparing times (e.g., whether a reading is
+ * stale) uses this instead of mono_ns, so that the replay decides the same.
+ * Without a trace, this is mono_ns.
+ */
+
+uint64_t trace_now(void);
+
+/*
+ * Replaying. trace_replay reads the header and the trace_init event, and
+ * sets the clock (mono_set). Each trace_next checks that the previous event
+ * produced all its outputs, then reads the next event, and sets the clock to
+ * its time. Mismatches are printed on stderr, the first "max_report" of them,
+ * and counted in trace_stats. Exits if the trace is invalid.
+ */
+
+void trace_replay(const char *path, struct trace_header *h,
+    unsigned long max_report);
+bool trace_next(struct trace_event *ev);
+
+#endif /* !TRACE_H */
@@ -7,18 +7,126 @@
  * A copy of the license can be found in the file COPYING.txt
  */
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #include "regmap.h"
 #include "ttc.h"
 
 
+#define	N_TTCS		2
+#define	N_TIMERS	3
+
+
+struct reg {
+	uint8_t offset;
+	bool shadow;
+};
+
+
 volatile void *ttc_base;
+void (*ttc_trace)(uint8_t ttc, uint8_t timer, enum ttc_reg reg,
+    uint32_t value) = NULL;
+bool (*ttc_replay)(uint8_t ttc, uint8_t timer, enum ttc_reg reg,
+    uint32_t *value) = NULL;
 
 static unsigned ref = 0;
 static struct regmap ttc_map;
 
+static const struct reg regs[ttc_n_regs] = {
+	[ttc_clk_ctrl]	= { 0x00, 1 },
+	[ttc_cnt_ctrl]	= { 0x0c, 1 },
+	[ttc_counter]	= { 0x18, 0 },
+	[ttc_interval]	= { 0x24, 1 },
+	[ttc_match_1]	= { 0x30, 1 },
+	[ttc_match_2]	= { 0x3c, 1 },
+	[ttc_match_3]	= { 0x48, 1 },
+	[ttc_isr]	= { 0x54, 0 },
+	[ttc_ier]	= { 0x60, 1 },
+	[ttc_ev_ctrl]	= { 0x6c, 1 },
+	[ttc_ev_reg]	= { 0x78, 0 },
+};
+
+static uint32_t shadow[N_TTCS][N_TIMERS][ttc_n_regs];
+static bool valid[N_TTCS][N_TIMERS][ttc_n_regs];
+
+
+static volatile uint32_t *reg(uint8_t ttc, uint8_t timer, enum ttc_reg r)
+{
+	assert(ttc < N_TTCS && timer < N_TIMERS);
+	return (volatile uint32_t *)
+	    (ttc_base + ttc * 0x1000 + regs[r].offset + timer * 4);
+}
+
+
+static uint32_t hw_read(uint8_t ttc, uint8_t timer, enum ttc_reg r)
+{
+	regmap_stats.reads++;
+	return *reg(ttc, timer, r);
+}
+
+
+uint32_t ttc_get(uint8_t ttc, uint8_t timer, enum ttc_reg r)
+{
+	uint32_t v;
+
+	if (!regs[r].shadow) {
+		if (ttc_replay && ttc_replay(ttc, timer, r, &v))
+			return v;
+		v = hw_read(ttc, timer, r);
+		if (ttc_trace)
+			ttc_trace(ttc, timer, r, v);
+		return v;
+	}
+	if (!valid[ttc][timer][r]) {
+		shadow[ttc][timer][r] = hw_read(ttc, timer, r);
+		valid[ttc][timer][r] = 1;
+	} else if (regmap_verify) {
+		v = hw_read(ttc, timer, r);
+		if (v != shadow[ttc][timer][r]) {
+			fprintf(stderr,
+			    "TTC%u timer %u register 0x%02x: shadow 0x%x, "
+			    "hardware 0x%x\n", ttc, timer, regs[r].offset,
+			    shadow[ttc][timer][r], v);
+			regmap_stats.mismatches++;
+			shadow[ttc][timer][r] = v;
+		}
+	}
+	return shadow[ttc][timer][r];
+}
+
+
+void ttc_write(uint8_t ttc, uint8_t timer, enum ttc_reg r, uint32_t value)
+{
+	regmap_stats.writes++;
+	*reg(ttc, timer, r) = value;
+	if (regs[r].shadow) {
+		shadow[ttc][timer][r] = value;
+		valid[ttc][timer][r] = 1;
+	}
+}
+
+
+void ttc_set(uint8_t ttc, uint8_t timer, enum ttc_reg r, uint32_t value)
+{
+	if (regs[r].shadow && valid[ttc][timer][r] &&
+	    ttc_get(ttc, timer, r) == value) {
+		regmap_stats.skipped++;
+		return;
+	}
+	ttc_write(ttc, timer, r, value);
+}
+
+
+void ttc_forget(void)
+{
+	memset(valid, 0, sizeof(valid));
+}
+
 
 void ttc_open(void)
 {
@@ -35,4 +143,5 @@ void ttc_close(void)
 		return;
 	regmap_close(&ttc_map);
 	ttc_base = NULL;
+	ttc_forget();
 }
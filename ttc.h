@@ -10,6 +10,9 @@
 #ifndef TTC_H
 #define	TTC_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #define	TTC_BASE	0xF8001000
 #define	TTC_SIZE	(0x1000 + 0x84)
 
@@ -89,8 +92,56 @@
 	(*(volatile uint32_t *) (ttc_base + 0x78 + (ttc) * 0x1000 + (t) * 4))
 
 
+/*
+ * Counted register access. Configuration registers, which only we change, are
+ * shadowed: ttc_get returns the shadow copy, and ttc_set skips writes that
+ * would not change the value. The other registers (TTC_COUNTER, TTC_ISR,
+ * TTC_EV_REG) always go to the hardware.
+ *
+ * ttc_write always writes, for cases where the hardware may have changed a
+ * shadowed register behind our back.
+ */
+
+enum ttc_reg {
+	ttc_clk_ctrl,
+	ttc_cnt_ctrl,
+	ttc_counter,
+	ttc_interval,
+	ttc_match_1,
+	ttc_match_2,
+	ttc_match_3,
+	ttc_isr,
+	ttc_ier,
+	ttc_ev_ctrl,
+	ttc_ev_reg,
+	ttc_n_regs
+};
+
+
 extern volatile void *ttc_base;
 
+/*
+ * For recording and replaying traces: if set, ttc_trace is called with each
+ * value read from a register that is not shadowed. If ttc_replay is set, it
+ * can supply such a value instead of the hardware, and returns 1 if it does.
+ */
+
+extern void (*ttc_trace)(uint8_t ttc, uint8_t timer, enum ttc_reg reg,
+    uint32_t value);
+extern bool (*ttc_replay)(uint8_t ttc, uint8_t timer, enum ttc_reg reg,
+    uint32_t *value);
+
+
+uint32_t ttc_get(uint8_t ttc, uint8_t timer, enum ttc_reg reg);
+void ttc_set(uint8_t ttc, uint8_t timer, enum ttc_reg reg, uint32_t value);
+void ttc_write(uint8_t ttc, uint8_t timer, enum ttc_reg reg, uint32_t value);
+
+/*
+ * Drop the shadow copies, e.g., after another process has written the
+ * registers. The next access of each register reads the hardware.
+ */
+
+void ttc_forget(void);
 
 void ttc_open(void);
 void ttc_close(void);
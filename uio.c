@@ -0,0 +1,180 @@
+/*
+ * uio.c - Userspace I/O (UIO) interrupts
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "uio.h"
+
+
+#define	UIO_CLASS	"/sys/class/uio"
+#define	MAX_MAPS	5	/* MAX_UIO_MAPS in the kernel */
+
+
+static int name_matches(const char *dev, const char *name)
+{
+	char path[300];
+	char buf[100];
+	FILE *file;
+	char *nl;
+	int ok = 0;
+
+	snprintf(path, sizeof(path), UIO_CLASS "/%s/name", dev);
+	file = fopen(path, "r");
+	if (!file)
+		return 0;
+	if (fgets(buf, sizeof(buf), file)) {
+		nl = strchr(buf, '\n');
+		if (nl)
+			*nl = 0;
+		ok = !strcmp(buf, name);
+	}
+	(void) fclose(file);
+	return ok;
+}
+
+
+int uio_open(const char *name)
+{
+	const struct dirent *de;
+	char path[300];
+	DIR *dir;
+	int fd = -1;
+
+	dir = opendir(UIO_CLASS);
+	if (!dir)
+		return -1;
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "uio", 3))
+			continue;
+		if (!name_matches(de->d_name, name))
+			continue;
+		snprintf(path, sizeof(path), "/dev/%s", de->d_name);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			perror(path);
+			exit(1);
+		}
+		break;
+	}
+	(void) closedir(dir);
+	return fd;
+}
+
+
+static bool read_ulong(const char *path, unsigned long *res)
+{
+	FILE *file;
+	bool ok;
+
+	file = fopen(path, "r");
+	if (!file)
+		return 0;
+	ok = fscanf(file, "%li", res) == 1;
+	(void) fclose(file);
+	return ok;
+}
+
+
+/*
+ * Each map has a directory /sys/class/uio/uioN/maps/mapM/ with the files
+ * "addr", "size", and "offset" (the offset of "addr" in its page).
+ */
+
+static bool map_matches(const char *dev, unsigned index, unsigned long addr,
+    size_t *size)
+{
+	unsigned long page = getpagesize();
+	unsigned long map_addr, map_size, offset;
+	char path[300];
+
+	snprintf(path, sizeof(path), UIO_CLASS "/%s/maps/map%u/addr",
+	    dev, index);
+	if (!read_ulong(path, &map_addr))
+		return 0;
+	snprintf(path, sizeof(path), UIO_CLASS "/%s/maps/map%u/size",
+	    dev, index);
+	if (!read_ulong(path, &map_size))
+		return 0;
+	snprintf(path, sizeof(path), UIO_CLASS "/%s/maps/map%u/offset",
+	    dev, index);
+	if (!read_ulong(path, &offset))
+		offset = map_addr & (page - 1);
+	if (map_addr - offset != addr)
+		return 0;
+	*size = (map_size + offset + page - 1) & ~(page - 1);
+	return 1;
+}
+
+
+int uio_find_map(unsigned long addr, unsigned *index, size_t *size)
+{
+	const struct dirent *de;
+	char path[300];
+	DIR *dir;
+	unsigned i;
+	int fd = -1;
+
+	dir = opendir(UIO_CLASS);
+	if (!dir)
+		return -1;
+	while (fd < 0 && (de = readdir(dir))) {
+		if (strncmp(de->d_name, "uio", 3))
+			continue;
+		for (i = 0; i != MAX_MAPS; i++)
+			if (map_matches(de->d_name, i, addr, size))
+				break;
+		if (i == MAX_MAPS)
+			continue;
+		snprintf(path, sizeof(path), "/dev/%s", de->d_name);
+		fd = open(path, O_RDWR | O_SYNC | O_CLOEXEC);
+		if (fd < 0) {
+			perror(path);
+			exit(1);
+		}
+		*index = i;
+	}
+	(void) closedir(dir);
+	return fd;
+}
+
+
+uint32_t uio_ack(int fd)
+{
+	uint32_t count;
+	ssize_t got;
+
+	got = read(fd, &count, sizeof(count));
+	if (got < 0) {
+		perror("read(uio)");
+		exit(1);
+	}
+	if (got != sizeof(count)) {
+		fprintf(stderr, "uio: short read (%d)\n", (int) got);
+		exit(1);
+	}
+	return count;
+}
+
+
+void uio_unmask(int fd)
+{
+	const uint32_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+		perror("write(uio)");
+		exit(1);
+	}
+}
@@ -0,0 +1,48 @@
+/*
+ * uio.h - Userspace I/O (UIO) interrupts
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef UIO_H
+#define	UIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/*
+ * Open the UIO device with the given name (as in /sys/class/uio/uio*\/name).
+ * Returns -1 if there is no such device.
+ */
+
+int uio_open(const char *name);
+
+/*
+ * Find the UIO map whose first page is at physical address "addr". Returns
+ * the open device, or -1 if there is no such map. "index" is the number of
+ * the map, "size" its size rounded up to full pages.
+ *
+ * @@@ UIO can only map a region from its beginning, so we cannot use a map
+ * that merely contains "addr".
+ */
+
+int uio_find_map(unsigned long addr, unsigned *index, size_t *size);
+
+/*
+ * Acknowledge an interrupt. Returns the total interrupt count.
+ */
+
+uint32_t uio_ack(int fd);
+
+/*
+ * (Re-)enable the interrupt. uio_pdrv_genirq masks the interrupt when it
+ * fires.
+ */
+
+void uio_unmask(int fd);
+
+#endif /* !UIO_H */
@@ -0,0 +1,368 @@
+/*
+ * watchdog.c - Deadlines that force the fans to full speed when missed
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#include "mono.h"
+#include "conf.h"
+#include "watchdog.h"
+
+
+#define	QUIT		'q'	/* sent to the guard on a clean exit */
+
+
+/*
+ * Shared between fand and the guard. Times are in milliseconds, so that they
+ * can be written and read atomically on 32-bit CPUs. They wrap after 49
+ * days, which differences between them do not mind.
+ */
+
+struct shared {
+	volatile uint32_t heartbeat_ms;	/* last watchdog_check */
+	volatile uint32_t fired;	/* interventions of the guard */
+	volatile uint32_t reaction_us;	/* of the last intervention */
+};
+
+
+const char *const watchdog_names[watchdog_n_deadlines] = {
+	[watchdog_loop]		= "loop",
+	[watchdog_broker]	= "broker",
+	[watchdog_input]	= "input",
+};
+
+static double deadline_s[watchdog_n_deadlines];	/* 0 if off */
+static double check_s = WATCHDOG_DEFAULT_CHECK_S;
+
+static uint64_t seen_ns[watchdog_n_deadlines];
+static struct shared *shared;
+static uint32_t fired_seen;
+static int guard_fd = -1;	/* our end of the pipe to the guard */
+static pid_t guard_pid;
+
+
+static uint32_t ms(uint64_t ns)
+{
+	return ns / 1000000;
+}
+
+
+/* ----- Configuration ----------------------------------------------------- */
+
+
+static double number(const char *s, const char *what)
+{
+	char *end;
+	double n;
+
+	n = strtod(s, &end);
+	if (end == s || *end || n <= 0)
+		conf_error("invalid %s \"%s\"", what, s);
+	return n;
+}
+
+
+static void conf_watchdog(int argc, char *const *argv)
+{
+	unsigned d;
+	int i;
+
+	if (argc & 1)
+		conf_error("settings come in pairs");
+	for (i = 0; i != argc; i += 2) {
+		const char *name = argv[i];
+		const char *value = argv[i + 1];
+
+		if (!strcmp(name, "check")) {
+			check_s = number(value, name) / 1000;
+			continue;
+		}
+		for (d = 0; d != watchdog_n_deadlines; d++)
+			if (!strcmp(name, watchdog_names[d]))
+				break;
+		if (d == watchdog_n_deadlines)
+			conf_error("unknown setting \"%s\"", name);
+		deadline_s[d] = number(value, name);
+	}
+}
+
+
+const struct conf_keyword watchdog_conf[] = {
+	{ "watchdog",	2, 8,	conf_watchdog },
+	{ NULL, 0, 0, NULL }
+};
+
+
+bool watchdog_enabled(void)
+{
+	unsigned d;
+
+	for (d = 0; d != watchdog_n_deadlines; d++)
+		if (deadline_s[d])
+			return 1;
+	return 0;
+}
+
+
+double watchdog_check_s(void)
+{
+	return check_s;
+}
+
+
+/* ----- Guard process ----------------------------------------------------- */
+
+
+/*
+ * If fand runs with real-time priority, the guard runs just above it, so that
+ * fand cannot keep it from running, even on the same core.
+ */
+
+static void guard_setup(void)
+{
+	struct sched_param param;
+
+	signal(SIGINT, SIG_IGN);	/* fand tells us when it stops */
+	signal(SIGTERM, SIG_IGN);
+	if (sched_getscheduler(0) != SCHED_FIFO)
+		return;
+	if (sched_getparam(0, &param) < 0) {
+		perror("sched_getparam");
+		_exit(1);
+	}
+	if (param.sched_priority < sched_get_priority_max(SCHED_FIFO))
+		param.sched_priority++;
+	if (sched_setparam(0, &param) < 0) {
+		perror("sched_setparam");
+		_exit(1);
+	}
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		perror("mlockall");
+		_exit(1);
+	}
+}
+
+
+static void intervene(void (*full)(void), uint64_t due_ns)
+{
+	uint64_t now;
+
+	full();
+	now = mono_ns();
+	shared->reaction_us = now > due_ns ? (now - due_ns) / 1000 : 0;
+	shared->fired++;
+}
+
+
+/*
+ * We only use the PWM registers (through "full") and the pipe. We leave with
+ * _exit, so that we don't flush stdio buffers we share with fand.
+ */
+
+static void __attribute__((noreturn)) guard(int fd, void (*full)(void))
+{
+	struct pollfd pfd = {
+		.fd	= fd,
+		.events	= POLLIN,
+	};
+	int timeout_ms = check_s * 1000 > 1 ? check_s * 1000 : 1;
+	uint32_t limit_ms = deadline_s[watchdog_loop] * 1000;
+	bool tripped = 0;
+	uint64_t now;
+	uint32_t age;
+	char c;
+	int n;
+
+	guard_setup();
+	while (1) {
+		n = poll(&pfd, 1, timeout_ms);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			full();
+			_exit(1);
+		}
+		if (n) {
+			if (read(fd, &c, 1) == 1 && c == QUIT)
+				_exit(0);
+			/* EOF: fand is gone */
+			intervene(full, mono_ns());
+			fprintf(stderr, "fand exited, fans at 100%%\n");
+			_exit(1);
+		}
+		now = mono_ns();
+		age = ms(now) - shared->heartbeat_ms;
+		if (age <= limit_ms) {
+			tripped = 0;
+			continue;
+		}
+		if (tripped)
+			continue;
+		intervene(full, now - (uint64_t) (age - limit_ms) * 1000000);
+		tripped = 1;
+	}
+}
+
+
+/*
+ * The guard inherits all of fand's file descriptors: the broker socket, the
+ * event loop's, UIO devices, etc. We close all but stdin, stdout, stderr,
+ * and our end of the pipe, so that the guard does not keep them open, e.g.,
+ * the connection to the broker after fand is gone. The register mappings
+ * remain.
+ */
+
+static void close_fds(int keep)
+{
+	struct dirent *de;
+	DIR *dir;
+	long max;
+	int fd;
+
+	dir = opendir("/proc/self/fd");
+	if (!dir) {
+		max = sysconf(_SC_OPEN_MAX);
+		for (fd = 3; fd < max; fd++)
+			if (fd != keep)
+				(void) close(fd);
+		return;
+	}
+	while ((de = readdir(dir))) {
+		fd = atoi(de->d_name);
+		if (fd > 2 && fd != keep && fd != dirfd(dir))
+			(void) close(fd);
+	}
+	(void) closedir(dir);
+}
+
+
+static void start_guard(void (*full)(void))
+{
+	int fds[2];
+
+	if (deadline_s[watchdog_loop] <= 2 * check_s) {
+		fprintf(stderr,
+		    "watchdog loop deadline must exceed twice the check "
+		    "interval\n");
+		exit(1);
+	}
+	shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	shared->heartbeat_ms = ms(mono_ns());
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	guard_pid = fork();
+	if (guard_pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (!guard_pid) {
+		close_fds(fds[0]);
+		guard(fds[0], full);
+	}
+	(void) close(fds[0]);
+	guard_fd = fds[1];
+}
+
+
+/* ----- Deadlines --------------------------------------------------------- */
+
+
+void watchdog_start(void (*full)(void))
+{
+	uint64_t now = mono_ns();
+	unsigned d;
+
+	for (d = 0; d != watchdog_n_deadlines; d++)
+		seen_ns[d] = now;
+	if (full && deadline_s[watchdog_loop])
+		start_guard(full);
+}
+
+
+void watchdog_stop(void)
+{
+	char c = QUIT;
+
+	if (guard_fd < 0)
+		return;
+	/* if the guard is gone, we get EPIPE (SIGPIPE is ignored) */
+	if (write(guard_fd, &c, 1) < 0)
+		perror("watchdog guard");
+	(void) close(guard_fd);
+	guard_fd = -1;
+}
+
+
+void watchdog_seen(enum watchdog_deadline d, uint64_t now)
+{
+	seen_ns[d] = now;
+}
+
+
+unsigned watchdog_check(uint64_t now, uint64_t *expired_ns)
+{
+	unsigned missed = 0;
+	uint64_t due;
+	unsigned d;
+
+	if (shared)
+		shared->heartbeat_ms = ms(now);
+	seen_ns[watchdog_loop] = now;
+	*expired_ns = now;
+	for (d = 0; d != watchdog_n_deadlines; d++) {
+		if (!deadline_s[d])
+			continue;
+		due = seen_ns[d] + deadline_s[d] * 1e9;
+		if (now <= due)
+			continue;
+		missed |= 1 << d;
+		if (due < *expired_ns)
+			*expired_ns = due;
+	}
+	if (guard_pid > 0 && waitpid(guard_pid, NULL, WNOHANG) == guard_pid) {
+		fprintf(stderr, "watchdog guard has exited\n");
+		guard_pid = 0;
+	}
+	return missed;
+}
+
+
+bool watchdog_guard_fired(uint64_t *reaction_ns)
+{
+	uint32_t fired;
+
+	if (!shared)
+		return 0;
+	fired = shared->fired;
+	if (fired == fired_seen)
+		return 0;
+	fired_seen = fired;
+	*reaction_ns = (uint64_t) shared->reaction_us * 1000;
+	return 1;
+}
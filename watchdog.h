@@ -0,0 +1,99 @@
+/*
+ * watchdog.h - Deadlines that force the fans to full speed when missed
+ *
+ * Copyright (C) 2021 Linzhi Ltd.
+ *
+ * This work is licensed under the terms of the MIT License.
+ * A copy of the license can be found in the file COPYING.txt
+ */
+
+#ifndef WATCHDOG_H
+#define	WATCHDOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "conf.h"
+
+
+enum watchdog_deadline {
+	watchdog_loop,		/* the event loop ran */
+	watchdog_broker,	/* we were connected to the MQTT broker */
+	watchdog_input,		/* a command or sensor reading arrived */
+	watchdog_n_deadlines
+};
+
+#define	WATCHDOG_DEFAULT_CHECK_S	0.1
+
+
+/*
+ * Configuration:
+ *
+ * watchdog SETTING VALUE ...
+ *	Settings:
+ *
+ *	loop S		the event loop must run at least every S seconds. A
+ *			separate guard process watches this, and also acts if
+ *			fand exits without stopping it (e.g., on a crash or
+ *			SIGKILL). Default: off.
+ *	broker S	the connection to the MQTT broker may be down for up
+ *			to S seconds. Default: off.
+ *	input S		a command or sensor reading must arrive at least
+ *			every S seconds. Default: off.
+ *	check MS	check the deadlines this often. This bounds the time
+ *			from a missed deadline to full speed. Default: 100 ms.
+ */
+
+extern const struct conf_keyword watchdog_conf[];
+
+
+extern const char *const watchdog_names[watchdog_n_deadlines];
+
+
+/*
+ * 1 if any deadline is configured.
+ */
+
+bool watchdog_enabled(void);
+
+double watchdog_check_s(void);
+
+/*
+ * Start the deadlines. If "full" is not NULL and the loop deadline is set,
+ * fork the guard process, which calls "full" to run all fans at 100% when
+ * the loop misses its deadline, or when fand is gone.
+ */
+
+void watchdog_start(void (*full)(void));
+
+/*
+ * Tell the guard we are exiting on purpose, and that it should leave the
+ * fans alone.
+ */
+
+void watchdog_stop(void);
+
+/*
+ * Record that the condition of a deadline was met at "now".
+ */
+
+void watchdog_seen(enum watchdog_deadline d, uint64_t now);
+
+/*
+ * Check the deadlines, and tell the guard that the loop runs. Returns a bit
+ * mask (1 << enum watchdog_deadline) of the deadlines missed, and the time
+ * the first of them expired in "expired_ns".
+ */
+
+unsigned watchdog_check(uint64_t now, uint64_t *expired_ns);
+
+/*
+ * If the guard has run the fans at full speed since the last call, returns
+ * 1 and the time it took to react, from the deadline to the last register
+ * write, in "reaction_ns". The guard has then written to the PWM registers
+ * behind our back.
+ */
+
+bool watchdog_guard_fired(uint64_t *reaction_ns);
+
+#endif /* !WATCHDOG_H */